@@ -0,0 +1,48 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PROXINJECT_BENCH_BENCH
+#define PROXINJECT_BENCH_BENCH
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+// results of measured calls are added up here, so that the compiler cannot
+// drop the calls as unused
+inline volatile std::uint64_t bench_sink = 0;
+
+// prints the mean time of `ops` operations that took `elapsed` in total
+inline void report(const char *name, std::size_t ops,
+                   std::chrono::steady_clock::duration elapsed) {
+  auto ns = std::chrono::duration<double, std::nano>(elapsed).count() /
+            (double)ops;
+  std::printf("%-44s %10.1f ns/op %14.0f op/s\n", name, ns, 1e9 / ns);
+}
+
+// runs `f(i)` for i in [0, iterations) and prints the mean time per call
+template <typename F>
+void measure(const char *name, std::size_t iterations, F &&f) {
+  std::uint64_t sum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < iterations; ++i) {
+    sum += (std::uint64_t)f(i);
+  }
+  report(name, iterations, std::chrono::steady_clock::now() - start);
+  bench_sink = bench_sink + sum;
+}
+
+#endif
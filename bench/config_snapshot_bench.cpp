@@ -0,0 +1,69 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bench.hpp"
+#include <client.hpp>
+#include <thread>
+#include <vector>
+
+// cost of loading the config snapshot as every hooked call does, alone and
+// from several threads while the config is replaced once a millisecond
+
+int main() {
+  InjectorConfig cfg;
+  cfg["addr"_f] = from_asio(localhost, 1080);
+  cfg["log"_f] = true;
+
+  injectee_config config;
+  config.set(cfg);
+
+  measure("config get", 1 << 24,
+          [&](std::size_t) { return config.get()->log; });
+
+  constexpr std::size_t loads = 1 << 22;
+  for (std::size_t readers : {1, 4, 8}) {
+    std::atomic<bool> stop = false;
+    std::thread writer([&] {
+      while (!stop) {
+        config.set(cfg);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (std::size_t r = 0; r < readers; ++r) {
+      threads.emplace_back([&] {
+        std::uint64_t sum = 0;
+        for (std::size_t i = 0; i < loads / readers; ++i) {
+          sum += config.get()->upstreams.size();
+        }
+        bench_sink = bench_sink + sum;
+      });
+    }
+    for (auto &t : threads) {
+      t.join();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    stop = true;
+    writer.join();
+
+    char name[64];
+    std::snprintf(name, sizeof(name), "config get under set (readers: %zu)",
+                  readers);
+    report(name, loads, elapsed);
+  }
+}
@@ -0,0 +1,56 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bench.hpp"
+#include <domain_table.hpp>
+#include <random>
+#include <string>
+#include <vector>
+
+// domain_table lookups over 50000 random exact and wildcard rules, for names
+// under a rule and for names matching none
+
+int main() {
+  std::mt19937 gen(1);
+  const char *tlds[] = {"com", "net", "org", "io", "cn", "de"};
+
+  std::vector<DomainRule> rules;
+  std::vector<std::string> hits, misses;
+  for (int i = 0; i < 50000; ++i) {
+    auto name = "d" + std::to_string(gen() % 100000) + "." + tlds[gen() % 6];
+
+    DomainRule rule;
+    rule["pattern"_f] = gen() % 2 ? "*." + name : "." + name;
+    rule["action"_f] = (std::uint32_t)(gen() % 3);
+    rules.push_back(rule);
+
+    hits.push_back("www.cdn." + name);
+    misses.push_back("www.cdn.m" + std::to_string(gen()) + ".example");
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  domain_table table(rules);
+  report("domain_table build (per rule)", rules.size(),
+         std::chrono::steady_clock::now() - start);
+
+  measure("domain_table lookup, hit (50000 rules)", 1 << 22,
+          [&](std::size_t i) {
+            return table.lookup(hits[i % hits.size()]).has_value();
+          });
+  measure("domain_table lookup, miss (50000 rules)", 1 << 22,
+          [&](std::size_t i) {
+            return table.lookup(misses[i % misses.size()]).has_value();
+          });
+}
@@ -0,0 +1,227 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bench.hpp"
+#include <asio.hpp>
+#include <asio/experimental/awaitable_operators.hpp>
+#include <cstring>
+#include <proxy_chain.hpp>
+#include <string>
+#include <thread>
+#include <vector>
+
+// latency of whole handshakes over loopback through stand-in SOCKS5 and HTTP
+// proxies, driven with blocking reads as the hooks do, and the number of
+// receive calls each takes (a peek and the read after it count as two); the
+// destination greets first, and its greeting must be left in the socket by
+// the handshake
+
+using tcp = asio::ip::tcp;
+
+constexpr std::string_view greeting = "hello";
+
+asio::awaitable<void> pump(tcp::socket &from, tcp::socket &to) {
+  char buf[4096];
+  try {
+    while (true) {
+      auto n = co_await from.async_read_some(asio::buffer(buf),
+                                             asio::use_awaitable);
+      co_await asio::async_write(to, asio::buffer(buf, n),
+                                 asio::use_awaitable);
+    }
+  } catch (asio::system_error &) {
+  }
+
+  asio::error_code ec;
+  to.shutdown(tcp::socket::shutdown_send, ec);
+}
+
+asio::awaitable<void> tunnel(tcp::socket client, std::uint16_t port,
+                             std::string_view reply,
+                             std::string_view ahead = {}) {
+  using namespace asio::experimental::awaitable_operators;
+
+  tcp::socket upstream(client.get_executor());
+  co_await upstream.async_connect(
+      {asio::ip::address_v4::loopback(), port}, asio::use_awaitable);
+  upstream.set_option(tcp::no_delay(true));
+
+  co_await asio::async_write(client, asio::buffer(reply), asio::use_awaitable);
+  co_await asio::async_write(upstream, asio::buffer(ahead),
+                             asio::use_awaitable);
+  co_await (pump(client, upstream) && pump(upstream, client));
+}
+
+// only NO AUTHENTICATION and CONNECT to IPv4 addresses
+asio::awaitable<void> socks5_proxy(tcp::socket client) {
+  char buf[10];
+  co_await asio::async_read(client, asio::buffer(buf, 3),
+                            asio::use_awaitable);
+  co_await asio::async_write(client, asio::buffer("\5\0", 2),
+                             asio::use_awaitable);
+  co_await asio::async_read(client, asio::buffer(buf, 10),
+                            asio::use_awaitable);
+
+  const char reply[] = {5, 0, 0, 1, 0, 0, 0, 0, 0, 0};
+  co_await tunnel(std::move(client),
+                  (std::uint16_t)((unsigned char)buf[8] << 8 |
+                                  (unsigned char)buf[9]),
+                  {reply, sizeof(reply)});
+}
+
+asio::awaitable<void> http_proxy(tcp::socket client) {
+  std::string request;
+  auto size = co_await asio::async_read_until(
+      client, asio::dynamic_buffer(request), "\r\n\r\n", asio::use_awaitable);
+
+  auto line = request.substr(0, request.find("\r\n"));
+  auto port = std::stoi(line.substr(line.rfind(':') + 1));
+  co_await tunnel(std::move(client), (std::uint16_t)port,
+                  "HTTP/1.1 200 Connection established\r\n"
+                  "Proxy-Agent: proxinject-bench\r\n\r\n",
+                  std::string_view(request).substr(size));
+}
+
+asio::awaitable<void> destination(tcp::socket client) {
+  co_await asio::async_write(client, asio::buffer(greeting),
+                             asio::use_awaitable);
+
+  char buf[64];
+  asio::error_code ec;
+  while (!ec) {
+    co_await client.async_read_some(
+        asio::buffer(buf), asio::redirect_error(asio::use_awaitable, ec));
+  }
+}
+
+template <typename Serve>
+std::uint16_t listen(asio::io_context &ctx, Serve serve) {
+  tcp::acceptor acceptor(ctx, {asio::ip::address_v4::loopback(), 0});
+  auto port = acceptor.local_endpoint().port();
+
+  asio::co_spawn(
+      ctx,
+      [acceptor = std::move(acceptor),
+       serve]() mutable -> asio::awaitable<void> {
+        while (true) {
+          auto socket = co_await acceptor.async_accept(asio::use_awaitable);
+          socket.set_option(tcp::no_delay(true));
+          asio::co_spawn(acceptor.get_executor(), serve(std::move(socket)),
+                         asio::detached);
+        }
+      },
+      asio::detached);
+  return port;
+}
+
+proxy_hop hop_to(std::uint16_t port,
+                 proxy_protocol protocol = proxy_protocol::socks5) {
+  proxy_hop hop{protocol};
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  hop.size = socks5_encode_request(hop.request.data(), (sockaddr *)&addr);
+  return hop;
+}
+
+// connects to `port` and runs the whole handshake, returns the number of
+// receive calls it took, or 0 if it failed
+std::size_t handshake(asio::io_context &ctx, std::uint16_t port,
+                      const proxy_hop &target, proxy_protocol protocol,
+                      std::span<const proxy_hop> chain, bool pipelined) {
+  tcp::socket s(ctx);
+  s.connect({asio::ip::address_v4::loopback(), port});
+  s.set_option(tcp::no_delay(true));
+
+  proxy_chain client(target.encoded(), protocol, chain, pipelined);
+  std::size_t reads = 0;
+  while (client.want_write() || client.want_read()) {
+    if (client.want_write()) {
+      auto out = client.output();
+      client.sent(s.write_some(asio::buffer(out.data(), out.size())));
+      continue;
+    }
+
+    ++reads;
+    auto in = client.input();
+    if (client.peek()) {
+      auto used = client.received(s.receive(
+          asio::buffer(in.data(), in.size()), tcp::socket::message_peek));
+      ++reads;
+      asio::read(s, asio::buffer(in.data(), used));
+    } else {
+      client.received(s.read_some(asio::buffer(in.data(), in.size())));
+    }
+  }
+
+  char buf[greeting.size()];
+  asio::read(s, asio::buffer(buf));
+  if (!client.done() || std::string_view(buf, sizeof(buf)) != greeting) {
+    return 0;
+  }
+  return reads;
+}
+
+int main() {
+  asio::io_context proxies(1);
+  auto socks5 = listen(proxies, socks5_proxy);
+  auto http = listen(proxies, http_proxy);
+  auto target = hop_to(listen(proxies, destination));
+  std::thread thread([&] { proxies.run(); });
+
+  struct setup {
+    const char *name;
+    std::uint16_t port;
+    proxy_protocol protocol;
+    std::vector<proxy_hop> chain;
+    bool pipelined;
+  };
+  const setup setups[] = {
+      {"socks5", socks5, proxy_protocol::socks5, {}, false},
+      {"socks5 (pipelined)", socks5, proxy_protocol::socks5, {}, true},
+      {"http connect", http, proxy_protocol::http, {}, false},
+      {"socks5>http>socks5 (pipelined)",
+       socks5,
+       proxy_protocol::socks5,
+       {hop_to(http, proxy_protocol::http), hop_to(socks5)},
+       true},
+  };
+
+  asio::io_context ctx(1);
+  constexpr std::size_t handshakes = 2000;
+  for (const auto &setup : setups) {
+    std::size_t reads = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < handshakes; ++i) {
+      auto n = handshake(ctx, setup.port, target, setup.protocol,
+                         setup.chain, setup.pipelined);
+      if (!n) {
+        std::printf("%s: handshake failed\n", setup.name);
+        return 1;
+      }
+      reads += n;
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    char name[64];
+    std::snprintf(name, sizeof(name), "%s, %.1f recvs", setup.name,
+                  (double)reads / handshakes);
+    report(name, handshakes, elapsed);
+  }
+
+  proxies.stop();
+  thread.join();
+}
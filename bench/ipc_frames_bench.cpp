@@ -0,0 +1,75 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bench.hpp"
+#include <schema.hpp>
+
+// frames per second through a framed_writer and a framed_reader over a
+// loopback tcp connection, with the writer handed bursts of frames at once
+
+int main() {
+  asio::io_context ctx(1);
+
+  tcp::acceptor acceptor(ctx, auto_endpoint);
+  tcp::socket out(ctx), in(ctx);
+  out.connect(acceptor.local_endpoint());
+  acceptor.accept(in);
+  out.set_option(tcp::no_delay(true));
+
+  framed_writer<tcp::socket> writer(out);
+  framed_reader<tcp::socket> reader(in);
+
+  auto msg = create_message<InjecteeMessage, "connect">(
+      InjecteeConnect{1u, IpAddr{0x01020304u, {}, {}, 443u},
+                      IpAddr{0x7f000001u, {}, {}, 1080u}, "connect"});
+
+  constexpr std::size_t frames = 1 << 20;
+  for (std::size_t burst : {1, 16, 256}) {
+    auto start = std::chrono::steady_clock::now();
+
+    asio::co_spawn(
+        ctx,
+        [&]() -> asio::awaitable<void> {
+          for (std::size_t i = 0; i < frames; i += burst) {
+            for (std::size_t j = 0; j < burst; ++j) {
+              writer.push(msg);
+            }
+            co_await writer.drained();
+          }
+        },
+        asio::detached);
+
+    std::uint64_t handles = 0;
+    asio::co_spawn(
+        ctx,
+        [&]() -> asio::awaitable<void> {
+          for (std::size_t i = 0; i < frames; ++i) {
+            auto read = co_await reader.read<InjecteeMessage>();
+            if (auto v = compare_message<"connect">(read)) {
+              handles += *(*v)["handle"_f];
+            }
+          }
+        },
+        asio::detached);
+
+    ctx.run();
+    ctx.restart();
+
+    char name[64];
+    std::snprintf(name, sizeof(name), "framed write+read (burst %zu)", burst);
+    report(name, frames, std::chrono::steady_clock::now() - start);
+    bench_sink = bench_sink + handles;
+  }
+}
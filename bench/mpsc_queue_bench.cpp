@@ -0,0 +1,73 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bench.hpp"
+#include <queue.hpp>
+#include <thread>
+#include <vector>
+
+// items per second from several producer threads to one consumer draining
+// the queue with pop_all on an io_context, as hooked calls feed the injectee
+// client; the queue is large enough that nothing is dropped
+
+int main() {
+  // a multiple of every producer count below
+  constexpr std::size_t items = 1 << 21;
+
+  for (std::size_t producers : {1, 2, 4, 8}) {
+    asio::io_context ctx(1);
+    mpsc_queue<std::uint64_t> queue(ctx, items);
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (std::size_t p = 0; p < producers; ++p) {
+      threads.emplace_back([&queue, n = items / producers] {
+        for (std::size_t i = 0; i < n; ++i) {
+          queue.push(i);
+        }
+      });
+    }
+
+    std::uint64_t sum = 0;
+    asio::co_spawn(
+        ctx,
+        [&]() -> asio::awaitable<void> {
+          std::vector<std::uint64_t> out;
+          std::size_t received = 0;
+          while (received < items) {
+            out.clear();
+            co_await queue.pop_all(out);
+            received += out.size();
+            for (auto v : out) {
+              sum += v;
+            }
+          }
+        },
+        asio::detached);
+
+    ctx.run();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    for (auto &t : threads) {
+      t.join();
+    }
+
+    char name[64];
+    std::snprintf(name, sizeof(name), "push+pop_all (producers: %zu)",
+                  producers);
+    report(name, items, elapsed);
+    bench_sink = bench_sink + sum;
+  }
+}
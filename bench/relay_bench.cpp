@@ -0,0 +1,123 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bench.hpp"
+#include <asio.hpp>
+#include <atomic>
+#include <memory>
+#include <relay.hpp>
+#include <thread>
+#include <vector>
+
+// throughput of the relay's forwarding loops over loopback: sources write
+// `total` bytes spread over some streams, one thread forwards every stream
+// towards its sink as a core of the relay does, and sinks read until EOF;
+// an op is 64 KiB forwarded
+
+using tcp = asio::ip::tcp;
+using forward_fn = asio::awaitable<void> (*)(tcp::socket &, tcp::socket &,
+                                             std::atomic<std::uint64_t> &);
+
+constexpr std::size_t op_size = 64 * 1024;
+
+asio::awaitable<void> source(tcp::socket s, std::size_t size) {
+  std::vector<char> buf(op_size, 'x');
+  for (std::size_t sent = 0; sent < size; sent += buf.size()) {
+    co_await asio::async_write(s, asio::buffer(buf), asio::use_awaitable);
+  }
+  s.shutdown(tcp::socket::shutdown_send);
+}
+
+asio::awaitable<void> sink(tcp::socket s, std::size_t &received) {
+  std::vector<char> buf(op_size);
+  asio::error_code ec;
+  while (!ec) {
+    received += co_await s.async_read_some(
+        asio::buffer(buf), asio::redirect_error(asio::use_awaitable, ec));
+  }
+}
+
+// returns false if a stream lost bytes on the way
+bool run(const char *name, forward_fn forward, std::size_t streams,
+         std::size_t total) {
+  asio::io_context ends(1), relay(1);
+  tcp::acceptor acceptor(ends, {asio::ip::address_v4::loopback(), 0});
+
+  // the relay's end of a connection is accepted on its own context
+  auto connect = [&](tcp::socket &end) {
+    end.connect(acceptor.local_endpoint());
+    auto s = acceptor.accept(relay);
+    s.set_option(tcp::no_delay(true));
+    return s;
+  };
+
+  struct stream {
+    tcp::socket from, to;
+  };
+  std::vector<std::unique_ptr<stream>> relayed;
+  std::vector<std::size_t> received(streams);
+  std::atomic<std::uint64_t> counter = 0;
+  auto size = total / streams;
+
+  for (std::size_t i = 0; i < streams; ++i) {
+    tcp::socket in(ends), out(ends);
+    auto from = connect(in);
+    auto to = connect(out);
+    relayed.push_back(
+        std::make_unique<stream>(stream{std::move(from), std::move(to)}));
+
+    asio::co_spawn(ends, source(std::move(in), size), asio::detached);
+    asio::co_spawn(ends, sink(std::move(out), received[i]), asio::detached);
+    asio::co_spawn(relay, forward(relayed[i]->from, relayed[i]->to, counter),
+                   asio::detached);
+  }
+  acceptor.close();
+
+  auto start = std::chrono::steady_clock::now();
+  std::thread thread([&] { relay.run(); });
+  ends.run();
+  thread.join();
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  for (auto n : received) {
+    if (n != size) {
+      std::printf("%s: %zu of %zu bytes arrived\n", name, n, size);
+      return false;
+    }
+  }
+
+  char label[64];
+  std::snprintf(label, sizeof(label), "%s, %zu stream(s), %.0f MiB/s", name,
+                streams,
+                (double)counter / (1 << 20) /
+                    std::chrono::duration<double>(elapsed).count());
+  report(label, counter / op_size, elapsed);
+  return true;
+}
+
+int main() {
+  constexpr std::size_t total = std::size_t(1) << 31;
+
+  for (std::size_t streams : {1, 8}) {
+    if (!run("copy", relay_copy, streams, total)) {
+      return 1;
+    }
+#ifdef __linux__
+    if (!run("splice", relay_pump, streams, total)) {
+      return 1;
+    }
+#endif
+  }
+}
@@ -0,0 +1,96 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bench.hpp"
+#include <random>
+#include <route_table.hpp>
+#include <vector>
+
+// route_table lookups over 20000 random IPv4 rules, against a linear scan
+// of the same rules that also checks every answer of the table
+
+struct flat_rule {
+  std::uint32_t network;
+  unsigned prefix;
+  std::uint16_t port_min, port_max;
+  route_action action;
+};
+
+route_action scan(const std::vector<flat_rule> &rules, std::uint32_t addr,
+                  std::uint16_t port) {
+  int best = -1;
+  auto action = route_action::proxy;
+  for (const auto &r : rules) {
+    auto mask = r.prefix ? ~std::uint32_t(0) << (32 - r.prefix) : 0;
+    if ((addr & mask) == r.network && port >= r.port_min &&
+        port <= r.port_max && (int)r.prefix > best) {
+      best = (int)r.prefix;
+      action = r.action;
+    }
+  }
+
+  return action;
+}
+
+int main() {
+  std::mt19937 gen(1);
+
+  std::vector<RouteRule> rules;
+  std::vector<flat_rule> flat;
+  for (int i = 0; i < 20000; ++i) {
+    unsigned prefix = gen() % 33;
+    std::uint32_t addr = prefix ? gen() & (~std::uint32_t(0) << (32 - prefix))
+                                : 0;
+    std::uint16_t port_min = gen() % 3 ? 0 : gen() % 1000;
+    std::uint16_t port_max = port_min + gen() % 2000;
+    auto action = (route_action)(gen() % 3);
+
+    RouteRule rule;
+    rule["network"_f] = std::vector<unsigned char>{
+        (unsigned char)(addr >> 24), (unsigned char)(addr >> 16),
+        (unsigned char)(addr >> 8), (unsigned char)addr};
+    rule["prefix"_f] = prefix;
+    rule["port_min"_f] = port_min;
+    rule["port_max"_f] = port_max;
+    rule["action"_f] = (std::uint32_t)action;
+    rules.push_back(rule);
+    flat.push_back({addr, prefix, port_min, port_max, action});
+  }
+  route_table table(rules);
+
+  std::vector<sockaddr_in> names(4096);
+  for (auto &name : names) {
+    name.sin_family = AF_INET;
+    name.sin_addr.s_addr = htonl(gen());
+    name.sin_port = htons(gen() % 3000);
+  }
+
+  for (const auto &name : names) {
+    auto expected = scan(flat, ntohl(name.sin_addr.s_addr),
+                         ntohs(name.sin_port));
+    if (table.route((const sockaddr *)&name) != expected) {
+      std::printf("route_table disagrees with the linear scan\n");
+      return 1;
+    }
+  }
+
+  measure("route_table lookup (20000 rules)", 1 << 22, [&](std::size_t i) {
+    return table.route((const sockaddr *)&names[i % names.size()]);
+  });
+  measure("linear scan (20000 rules)", 1 << 12, [&](std::size_t i) {
+    const auto &name = names[i % names.size()];
+    return scan(flat, ntohl(name.sin_addr.s_addr), ntohs(name.sin_port));
+  });
+}
@@ -0,0 +1,115 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bench.hpp"
+#include <algorithm>
+#include <proxy_client.hpp>
+#include <string_view>
+
+// throughput of the sans-IO handshake codecs, fed replies from memory in
+// chunks of a given size (0 for as much as they ask for)
+
+template <typename Client>
+bool run(Client &client, std::string_view reply, std::size_t chunk) {
+  std::size_t pos = 0;
+  while (client.want_write() || client.want_read()) {
+    if (client.want_write()) {
+      client.sent(client.output().size());
+      continue;
+    }
+
+    auto in = client.input();
+    auto size = std::min(in.size(), reply.size() - pos);
+    if (chunk) {
+      size = std::min(size, chunk);
+    }
+    if (!size) {
+      break;
+    }
+
+    std::copy_n(reply.data() + pos, size, in.data());
+    pos += client.received(size);
+  }
+
+  return client.done();
+}
+
+int main() {
+  constexpr std::size_t iterations = 2000000;
+
+  char req[SOCKS_REQUEST_MAX_SIZE];
+  auto v4 = socks5_encode_request(req, IpAddr(0x01020304u, {}, {}, 443));
+  std::span<const char> request(req, v4);
+
+  char domain_req[SOCKS_REQUEST_MAX_SIZE];
+  std::span<const char> domain(
+      domain_req, socks5_encode_request(
+                      domain_req, IpAddr({}, {}, "www.example.com", 443)));
+
+  constexpr std::string_view socks5_reply("\x05\x00"
+                                          "\x05\x00\x00\x01\x01\x02\x03\x04"
+                                          "\x01\xbb",
+                                          12);
+  constexpr std::string_view http_reply(
+      "HTTP/1.1 200 Connection established\r\n"
+      "Proxy-Agent: bench\r\n"
+      "\r\n");
+
+  measure("encode request (ipv4)", iterations, [&](std::size_t i) {
+    char buf[SOCKS_REQUEST_MAX_SIZE];
+    return socks5_encode_request(buf, IpAddr((std::uint32_t)i, {}, {}, 443));
+  });
+
+  measure("encode request (domain)", iterations, [&](std::size_t) {
+    char buf[SOCKS_REQUEST_MAX_SIZE];
+    return socks5_encode_request(buf, IpAddr({}, {}, "www.example.com", 443));
+  });
+
+  measure("socks5 handshake", iterations, [&](std::size_t) {
+    socks5_client client(request);
+    return run(client, socks5_reply, 0);
+  });
+
+  measure("socks5 handshake (pipelined)", iterations, [&](std::size_t) {
+    socks5_client client(request, true);
+    return run(client, socks5_reply, 0);
+  });
+
+  measure("socks5 handshake (domain, 1-byte reads)", iterations,
+          [&](std::size_t) {
+            socks5_client client(domain);
+            return run(client, socks5_reply, 1);
+          });
+
+  measure("http connect handshake", iterations, [&](std::size_t) {
+    http_connect_client client(request);
+    return run(client, http_reply, 0);
+  });
+
+  measure("http connect handshake (domain)", iterations, [&](std::size_t) {
+    http_connect_client client(domain);
+    return run(client, http_reply, 0);
+  });
+
+  measure("proxy_client socks5 handshake", iterations, [&](std::size_t) {
+    proxy_client client(request, proxy_protocol::socks5);
+    return run(client, socks5_reply, 0);
+  });
+
+  measure("proxy_client http handshake", iterations, [&](std::size_t) {
+    proxy_client client(request, proxy_protocol::http);
+    return run(client, http_reply, 0);
+  });
+}
@@ -0,0 +1,174 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <proxy_client.hpp>
+
+// feeds arbitrary proxy responses to the handshake codecs: the first byte
+// picks the protocol, pipelining and destination, the second the read size,
+// and the rest is what the proxy sends
+//
+// built with libFuzzer under clang (PROXINJECT_LIBFUZZER), and otherwise as a
+// standalone program replaying the files given to it, or mutating
+// well-formed responses for a fixed number of runs
+
+#define FUZZ_CHECK(cond)                                                       \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      std::abort();                                                            \
+    }                                                                          \
+  } while (0)
+
+static void check_finished(const proxy_client &client) {
+  FUZZ_CHECK(!(client.done() && client.failed()));
+  if (client.done()) {
+    FUZZ_CHECK(client.replied() && client.reply() == SOCKS_SUCCESS);
+    FUZZ_CHECK(client.bound().size() <= SOCKS_REPLY_MAX_SIZE);
+  }
+  if (client.done() || client.failed()) {
+    FUZZ_CHECK(!client.want_read());
+  }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t *data,
+                                      std::size_t size) {
+  if (size < 2) {
+    return 0;
+  }
+
+  auto flags = data[0];
+  std::size_t chunk = data[1];
+  std::span<const char> response((const char *)data + 2, size - 2);
+
+  char req[SOCKS_REQUEST_MAX_SIZE];
+  auto req_size =
+      flags & 4 ? socks5_encode_request(req, IpAddr({}, {}, "example.com", 80))
+                : socks5_encode_request(req, IpAddr(0x7f000001u, {}, {}, 80));
+
+  auto protocol = flags & 1 ? proxy_protocol::http : proxy_protocol::socks5;
+  bool pipelined = flags & 2;
+
+  // driven read by read, as the hooks do
+  proxy_client client({req, req_size}, protocol, pipelined);
+  std::size_t pos = 0;
+  while (client.want_write() || client.want_read()) {
+    if (client.want_write()) {
+      auto out = client.output();
+      FUZZ_CHECK(!out.empty());
+      client.sent(out.size());
+      continue;
+    }
+
+    auto in = client.input();
+    FUZZ_CHECK(!in.empty());
+    auto n = std::min(in.size(), response.size() - pos);
+    if (chunk) {
+      n = std::min(n, chunk);
+    }
+    if (!n) {
+      break;
+    }
+
+    // bytes past the end of a reply are left for the application
+    std::copy_n(response.begin() + pos, n, in.begin());
+    auto used = client.received(n);
+    FUZZ_CHECK(used <= n && (used == n || !client.want_read()));
+    pos += used;
+  }
+
+  // fed at once, it must end up in the same state, and a successful one
+  // must take no more than the response
+  proxy_client fed({req, req_size}, protocol, pipelined);
+  while (fed.want_write()) {
+    fed.sent(fed.output().size());
+  }
+  auto taken = fed.feed(response);
+  FUZZ_CHECK(!client.done() || taken == pos);
+  FUZZ_CHECK(fed.done() == client.done() && fed.failed() == client.failed());
+  FUZZ_CHECK(fed.reply() == client.reply());
+
+  if (client.want_read()) {
+    client.closed();
+    FUZZ_CHECK(client.failed());
+  }
+  check_finished(client);
+
+  return 0;
+}
+
+#ifndef PROXINJECT_LIBFUZZER
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+int main(int argc, char *argv[]) {
+  if (argc > 1) {
+    for (int i = 1; i < argc; ++i) {
+      std::ifstream file(argv[i], std::ios::binary);
+      std::vector<std::uint8_t> input(std::istreambuf_iterator<char>(file),
+                                      {});
+      LLVMFuzzerTestOneInput(input.data(), input.size());
+    }
+    return 0;
+  }
+
+  const std::string seeds[] = {
+      std::string("\x05\x00\x05\x00\x00\x01\x01\x02\x03\x04\x00\x50", 12),
+      std::string("\x05\x00\x05\x00\x00\x03\x03"
+                  "a.b\x00\x50",
+                  12),
+      std::string("\x05\x00\x05\x00\x00\x04", 6) + std::string(16, '\x01') +
+          std::string("\x00\x50", 2),
+      std::string("\x05\x00\x05\x05\x00\x01\x00\x00\x00\x00\x00\x00", 12),
+      "HTTP/1.1 200 Connection established\r\nVia: x\r\n\r\ndata",
+      "HTTP/1.0 407 Proxy Authentication Required\r\n\r\n",
+  };
+
+  std::mt19937_64 rng(1);
+  constexpr std::size_t runs = 1000000;
+  for (std::size_t run = 0; run < runs; ++run) {
+    const auto &seed = seeds[rng() % std::size(seeds)];
+    std::vector<std::uint8_t> input{(std::uint8_t)rng(),
+                                    (std::uint8_t)(rng() % 8)};
+    input.insert(input.end(), seed.begin(), seed.end());
+
+    for (auto n = rng() % 4; n-- > 0 && input.size() > 2;) {
+      auto at = 2 + rng() % (input.size() - 2);
+      switch (rng() % 4) {
+      case 0:
+        input[at] = (std::uint8_t)rng();
+        break;
+      case 1:
+        input.insert(input.begin() + at, (std::uint8_t)rng());
+        break;
+      case 2:
+        input.erase(input.begin() + at);
+        break;
+      default:
+        input.resize(at);
+      }
+    }
+
+    LLVMFuzzerTestOneInput(input.data(), input.size());
+  }
+
+  std::printf("%zu runs passed\n", runs);
+}
+#endif
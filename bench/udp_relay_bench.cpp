@@ -0,0 +1,208 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bench.hpp"
+#include <array>
+#include <asio.hpp>
+#include <asio/experimental/awaitable_operators.hpp>
+#include <cstring>
+#include <socks5_udp.hpp>
+#include <thread>
+#include <vector>
+
+// datagrams per second over loopback to an echoing destination, sent to it
+// directly and through a stand-in SOCKS5 UDP relay, with the client wrapping
+// and unwrapping the header as the hooks do: the header goes out from a
+// buffer of its own ahead of the payload, and the payload is copied once out
+// of a received datagram; `window` datagrams are kept in flight, and an op
+// is one datagram echoed back
+
+using udp = asio::ip::udp;
+
+constexpr std::size_t payload_size = 512;
+
+asio::awaitable<void> echo(udp::socket s) {
+  char buf[2048];
+  udp::endpoint from;
+  while (true) {
+    auto n = co_await s.async_receive_from(asio::buffer(buf), from,
+                                           asio::use_awaitable);
+    co_await s.async_send_to(asio::buffer(buf, n), from, asio::use_awaitable);
+  }
+}
+
+// datagrams from the client lose their header and go on to the destination
+// it names
+asio::awaitable<void> relay_out(udp::socket &front, udp::socket &back) {
+  char buf[2048];
+  udp::endpoint from;
+  while (true) {
+    auto n = co_await front.async_receive_from(asio::buffer(buf), from,
+                                               asio::use_awaitable);
+
+    sockaddr_storage to;
+    auto header = socks5_decode_udp_header({buf, n}, to);
+    if (!header || to.ss_family != AF_INET) {
+      continue;
+    }
+
+    udp::endpoint dest;
+    std::memcpy(dest.data(), &to, sizeof(sockaddr_in));
+    co_await back.async_send_to(asio::buffer(buf + header, n - header), dest,
+                                asio::use_awaitable);
+  }
+}
+
+// replies come back to the client with a header naming their source
+asio::awaitable<void> relay_back(udp::socket &back, udp::socket &front,
+                                 udp::endpoint client) {
+  constexpr std::size_t header_v4 = 3 + 1 + 4 + 2;
+  char buf[2048];
+  udp::endpoint from;
+  while (true) {
+    auto n = co_await back.async_receive_from(
+        asio::buffer(buf + header_v4, sizeof(buf) - header_v4), from,
+        asio::use_awaitable);
+
+    auto header = socks5_encode_udp_header(buf, from.data());
+    co_await front.async_send_to(asio::buffer(buf, header + n), client,
+                                 asio::use_awaitable);
+  }
+}
+
+asio::awaitable<void> relay(udp::socket front, udp::socket back,
+                            udp::endpoint client) {
+  using namespace asio::experimental::awaitable_operators;
+  co_await (relay_out(front, back) && relay_back(back, front, client));
+}
+
+// sends `count` datagrams to `to` for `dest`, through the relay if `to` is
+// not `dest`; returns false if one came back changed or out of order
+bool run(const char *name, udp::socket &s, const udp::endpoint &to,
+         const udp::endpoint &dest, std::size_t count, std::size_t window) {
+  bool relayed = to != dest;
+  char header[SOCKS_REQUEST_MAX_SIZE];
+  auto header_size = relayed ? socks5_encode_udp_header(header, dest.data())
+                             : 0;
+
+  std::vector<char> payload(payload_size, 'x'), buf(2048), out(payload_size);
+  auto send = [&](std::size_t i) {
+    std::memcpy(payload.data(), &i, sizeof(i));
+    std::array<asio::const_buffer, 2> bufs{asio::buffer(header, header_size),
+                                           asio::buffer(payload)};
+    s.send_to(bufs, to);
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  std::size_t sent = 0;
+  while (sent < window && sent < count) {
+    send(sent++);
+  }
+
+  for (std::size_t i = 0; i < count; ++i) {
+    udp::endpoint from;
+    auto n = s.receive_from(asio::buffer(buf), from);
+    std::span<const char> data(buf.data(), n);
+
+    if (relayed) {
+      sockaddr_storage origin;
+      auto size = socks5_decode_udp_header(data, origin);
+      auto v4 = (const sockaddr_in *)&origin;
+      auto want = (const sockaddr_in *)dest.data();
+      if (!size || origin.ss_family != AF_INET ||
+          v4->sin_port != want->sin_port ||
+          v4->sin_addr.s_addr != want->sin_addr.s_addr) {
+        return false;
+      }
+      data = data.subspan(size);
+    }
+
+    std::size_t seq;
+    if (data.size() != payload_size ||
+        (std::memcpy(&seq, data.data(), sizeof(seq)), seq != i)) {
+      return false;
+    }
+    std::memcpy(out.data(), data.data(), data.size());
+
+    if (sent < count) {
+      send(sent++);
+    }
+  }
+
+  report(name, count, std::chrono::steady_clock::now() - start);
+  return true;
+}
+
+int main() {
+  const udp::endpoint any{asio::ip::address_v4::loopback(), 0};
+  asio::io_context ends(1), ctx(1);
+
+  udp::socket client(ctx, any), echo_s(ends, any), front(ends, any),
+      back(ends, any);
+  auto dest = echo_s.local_endpoint();
+  auto relay_ep = front.local_endpoint();
+
+  asio::co_spawn(ends, echo(std::move(echo_s)), asio::detached);
+  asio::co_spawn(ends,
+                 relay(std::move(front), std::move(back),
+                       client.local_endpoint()),
+                 asio::detached);
+  std::thread thread([&] { ends.run(); });
+
+  // the header alone, as the hooks see it for each datagram
+  char header[SOCKS_REQUEST_MAX_SIZE];
+  std::vector<char> datagram(SOCKS_REQUEST_MAX_SIZE + payload_size, 'x');
+  auto header_size = socks5_encode_udp_header(datagram.data(), dest.data());
+  std::vector<char> out(payload_size);
+  sockaddr_storage addr{};
+  std::memcpy(&addr, dest.data(), dest.size());
+  measure("wrap: encode header", 10000000, [&](std::size_t i) {
+    ((sockaddr_in *)&addr)->sin_port = (unsigned short)i;
+    return socks5_encode_udp_header(header, (const sockaddr *)&addr) +
+           (std::size_t)header[8];
+  });
+  measure("unwrap: decode header, copy 512 B", 10000000, [&](std::size_t) {
+    sockaddr_storage origin;
+    auto size = socks5_decode_udp_header(
+        {datagram.data(), header_size + payload_size}, origin);
+    std::memcpy(out.data(), datagram.data() + size, payload_size);
+    return size + (std::size_t)out[0];
+  });
+
+  struct setup {
+    const char *name;
+    udp::endpoint to;
+    std::size_t window;
+  };
+  const setup setups[] = {
+      {"direct, 1 in flight", dest, 1},
+      {"relayed, 1 in flight", relay_ep, 1},
+      {"direct, 32 in flight", dest, 32},
+      {"relayed, 32 in flight", relay_ep, 32},
+  };
+
+  int ret = 0;
+  for (const auto &setup : setups) {
+    if (!run(setup.name, client, setup.to, dest, 200000, setup.window)) {
+      std::printf("%s: datagram lost or changed\n", setup.name);
+      ret = 1;
+      break;
+    }
+  }
+
+  ends.stop();
+  thread.join();
+  return ret;
+}
@@ -17,36 +17,192 @@
 #define PROXINJECT_COMMON_ASYNC_IO
 
 #include <asio.hpp>
+#include <chrono>
+#include <cstring>
+#include <memory>
 #include <protopuf/message.h>
 #include <span>
+#include <stdexcept>
 
 namespace ip = asio::ip;
 using tcp = asio::ip::tcp;
 
-template <typename Message, typename Stream>
-asio::awaitable<Message> async_read_message(Stream &s) {
-  std::int32_t len = 0;
-  co_await asio::async_read(s, asio::buffer(&len, sizeof(len)),
-                            asio::use_awaitable);
+// reads length-prefixed frames through a reusable buffer, so that one
+// `async_read_some` can yield many messages and no frame allocates by itself
+template <typename Stream> class framed_reader {
+  Stream &stream_;
+  std::vector<std::byte> buf_;
+  std::size_t begin_ = 0;
+  std::size_t end_ = 0;
 
-  std::vector<std::byte> buf(len);
-  co_await asio::async_read(s, asio::buffer(buf, len), asio::use_awaitable);
+  asio::awaitable<void> fill(std::size_t need) {
+    if (need > buf_.size()) {
+      buf_.resize(need);
+    }
 
-  auto [msg, remains] =
-      pp::message_coder<Message>::decode(std::span(buf.begin(), buf.end()));
-  co_return msg;
-}
+    if (begin_ + need > buf_.size()) {
+      std::memmove(buf_.data(), buf_.data() + begin_, end_ - begin_);
+      end_ -= begin_;
+      begin_ = 0;
+    }
+
+    end_ += co_await stream_.async_read_some(
+        asio::buffer(buf_.data() + end_, buf_.size() - end_),
+        asio::use_awaitable);
+  }
+
+public:
+  static constexpr std::size_t default_capacity = 64 * 1024;
+
+  explicit framed_reader(Stream &s, std::size_t capacity = default_capacity)
+      : stream_(s), buf_(capacity) {}
+
+  framed_reader(const framed_reader &) = delete;
+
+  template <typename Message> asio::awaitable<Message> read() {
+    std::int32_t len = 0;
+
+    while (true) {
+      std::size_t avail = end_ - begin_;
+      if (avail >= sizeof(len)) {
+        std::memcpy(&len, buf_.data() + begin_, sizeof(len));
+        if (len < 0) {
+          throw std::runtime_error("invalid frame length");
+        }
+        if (avail >= sizeof(len) + len) {
+          break;
+        }
+      }
+
+      co_await fill(avail >= sizeof(len) ? sizeof(len) + len : sizeof(len));
+    }
+
+    auto body = std::span(buf_.data() + begin_ + sizeof(len), len);
+    begin_ += sizeof(len) + len;
+    if (begin_ == end_) {
+      begin_ = end_ = 0;
+    }
+
+    auto [msg, remains] = pp::message_coder<Message>::decode(body);
+    co_return msg;
+  }
+};
+
+// serializes all outbound frames of a stream: messages are encoded into pooled
+// buffers and everything pending is flushed with one scatter/gather write
+template <typename Stream> class framed_writer {
+  Stream &stream_;
+  std::vector<std::vector<std::byte>> pending_;
+  std::vector<std::vector<std::byte>> inflight_;
+  std::vector<std::vector<std::byte>> pool_;
+  std::vector<asio::const_buffer> buffers_;
+  asio::steady_timer idle_;
+  bool writing_ = false;
+
+  std::vector<std::byte> acquire() {
+    if (pool_.empty()) {
+      return {};
+    }
+
+    auto buf = std::move(pool_.back());
+    pool_.pop_back();
+    return buf;
+  }
+
+  void release(std::vector<std::byte> &&buf) {
+    if (pool_.size() < max_pooled && buf.capacity() <= max_pooled_size) {
+      buf.clear();
+      pool_.push_back(std::move(buf));
+    }
+  }
+
+  asio::awaitable<void> flush() {
+    try {
+      while (!pending_.empty()) {
+        std::swap(pending_, inflight_);
+
+        buffers_.clear();
+        for (const auto &buf : inflight_) {
+          buffers_.push_back(asio::buffer(buf));
+        }
+        co_await asio::async_write(stream_, buffers_, asio::use_awaitable);
+
+        for (auto &buf : inflight_) {
+          release(std::move(buf));
+        }
+        inflight_.clear();
+      }
+    } catch (std::exception &) {
+      pending_.clear();
+      inflight_.clear();
+      asio::error_code ec;
+      stream_.close(ec);
+    }
+
+    writing_ = false;
+    idle_.cancel();
+  }
+
+public:
+  static constexpr std::size_t max_pooled = 64;
+  static constexpr std::size_t max_pooled_size = 64 * 1024;
+
+  explicit framed_writer(Stream &s) : stream_(s), idle_(s.get_executor()) {
+    idle_.expires_at(std::chrono::steady_clock::time_point::max());
+  }
+
+  framed_writer(const framed_writer &) = delete;
+
+  bool idle() const { return !writing_; }
+
+  // completes once every frame pushed so far has been written
+  asio::awaitable<void> drained() {
+    while (writing_) {
+      asio::error_code ec;
+      co_await idle_.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+    }
+  }
+
+  // must be called from the executor of the stream; `keep_alive` is held
+  // until the flush it may start has finished
+  template <typename Message>
+  void push(const Message &msg, std::shared_ptr<void> keep_alive = nullptr) {
+    std::int32_t len =
+        pp::skipper<pp::message_coder<Message>>::encode_skip(msg);
+
+    auto buf = acquire();
+    buf.resize(sizeof(len) + len);
+    std::memcpy(buf.data(), &len, sizeof(len));
+    pp::message_coder<Message>::encode(
+        msg, std::span(buf.data() + sizeof(len), len));
+    pending_.push_back(std::move(buf));
 
-template <typename Message, typename Stream>
-asio::awaitable<void> async_write_message(Stream &s, const Message &msg) {
-  std::int32_t len = pp::skipper<pp::message_coder<Message>>::encode_skip(msg);
+    if (!writing_) {
+      writing_ = true;
+      asio::co_spawn(
+          stream_.get_executor(),
+          [this, keep = std::move(keep_alive)] { return flush(); },
+          asio::detached);
+    }
+  }
+};
 
-  std::vector<std::byte> buf(len);
-  pp::message_coder<Message>::encode(msg, std::span(buf.begin(), buf.end()));
+// decides whether an accept loop goes on after an accept failed with `ec`;
+// running out of descriptors lasts until connections close, so the next
+// accept waits a moment, and a closed acceptor ends the loop
+inline asio::awaitable<bool> accept_failed(tcp::acceptor &acceptor,
+                                           asio::error_code ec) {
+  if (ec == asio::error::operation_aborted || !acceptor.is_open()) {
+    co_return false;
+  }
 
-  co_await asio::async_write(s, asio::buffer(&len, sizeof(len)),
-                             asio::use_awaitable);
-  co_await asio::async_write(s, asio::buffer(buf, len), asio::use_awaitable);
+  if (ec == asio::error::no_descriptors ||
+      ec == std::errc::too_many_files_open_in_system) {
+    asio::steady_timer timer(acceptor.get_executor(),
+                             std::chrono::milliseconds(100));
+    co_await timer.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+  }
+  co_return true;
 }
 
 inline const auto localhost = ip::address::from_string("127.0.0.1");
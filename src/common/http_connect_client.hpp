@@ -0,0 +1,294 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PROXINJECT_COMMON_HTTP_CONNECT_CLIENT
+#define PROXINJECT_COMMON_HTTP_CONNECT_CLIENT
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <socks5_client.hpp>
+#include <span>
+#include <string_view>
+
+// "CONNECT <authority> HTTP/1.1\r\nHost: <authority>\r\n\r\n", where the
+// longest authority is a 255-byte name with ":65535"
+constexpr const size_t HTTP_CONNECT_REQUEST_MAX_SIZE = 8 + 17 + 4 + 2 * 261;
+
+// a proxy sending longer response headers is taken as broken
+constexpr const size_t HTTP_CONNECT_RESPONSE_MAX_SIZE = 8192;
+
+// a resumable, IO-free HTTP CONNECT handshake with the interface of
+// socks5_client, taking the same encoded CONNECT request for the destination
+//
+// the response is parsed as it arrives instead of being kept, since only the
+// status code matters; `input()` is longer than most responses, so a read
+// into it has to be made with MSG_PEEK (as `peek()` says) and then just the
+// bytes `received` reports as used be taken off the socket, leaving those
+// following the response for the application, even from a destination that
+// speaks first
+//
+// the exchange is a single round-trip, so there is nothing to pipeline
+class http_connect_client {
+public:
+  enum class state { status, headers, done, failed };
+
+private:
+  std::array<char, HTTP_CONNECT_REQUEST_MAX_SIZE> out_;
+  std::size_t out_begin_ = 0;
+  std::size_t out_end_ = 0;
+
+  // the bytes of one read, parsed right away
+  std::array<char, 512> in_;
+
+  state state_ = state::status;
+  char reply_ = SOCKS_GENERAL_FAILURE;
+  bool replied_ = false;
+
+  // how much of "HTTP/1.x NNN" has been seen, and the code in it
+  std::size_t status_size_ = 0;
+  unsigned status_ = 0;
+  // how much of the "\r\n\r\n" ending the response has been matched
+  std::size_t ending_ = 0;
+  std::size_t total_ = 0;
+
+  void fail(char reply = SOCKS_GENERAL_FAILURE) {
+    state_ = state::failed;
+    reply_ = reply;
+  }
+
+  static char *put(char *ptr, std::string_view s) {
+    return std::copy(s.begin(), s.end(), ptr);
+  }
+
+  static char *put_number(char *ptr, unsigned v, unsigned base = 10) {
+    char digits[8];
+    int n = 0;
+    do {
+      digits[n++] = "0123456789abcdef"[v % base];
+      v /= base;
+    } while (v);
+
+    while (n > 0) {
+      *ptr++ = digits[--n];
+    }
+    return ptr;
+  }
+
+  // the destination of an encoded CONNECT request as "host:port", nullptr
+  // if it is not one
+  static char *put_authority(char *ptr, std::span<const char> request) {
+    if (request.size() < 5 || request[0] != SOCKS_VERSION ||
+        request[1] != SOCKS_CONNECT) {
+      return nullptr;
+    }
+
+    auto addr = (const unsigned char *)request.data() + 4;
+    std::size_t size = 0;
+    switch (request[3]) {
+    case SOCKS_IPV4:
+      size = 4;
+      break;
+    case SOCKS_IPV6:
+      size = 16;
+      break;
+    case SOCKS_DOMAINNAME:
+      size = 1 + addr[0];
+      break;
+    default:
+      return nullptr;
+    }
+    if (request.size() < 4 + size + 2) {
+      return nullptr;
+    }
+
+    if (request[3] == SOCKS_IPV4) {
+      for (int i = 0; i < 4; ++i) {
+        if (i) {
+          *ptr++ = '.';
+        }
+        ptr = put_number(ptr, addr[i]);
+      }
+    } else if (request[3] == SOCKS_IPV6) {
+      *ptr++ = '[';
+      for (int i = 0; i < 16; i += 2) {
+        if (i) {
+          *ptr++ = ':';
+        }
+        ptr = put_number(ptr, addr[i] << 8 | addr[i + 1], 16);
+      }
+      *ptr++ = ']';
+    } else {
+      // a name that would break the request line is not sent
+      if (size == 1 ||
+          std::any_of(addr + 1, addr + size,
+                      [](unsigned char c) { return c <= ' ' || c >= 127; })) {
+        return nullptr;
+      }
+      ptr = std::copy(addr + 1, addr + size, ptr);
+    }
+
+    *ptr++ = ':';
+    return put_number(ptr, addr[size] << 8 | addr[size + 1]);
+  }
+
+  void parse(char c) {
+    ++total_;
+
+    if (state_ == state::status) {
+      constexpr std::string_view version = "HTTP/1.";
+      auto i = status_size_++;
+      if (i < version.size()) {
+        if (c != version[i]) {
+          return fail();
+        }
+      } else if (i == 8) {
+        if (c != ' ') {
+          return fail();
+        }
+      } else if (c < '0' || c > '9') {
+        return fail();
+      } else if (i > 8) {
+        status_ = status_ * 10 + (c - '0');
+      }
+
+      if (status_size_ == 12) {
+        replied_ = true;
+        if (status_ / 100 != 2) {
+          return fail();
+        }
+        state_ = state::headers;
+      }
+      return;
+    }
+
+    if (c == "\r\n\r\n"[ending_]) {
+      ++ending_;
+    } else {
+      ending_ = c == '\r';
+    }
+
+    if (ending_ == 4) {
+      state_ = state::done;
+      reply_ = SOCKS_SUCCESS;
+    } else if (total_ >= HTTP_CONNECT_RESPONSE_MAX_SIZE) {
+      fail();
+    }
+  }
+
+public:
+  // `request` is an encoded CONNECT request, see `socks5_encode_request`
+  explicit http_connect_client(std::span<const char> request) {
+    auto ptr = put(out_.data(), "CONNECT ");
+    auto authority = ptr;
+    if (!(ptr = put_authority(ptr, request))) {
+      fail();
+      return;
+    }
+    auto authority_end = ptr;
+
+    ptr = put(ptr, " HTTP/1.1\r\nHost: ");
+    ptr = std::copy(authority, authority_end, ptr);
+    ptr = put(ptr, "\r\n\r\n");
+    out_end_ = ptr - out_.data();
+  }
+
+  state get_state() const { return state_; }
+  bool done() const { return state_ == state::done; }
+  bool failed() const { return state_ == state::failed; }
+
+  // the reply code in SOCKS5 terms, meaningful once done or failed
+  char reply() const { return reply_; }
+
+  bool pipelined() const { return false; }
+
+  // the HTTP status code, 0 until the proxy has answered
+  unsigned status() const { return replied_ ? status_ : 0; }
+
+  // HTTP CONNECT has no bound address to report
+  std::span<const char> bound() const { return {}; }
+
+  bool replied() const { return replied_; }
+
+  // to be called when the proxy closes or resets the connection, which fails
+  // a handshake still waiting for a reply
+  void closed() {
+    if (want_read()) {
+      fail();
+    }
+  }
+
+  // starts over, for a new connection to the proxy
+  void restart() {
+    // a request that could not be built stays failed
+    if (out_end_) {
+      out_begin_ = 0;
+      state_ = state::status;
+      reply_ = SOCKS_GENERAL_FAILURE;
+      replied_ = false;
+      status_size_ = status_ = ending_ = total_ = 0;
+    }
+  }
+
+  bool want_write() const { return !failed() && out_begin_ != out_end_; }
+  bool want_read() const {
+    return state_ == state::status || state_ == state::headers;
+  }
+
+  std::span<const char> output() const {
+    return {out_.data() + out_begin_, out_end_ - out_begin_};
+  }
+
+  void sent(std::size_t size) {
+    out_begin_ += std::min(size, out_end_ - out_begin_);
+  }
+
+  // a read may go past the end of the response, so it has to peek
+  bool peek() const { return want_read(); }
+
+  std::span<char> input() {
+    if (!want_read()) {
+      return {};
+    }
+
+    return in_;
+  }
+
+  // returns how many of the bytes read belong to the response, up to its end
+  std::size_t received(std::size_t size) {
+    size = std::min(size, in_.size());
+    std::size_t used = 0;
+    while (used < size && want_read()) {
+      parse(in_[used++]);
+    }
+    return used;
+  }
+
+  // copies as much of `data` as the handshake needs and returns its size
+  std::size_t feed(std::span<const char> data) {
+    std::size_t total = 0;
+    while (want_read() && total < data.size()) {
+      auto space = input();
+      auto size = std::min(space.size(), data.size() - total);
+      std::copy_n(data.begin() + total, size, space.begin());
+      total += received(size);
+    }
+
+    return total;
+  }
+};
+
+#endif
@@ -0,0 +1,117 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef PROXINJECT_COMMON_MUX
+#define PROXINJECT_COMMON_MUX
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+// the proxinject mux protocol carries many TCP flows as streams over one
+// long-lived TCP connection (a link) between the local relay (the client)
+// and a mux server, which connects to the destinations itself
+//
+// every frame is an 8-byte header followed by `length` bytes of payload:
+//
+//   +------+-------+--------------+------------------+
+//   | TYPE | FLAGS | LENGTH (2)   | STREAM (4)       |
+//   +------+-------+--------------+------------------+
+//
+// with LENGTH and STREAM big-endian, FLAGS zero and LENGTH at most
+// `mux_max_payload`; the types are
+//
+//   OPEN   (client) opens STREAM to the destination in the payload, which is
+//          ATYP ADDR PORT as in a SOCKS5 request
+//   REPLY  (server) answers OPEN with REP ATYP ADDR PORT as in a SOCKS5
+//          reply; a REP other than 0 closes the stream
+//   DATA   the payload is the next bytes of the stream
+//   WINDOW the payload is a 4-byte big-endian increment of the window of
+//          the receiver of this frame
+//   FIN    the sender will send no more DATA on the stream; a stream is
+//          closed once FIN has gone both ways
+//   RESET  the stream is closed in both directions at once
+//
+// stream ids are picked by the client, never 0 and never reused on a link;
+// frames for unknown streams are ignored
+//
+// flow control is per stream: either side may only have sent as many DATA
+// bytes as its window, which starts at `mux_initial_window` and grows by
+// the WINDOW frames of the peer, sent once the peer has passed the data on;
+// a bulk transfer can therefore never fill the link with data that an
+// interactive stream would have to queue behind on the receiving side
+//
+// a sender should take turns between streams with data to send, one DATA
+// frame each, so that one stream does not hold up the others on the link
+
+enum class mux_frame : std::uint8_t {
+  open = 1,
+  reply = 2,
+  data = 3,
+  window = 4,
+  fin = 5,
+  reset = 6,
+};
+
+struct mux_header {
+  mux_frame type;
+  std::uint16_t length;
+  std::uint32_t stream;
+};
+
+constexpr std::size_t mux_header_size = 8;
+constexpr std::size_t mux_max_payload = 16 * 1024;
+constexpr std::uint32_t mux_initial_window = 256 * 1024;
+
+inline void mux_put32(char *buf, std::uint32_t v) {
+  buf[0] = (char)(v >> 24);
+  buf[1] = (char)(v >> 16);
+  buf[2] = (char)(v >> 8);
+  buf[3] = (char)v;
+}
+
+inline std::uint32_t mux_get32(const char *buf) {
+  return (std::uint32_t)(unsigned char)buf[0] << 24 |
+         (std::uint32_t)(unsigned char)buf[1] << 16 |
+         (std::uint32_t)(unsigned char)buf[2] << 8 |
+         (std::uint32_t)(unsigned char)buf[3];
+}
+
+inline void mux_encode_header(char *buf, const mux_header &h) {
+  buf[0] = (char)h.type;
+  buf[1] = 0;
+  buf[2] = (char)(h.length >> 8);
+  buf[3] = (char)h.length;
+  mux_put32(buf + 4, h.stream);
+}
+
+// nullopt if the header breaks the protocol
+inline std::optional<mux_header> mux_decode_header(const char *buf) {
+  auto type = (std::uint8_t)buf[0];
+  auto length = (std::uint16_t)((unsigned char)buf[2] << 8 |
+                                (unsigned char)buf[3]);
+  auto stream = mux_get32(buf + 4);
+
+  if (type < (std::uint8_t)mux_frame::open ||
+      type > (std::uint8_t)mux_frame::reset || buf[1] != 0 ||
+      length > mux_max_payload || stream == 0) {
+    return std::nullopt;
+  }
+
+  return mux_header{(mux_frame)type, length, stream};
+}
+
+#endif
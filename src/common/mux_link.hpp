@@ -0,0 +1,508 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef PROXINJECT_COMMON_MUX_LINK
+#define PROXINJECT_COMMON_MUX_LINK
+
+#include "async_io.hpp"
+#include "mux.hpp"
+#include <algorithm>
+#include <asio.hpp>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+class mux_link;
+
+// one flow carried by a mux_link; like the link, it may only be used from
+// the executor of the link
+class mux_stream {
+  friend class mux_link;
+
+  std::shared_ptr<mux_link> link_;
+  std::uint32_t id_;
+
+  // DATA received but not read yet, never more than the window granted
+  std::vector<char> in_;
+  std::size_t in_begin_ = 0;
+  // read since the last WINDOW frame
+  std::uint32_t consumed_ = 0;
+  bool fin_received_ = false;
+
+  // DATA not framed yet, never more than the window of the peer
+  std::vector<char> out_;
+  std::size_t out_begin_ = 0;
+  std::uint32_t window_ = mux_initial_window;
+  bool fin_queued_ = false;
+  bool fin_sent_ = false;
+  bool scheduled_ = false;
+
+  bool reset_ = false;
+  // forgotten by the link, which sends nothing more for it
+  bool closed_ = false;
+  std::optional<std::vector<char>> reply_;
+
+  // cancelled on every change, waking whoever waits for one
+  asio::steady_timer changed_;
+
+  void notify() { changed_.cancel(); }
+
+  asio::awaitable<void> wait() {
+    asio::error_code ec;
+    co_await changed_.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+  }
+
+  static void compact(std::vector<char> &buf, std::size_t &begin) {
+    if (begin == buf.size()) {
+      buf.clear();
+      begin = 0;
+    } else if (begin >= buf.size() / 2) {
+      buf.erase(buf.begin(), buf.begin() + begin);
+      begin = 0;
+    }
+  }
+
+public:
+  mux_stream(std::shared_ptr<mux_link> link, std::uint32_t id,
+             asio::any_io_executor executor)
+      : link_(std::move(link)), id_(id), changed_(executor) {
+    changed_.expires_at(std::chrono::steady_clock::time_point::max());
+  }
+
+  mux_stream(const mux_stream &) = delete;
+
+  std::uint32_t id() const { return id_; }
+  asio::any_io_executor get_executor() { return changed_.get_executor(); }
+
+  // the REPLY to OPEN (REP ATYP ADDR PORT), empty until it has arrived or
+  // if the link has failed before
+  std::span<const char> reply() const {
+    if (reply_) {
+      return *reply_;
+    }
+    return {};
+  }
+
+  asio::awaitable<void> replied() {
+    while (!reply_ && !reset_) {
+      co_await wait();
+    }
+  }
+
+  // answers OPEN on the server side, see `mux_link::open_handler`
+  void answer(char rep, std::span<const char> bound);
+
+  // 0 once the peer has sent FIN
+  asio::awaitable<std::size_t> read_some(std::span<char> buf);
+
+  // returns once `data` fits in the window, not once it has been sent
+  asio::awaitable<void> write(std::span<const char> data);
+
+  void close_write();
+  void reset();
+};
+
+// a connection carrying mux_streams, see mux.hpp for the protocol
+class mux_link : public std::enable_shared_from_this<mux_link> {
+  friend class mux_stream;
+
+public:
+  // called on the server side for every OPEN, with the new stream and the
+  // destination (ATYP ADDR PORT); the stream is to be answered
+  using open_handler =
+      std::function<void(std::shared_ptr<mux_stream>, std::vector<char>)>;
+
+  // bytes of frames a single write gathers at most
+  static constexpr std::size_t write_batch = 64 * 1024;
+
+private:
+  tcp::socket socket_;
+  open_handler on_open_;
+  std::unordered_map<std::uint32_t, std::shared_ptr<mux_stream>> streams_;
+  std::uint32_t next_id_ = 1;
+
+  // control frames, sent before any DATA
+  std::vector<char> control_;
+  // streams with DATA or FIN to frame, taking turns
+  std::deque<std::uint32_t> ready_;
+  std::vector<char> batch_;
+  asio::steady_timer wake_;
+  bool closed_ = false;
+
+  void append(std::vector<char> &buf, mux_frame type, std::uint32_t stream,
+              std::span<const char> payload) {
+    auto pos = buf.size();
+    buf.resize(pos + mux_header_size + payload.size());
+    mux_encode_header(buf.data() + pos,
+                      {type, (std::uint16_t)payload.size(), stream});
+    std::copy(payload.begin(), payload.end(),
+              buf.begin() + pos + mux_header_size);
+  }
+
+  void control(mux_frame type, std::uint32_t stream,
+               std::span<const char> payload = {}) {
+    if (!closed_) {
+      append(control_, type, stream, payload);
+      wake_.cancel();
+    }
+  }
+
+  void schedule(mux_stream &s) {
+    if (!s.scheduled_ && !closed_) {
+      s.scheduled_ = true;
+      ready_.push_back(s.id_);
+      wake_.cancel();
+    }
+  }
+
+  void forget(mux_stream &s) {
+    s.closed_ = true;
+    streams_.erase(s.id_);
+  }
+
+  void forget_if_done(mux_stream &s) {
+    if (s.reset_ || (s.fin_received_ && s.fin_sent_)) {
+      forget(s);
+    }
+  }
+
+  void fail() {
+    if (closed_) {
+      return;
+    }
+
+    closed_ = true;
+    asio::error_code ec;
+    socket_.close(ec);
+
+    auto streams = std::move(streams_);
+    for (auto &[_, s] : streams) {
+      s->reset_ = s->closed_ = true;
+      s->notify();
+    }
+    ready_.clear();
+    wake_.cancel();
+  }
+
+  // frames DATA of the scheduled streams, one frame each in turn
+  void frame_data() {
+    while (!ready_.empty() && batch_.size() < write_batch) {
+      auto id = ready_.front();
+      ready_.pop_front();
+
+      auto iter = streams_.find(id);
+      if (iter == streams_.end()) {
+        continue;
+      }
+      auto s = iter->second;
+
+      if (s->out_begin_ < s->out_.size()) {
+        auto n = std::min(mux_max_payload, s->out_.size() - s->out_begin_);
+        append(batch_, mux_frame::data, id,
+               {s->out_.data() + s->out_begin_, n});
+        s->out_begin_ += n;
+        mux_stream::compact(s->out_, s->out_begin_);
+      } else if (s->fin_queued_ && !s->fin_sent_) {
+        append(batch_, mux_frame::fin, id, {});
+        s->fin_sent_ = true;
+      }
+
+      if (s->out_begin_ < s->out_.size() || (s->fin_queued_ && !s->fin_sent_)) {
+        ready_.push_back(id);
+      } else {
+        s->scheduled_ = false;
+        forget_if_done(*s);
+      }
+    }
+  }
+
+  asio::awaitable<void> writer() {
+    try {
+      while (!closed_) {
+        batch_.clear();
+        std::swap(batch_, control_);
+        frame_data();
+
+        if (batch_.empty()) {
+          asio::error_code ec;
+          co_await wake_.async_wait(
+              asio::redirect_error(asio::use_awaitable, ec));
+          continue;
+        }
+
+        co_await asio::async_write(socket_, asio::buffer(batch_),
+                                   asio::use_awaitable);
+      }
+    } catch (std::exception &) {
+      fail();
+    }
+  }
+
+  void dispatch(const mux_header &h, std::span<const char> body) {
+    if (h.type == mux_frame::open) {
+      if (on_open_ && !closed_ && !streams_.contains(h.stream)) {
+        auto s = std::make_shared<mux_stream>(shared_from_this(), h.stream,
+                                              socket_.get_executor());
+        streams_.emplace(h.stream, s);
+        on_open_(std::move(s), {body.begin(), body.end()});
+      } else {
+        control(mux_frame::reset, h.stream);
+      }
+      return;
+    }
+
+    auto iter = streams_.find(h.stream);
+    if (iter == streams_.end()) {
+      return;
+    }
+    auto s = iter->second;
+
+    switch (h.type) {
+    case mux_frame::reply:
+      s->reply_.emplace(body.begin(), body.end());
+      if (body.empty() || body[0] != 0) {
+        s->reset_ = true;
+        forget(*s);
+      }
+      break;
+    case mux_frame::data:
+      // more than the window granted
+      if (s->in_.size() - s->in_begin_ + body.size() > mux_initial_window) {
+        s->reset();
+      } else {
+        s->in_.insert(s->in_.end(), body.begin(), body.end());
+      }
+      break;
+    case mux_frame::window:
+      if (body.size() == 4) {
+        s->window_ += mux_get32(body.data());
+      }
+      break;
+    case mux_frame::fin:
+      s->fin_received_ = true;
+      forget_if_done(*s);
+      break;
+    case mux_frame::reset:
+      s->reset_ = true;
+      forget(*s);
+      break;
+    default:
+      break;
+    }
+
+    s->notify();
+  }
+
+  asio::awaitable<void> reader() {
+    char header[mux_header_size];
+    std::vector<char> payload(mux_max_payload);
+
+    try {
+      while (!closed_) {
+        co_await asio::async_read(socket_, asio::buffer(header),
+                                  asio::use_awaitable);
+        auto h = mux_decode_header(header);
+        if (!h) {
+          break;
+        }
+
+        co_await asio::async_read(socket_,
+                                  asio::buffer(payload.data(), h->length),
+                                  asio::use_awaitable);
+        dispatch(*h, {payload.data(), h->length});
+      }
+    } catch (std::exception &) {
+    }
+
+    fail();
+  }
+
+public:
+  explicit mux_link(tcp::socket socket, open_handler on_open = nullptr)
+      : socket_(std::move(socket)), on_open_(std::move(on_open)),
+        wake_(socket_.get_executor()) {
+    wake_.expires_at(std::chrono::steady_clock::time_point::max());
+  }
+
+  mux_link(const mux_link &) = delete;
+
+  void start() {
+    asio::co_spawn(
+        socket_.get_executor(),
+        [self = shared_from_this()] { return self->reader(); },
+        asio::detached);
+    asio::co_spawn(
+        socket_.get_executor(),
+        [self = shared_from_this()] { return self->writer(); },
+        asio::detached);
+  }
+
+  bool closed() const { return closed_; }
+  std::size_t streams() const { return streams_.size(); }
+
+  // opens a stream to `target` (ATYP ADDR PORT) on the client side; wait
+  // for `replied` before using it
+  std::shared_ptr<mux_stream> open(std::span<const char> target) {
+    auto id = next_id_++;
+    if (next_id_ == 0) {
+      next_id_ = 1;
+    }
+
+    auto s = std::make_shared<mux_stream>(shared_from_this(), id,
+                                          socket_.get_executor());
+    if (closed_) {
+      s->reset_ = s->closed_ = true;
+    } else {
+      streams_.emplace(id, s);
+      control(mux_frame::open, id, target);
+    }
+    return s;
+  }
+
+  void close() { fail(); }
+};
+
+inline void mux_stream::answer(char rep, std::span<const char> bound) {
+  std::vector<char> payload{rep};
+  payload.insert(payload.end(), bound.begin(), bound.end());
+  link_->control(mux_frame::reply, id_, payload);
+
+  if (rep != 0 && !closed_) {
+    reset_ = true;
+    link_->forget(*this);
+    notify();
+  }
+}
+
+inline asio::awaitable<std::size_t> mux_stream::read_some(std::span<char> buf) {
+  while (in_begin_ == in_.size() && !fin_received_ && !reset_) {
+    co_await wait();
+  }
+  if (reset_) {
+    throw asio::system_error(asio::error::connection_reset);
+  }
+
+  auto n = std::min(buf.size(), in_.size() - in_begin_);
+  std::copy_n(in_.begin() + in_begin_, n, buf.begin());
+  in_begin_ += n;
+  compact(in_, in_begin_);
+
+  // granting in larger steps saves frames without stalling the peer
+  consumed_ += (std::uint32_t)n;
+  if (consumed_ >= mux_initial_window / 4 && !closed_) {
+    char increment[4];
+    mux_put32(increment, consumed_);
+    link_->control(mux_frame::window, id_, increment);
+    consumed_ = 0;
+  }
+
+  co_return n;
+}
+
+inline asio::awaitable<void> mux_stream::write(std::span<const char> data) {
+  while (!data.empty()) {
+    while (window_ == 0 && !reset_) {
+      co_await wait();
+    }
+    if (reset_ || fin_queued_) {
+      throw asio::system_error(asio::error::connection_reset);
+    }
+
+    auto n = std::min<std::size_t>(window_, data.size());
+    out_.insert(out_.end(), data.begin(), data.begin() + n);
+    window_ -= (std::uint32_t)n;
+    data = data.subspan(n);
+    link_->schedule(*this);
+  }
+}
+
+inline void mux_stream::close_write() {
+  if (!fin_queued_ && !reset_) {
+    fin_queued_ = true;
+    link_->schedule(*this);
+  }
+}
+
+inline void mux_stream::reset() {
+  if (!closed_) {
+    link_->control(mux_frame::reset, id_);
+    reset_ = true;
+    link_->forget(*this);
+  }
+  notify();
+}
+
+// forwards `from` into the stream `to` until EOF, counting into `counter`
+inline asio::awaitable<void> mux_pump(tcp::socket &from, mux_stream &to,
+                                      std::atomic<std::uint64_t> &counter) {
+  std::vector<char> buf(4 * mux_max_payload);
+
+  bool eof = false;
+  try {
+    while (true) {
+      auto n = co_await from.async_read_some(asio::buffer(buf),
+                                             asio::use_awaitable);
+      co_await to.write({buf.data(), n});
+      counter.fetch_add(n, std::memory_order_relaxed);
+    }
+  } catch (asio::system_error &e) {
+    eof = e.code() == asio::error::eof;
+  }
+
+  asio::error_code ec;
+  if (eof) {
+    to.close_write();
+  } else {
+    to.reset();
+    from.shutdown(tcp::socket::shutdown_both, ec);
+  }
+}
+
+// forwards the stream `from` into `to` until FIN, counting into `counter`
+inline asio::awaitable<void> mux_pump(mux_stream &from, tcp::socket &to,
+                                      std::atomic<std::uint64_t> &counter) {
+  std::vector<char> buf(4 * mux_max_payload);
+
+  bool eof = false;
+  try {
+    while (true) {
+      auto n = co_await from.read_some(buf);
+      if (n == 0) {
+        eof = true;
+        break;
+      }
+      co_await asio::async_write(to, asio::buffer(buf.data(), n),
+                                 asio::use_awaitable);
+      counter.fetch_add(n, std::memory_order_relaxed);
+    }
+  } catch (asio::system_error &) {
+  }
+
+  asio::error_code ec;
+  if (eof) {
+    to.shutdown(tcp::socket::shutdown_send, ec);
+  } else {
+    from.reset();
+    to.shutdown(tcp::socket::shutdown_both, ec);
+  }
+}
+
+#endif
@@ -0,0 +1,218 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PROXINJECT_COMMON_PROXY_CHAIN
+#define PROXINJECT_COMMON_PROXY_CHAIN
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <proxy_client.hpp>
+#include <span>
+#include <vector>
+
+// a proxy reached through the one before it in a chain, with its address
+// encoded as the request to that one
+struct proxy_hop {
+  proxy_protocol protocol = proxy_protocol::socks5;
+  std::array<char, SOCKS_REQUEST_MAX_SIZE> request{};
+  std::size_t size = 0;
+
+  std::span<const char> encoded() const { return {request.data(), size}; }
+};
+
+// nested handshakes over one connection, driven like a single proxy_client:
+// the first proxy is asked for the next hop, that one (through the tunnel)
+// for the one after, and the last one for the destination
+//
+// in pipelined mode the handshakes behind SOCKS5 hops are written before
+// those hops have answered, so that a chain of SOCKS5 proxies is sent in one
+// go and only the replies take a round-trip through the tunnel; bytes behind
+// an HTTP hop wait for its response, since a proxy refusing the CONNECT may
+// keep the connection alive and read them as another request
+class proxy_chain {
+  using clock = std::chrono::steady_clock;
+
+  struct hop {
+    proxy_client client;
+    clock::time_point finished{};
+  };
+
+  // a chain of one, the common case, does not allocate
+  hop first_;
+  std::vector<hop> rest_;
+
+  // the hop whose reply is being read, and how many may be written to
+  std::size_t current_ = 0;
+  std::size_t released_ = 1;
+  bool broken_ = false;
+  clock::time_point started_{};
+
+  hop &at(std::size_t i) { return i ? rest_[i - 1] : first_; }
+  const hop &at(std::size_t i) const { return i ? rest_[i - 1] : first_; }
+
+  const proxy_client &current() const { return at(current_).client; }
+
+  void release() {
+    released_ = std::max(released_, current_ + 1);
+    while (released_ < hops() && at(released_ - 1).client.pipelined()) {
+      ++released_;
+    }
+  }
+
+  void advance() {
+    while (at(current_).client.done() &&
+           at(current_).finished == clock::time_point{}) {
+      at(current_).finished = clock::now();
+      if (current_ + 1 < hops()) {
+        ++current_;
+        release();
+      }
+    }
+  }
+
+  // the first released hop with something to write
+  std::size_t writer() const {
+    for (std::size_t i = current_; i < released_; ++i) {
+      if (at(i).client.want_write()) {
+        return i;
+      }
+    }
+    return released_;
+  }
+
+public:
+  // `request` is an encoded request for the last hop, see
+  // `socks5_encode_request`; `chain` lists the hops behind the first proxy,
+  // which speaks `protocol`
+  explicit proxy_chain(std::span<const char> request,
+                       proxy_protocol protocol = proxy_protocol::socks5,
+                       std::span<const proxy_hop> chain = {},
+                       bool pipelined = false)
+      : first_{proxy_client(chain.empty() ? request : chain[0].encoded(),
+                            protocol, pipelined)} {
+    rest_.reserve(chain.size());
+    for (std::size_t i = 0; i < chain.size(); ++i) {
+      rest_.push_back({proxy_client(i + 1 < chain.size()
+                                        ? chain[i + 1].encoded()
+                                        : request,
+                                    chain[i].protocol, pipelined)});
+    }
+
+    for (std::size_t i = 0; i < hops(); ++i) {
+      broken_ = broken_ || at(i).client.failed() ||
+                (i < chain.size() && !chain[i].size);
+    }
+    release();
+  }
+
+  std::size_t hops() const { return 1 + rest_.size(); }
+
+  bool done() const { return at(hops() - 1).client.done(); }
+  bool failed() const { return broken_ || current().failed(); }
+
+  // the reply code of the hop that failed, or of the last one
+  char reply() const {
+    return broken_ ? SOCKS_GENERAL_FAILURE : current().reply();
+  }
+
+  bool pipelined() const { return !broken_ && current().pipelined(); }
+  bool replied() const { return current().replied(); }
+
+  // the bound address reported by the last hop
+  std::span<const char> bound() const {
+    return done() ? at(hops() - 1).client.bound() : std::span<const char>{};
+  }
+
+  // the time each finished hop took on top of the ones before it, in
+  // microseconds from the first byte sent
+  std::vector<std::uint32_t> hop_us() const {
+    std::vector<std::uint32_t> res;
+    auto last = started_;
+    for (std::size_t i = 0;
+         i < hops() && at(i).finished != clock::time_point{}; ++i) {
+      res.push_back((std::uint32_t)std::chrono::duration_cast<
+                        std::chrono::microseconds>(at(i).finished - last)
+                        .count());
+      last = at(i).finished;
+    }
+    return res;
+  }
+
+  bool want_write() const { return !failed() && writer() < released_; }
+  bool want_read() const { return !failed() && current().want_read(); }
+
+  std::span<const char> output() const {
+    auto i = writer();
+    return i < released_ ? at(i).client.output() : std::span<const char>{};
+  }
+
+  void sent(std::size_t size) {
+    if (started_ == clock::time_point{}) {
+      started_ = clock::now();
+    }
+    if (auto i = writer(); i < released_) {
+      at(i).client.sent(size);
+    }
+  }
+
+  // whether reads into `input()` have to be made with MSG_PEEK, taking off
+  // the socket afterwards only what `received` returns
+  bool peek() const { return !failed() && current().peek(); }
+
+  std::span<char> input() {
+    return failed() ? std::span<char>{} : at(current_).client.input();
+  }
+
+  // returns how many of the bytes read belong to the current hop
+  std::size_t received(std::size_t size) {
+    auto used = at(current_).client.received(size);
+    advance();
+    return used;
+  }
+
+  // to be called when the connection is closed or reset under the handshakes
+  void closed() { at(current_).client.closed(); }
+
+  // starts all hops over without pipelining, for a new connection to the
+  // first proxy
+  void restart() {
+    for (std::size_t i = 0; i < hops(); ++i) {
+      at(i).client.restart();
+      at(i).finished = {};
+    }
+
+    current_ = 0;
+    released_ = 1;
+    started_ = {};
+    release();
+  }
+
+  // copies as much of `data` as the handshakes need and returns its size
+  std::size_t feed(std::span<const char> data) {
+    std::size_t total = 0;
+    while (want_read() && total < data.size()) {
+      auto space = input();
+      auto size = std::min(space.size(), data.size() - total);
+      std::copy_n(data.begin() + total, size, space.begin());
+      total += received(size);
+    }
+
+    return total;
+  }
+};
+
+#endif
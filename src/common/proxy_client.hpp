@@ -0,0 +1,105 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PROXINJECT_COMMON_PROXY_CLIENT
+#define PROXINJECT_COMMON_PROXY_CLIENT
+
+#include <http_connect_client.hpp>
+#include <schema.hpp>
+#include <socks5_client.hpp>
+#include <span>
+#include <variant>
+
+// the handshake with a proxy of either protocol, driven like a
+// socks5_client; reply codes are in SOCKS5 terms for both
+class proxy_client {
+  using impl = std::variant<socks5_client, http_connect_client>;
+  impl impl_;
+
+  template <typename F> decltype(auto) visit(F &&f) {
+    return std::visit(std::forward<F>(f), impl_);
+  }
+
+  template <typename F> decltype(auto) visit(F &&f) const {
+    return std::visit(std::forward<F>(f), impl_);
+  }
+
+public:
+  // `request` is an encoded request, see `socks5_encode_request`; HTTP
+  // proxies only take CONNECT and ignore `pipelined`
+  explicit proxy_client(std::span<const char> request,
+                        proxy_protocol protocol = proxy_protocol::socks5,
+                        bool pipelined = false)
+      : impl_(protocol == proxy_protocol::http
+                  ? impl(std::in_place_type<http_connect_client>, request)
+                  : impl(std::in_place_type<socks5_client>, request,
+                         pipelined)) {}
+
+  proxy_protocol protocol() const {
+    return impl_.index() ? proxy_protocol::http : proxy_protocol::socks5;
+  }
+
+  bool done() const {
+    return visit([](const auto &c) { return c.done(); });
+  }
+  bool failed() const {
+    return visit([](const auto &c) { return c.failed(); });
+  }
+  char reply() const {
+    return visit([](const auto &c) { return c.reply(); });
+  }
+  bool pipelined() const {
+    return visit([](const auto &c) { return c.pipelined(); });
+  }
+  std::span<const char> bound() const {
+    return visit([](const auto &c) { return c.bound(); });
+  }
+  bool replied() const {
+    return visit([](const auto &c) { return c.replied(); });
+  }
+  bool want_write() const {
+    return visit([](const auto &c) { return c.want_write(); });
+  }
+  bool want_read() const {
+    return visit([](const auto &c) { return c.want_read(); });
+  }
+
+  std::span<const char> output() const {
+    return visit([](const auto &c) { return c.output(); });
+  }
+  void sent(std::size_t size) {
+    visit([size](auto &c) { c.sent(size); });
+  }
+  bool peek() const {
+    return visit([](const auto &c) { return c.peek(); });
+  }
+  std::span<char> input() {
+    return visit([](auto &c) { return c.input(); });
+  }
+  std::size_t received(std::size_t size) {
+    return visit([size](auto &c) { return c.received(size); });
+  }
+  std::size_t feed(std::span<const char> data) {
+    return visit([data](auto &c) { return c.feed(data); });
+  }
+  void closed() {
+    visit([](auto &c) { c.closed(); });
+  }
+  void restart() {
+    visit([](auto &c) { c.restart(); });
+  }
+};
+
+#endif
@@ -16,39 +16,169 @@
 #ifndef PROXINJECT_COMMON_QUEUE
 #define PROXINJECT_COMMON_QUEUE
 
-#include <asio/experimental/channel.hpp>
-#include <queue>
+#include <asio.hpp>
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <vector>
 
-template <typename T> using channel = asio::experimental::channel<T>;
+// what `mpsc_queue::push` does with an item once the queue is full
+enum class overflow_policy : std::uint32_t {
+  drop_newest, // discard the incoming item
+  drop_oldest, // discard the oldest queued item to make room
+  aggregate,   // fold the incoming item into the aggregated counter
+};
+
+// bounded multi-producer/single-consumer queue: `push` never allocates queue
+// storage nor waits and may be called from any thread, while `pop_all` and
+// `cancel` belong to the executor thread
+template <typename T> class mpsc_queue {
+  // bounded ring with per-cell sequence numbers (D. Vyukov)
+  struct cell {
+    std::atomic<std::size_t> seq;
+    std::optional<T> value;
+  };
+
+  std::unique_ptr<cell[]> cells_;
+  const std::size_t mask_;
+  alignas(64) std::atomic<std::size_t> enqueue_pos_ = 0;
+  alignas(64) std::atomic<std::size_t> dequeue_pos_ = 0;
+
+  std::atomic<overflow_policy> policy_;
+  std::atomic<std::uint64_t> dropped_ = 0;
+  std::atomic<std::uint64_t> aggregated_ = 0;
+
+  std::atomic<bool> notified_ = false;
+  asio::steady_timer timer_;
+  bool cancelled_ = false;
+
+  static std::size_t round_capacity(std::size_t n) {
+    std::size_t cap = 2;
+    while (cap < n) {
+      cap <<= 1;
+    }
+    return cap;
+  }
+
+  bool try_enqueue(T &item) {
+    std::size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      cell &c = cells_[pos & mask_];
+      std::size_t seq = c.seq.load(std::memory_order_acquire);
+      auto diff = (std::intptr_t)seq - (std::intptr_t)pos;
+
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          c.value = std::move(item);
+          c.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  std::optional<T> try_dequeue() {
+    std::size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      cell &c = cells_[pos & mask_];
+      std::size_t seq = c.seq.load(std::memory_order_acquire);
+      auto diff = (std::intptr_t)seq - (std::intptr_t)(pos + 1);
 
-template <typename T> class blocking_queue {
-  std::mutex _sync;
-  std::queue<T> _qu;
-  channel<void(asio::error_code)> chan;
+      if (diff == 0) {
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          std::optional<T> item = std::move(c.value);
+          c.value.reset();
+          c.seq.store(pos + mask_ + 1, std::memory_order_release);
+          return item;
+        }
+      } else if (diff < 0) {
+        return std::nullopt;
+      } else {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
 
 public:
-  blocking_queue(asio::io_context &ctx, size_t max)
-      : chan(ctx.get_executor(), max) {}
+  static constexpr std::size_t default_capacity = 1024;
 
-  void push(const T &item) {
-    std::unique_lock<std::mutex> lock(_sync);
-    _qu.push(item);
-    asio::co_spawn(chan.get_executor(),
-                   chan.async_send(asio::error_code{}, asio::use_awaitable),
-                   asio::detached);
+  mpsc_queue(asio::io_context &ctx, std::size_t capacity = default_capacity,
+             overflow_policy policy = overflow_policy::drop_newest)
+      : cells_(new cell[round_capacity(capacity)]),
+        mask_(round_capacity(capacity) - 1), policy_(policy), timer_(ctx) {
+    for (std::size_t i = 0; i <= mask_; ++i) {
+      cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+    timer_.expires_at(std::chrono::steady_clock::time_point::max());
   }
 
-  asio::awaitable<T> pop() {
-    co_await chan.async_receive(asio::use_awaitable);
-    std::unique_lock<std::mutex> lock(_sync);
-    T item = std::move(_qu.front());
-    _qu.pop();
-    co_return item;
+  mpsc_queue(const mpsc_queue &) = delete;
+
+  void set_policy(overflow_policy policy) { policy_ = policy; }
+
+  void push(T item) {
+    while (!try_enqueue(item)) {
+      auto policy = policy_.load(std::memory_order_relaxed);
+      if (policy == overflow_policy::drop_oldest) {
+        if (try_dequeue()) {
+          ++dropped_;
+        }
+      } else {
+        ++(policy == overflow_policy::aggregate ? aggregated_ : dropped_);
+        return;
+      }
+    }
+
+    // only the first push after the consumer went idle pays for a wakeup
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!notified_.exchange(true)) {
+      asio::post(timer_.get_executor(), [this] { timer_.cancel(); });
+    }
+  }
+
+  // returns and resets the number of items dropped and aggregated so far
+  std::pair<std::uint64_t, std::uint64_t> take_overflow() {
+    return {dropped_.exchange(0), aggregated_.exchange(0)};
+  }
+
+  // moves every queued item into `out` in push order, without waiting
+  std::size_t try_pop_all(std::vector<T> &out) {
+    std::size_t count = 0;
+    while (auto item = try_dequeue()) {
+      out.push_back(std::move(*item));
+      ++count;
+    }
+
+    return count;
   }
 
-  void cancel() { chan.cancel(); }
+  asio::awaitable<void> pop_all(std::vector<T> &out) {
+    while (true) {
+      if (cancelled_) {
+        throw asio::system_error(asio::error::operation_aborted);
+      }
+
+      notified_.store(false);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (try_pop_all(out) > 0) {
+        co_return;
+      }
 
-  ~blocking_queue() { chan.close(); }
+      asio::error_code ec;
+      co_await timer_.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+    }
+  }
+
+  void cancel() {
+    cancelled_ = true;
+    timer_.cancel();
+  }
 };
 
 #endif
@@ -16,6 +16,7 @@
 #ifndef PROXINJECT_COMMON_SCHEMA
 #define PROXINJECT_COMMON_SCHEMA
 
+#include "async_io.hpp"
 #include <protopuf/message.h>
 
 using pp::operator""_f;
@@ -55,25 +56,93 @@ using InjecteeConnect = pp::message<
     pp::uint32_field<"handle", 1>, pp::message_field<"addr", 2, IpAddr>,
     pp::message_field<"proxy", 3, IpAddr>, pp::string_field<"syscall", 4>>;
 
+using InjecteeConnectBatch = pp::message<
+    pp::message_field<"connects", 1, InjecteeConnect, pp::repeated>>;
+
+using InjecteeOverflow =
+    pp::message<pp::uint64_field<"dropped", 1>,
+                pp::uint64_field<"aggregated", 2>>;
+
+// how long the phases of a proxied connect with a deadline (or through a
+// chain) took, in microseconds; `handshake_us` is unset if the proxy was never
+// reached, `connect_us` if the connect to it was not timed, and `hop_us` has
+// the share of each hop of a chain that was passed
+using InjecteeTiming = pp::message<
+    pp::uint32_field<"handle", 1>, pp::string_field<"syscall", 2>,
+    pp::uint32_field<"connect_us", 3>, pp::uint32_field<"handshake_us", 4>,
+    pp::bool_field<"success", 5>, pp::bool_field<"timed_out", 6>,
+    pp::uint32_field<"hop_us", 7, pp::repeated>>;
+
+// a name lookup sent to the shared resolver of the injector, answered by an
+// InjectorResolved with the same `id`
+using InjecteeResolve =
+    pp::message<pp::uint32_field<"id", 1>, pp::string_field<"name", 2>>;
+
 using InjecteeMessage =
     pp::message<pp::string_field<"opcode", 1>,
                 pp::message_field<"connect", 2, InjecteeConnect>,
-                pp::uint32_field<"pid", 3>, pp::uint32_field<"subpid", 4>>;
-
+                pp::uint32_field<"pid", 3>, pp::uint32_field<"subpid", 4>,
+                pp::message_field<"connects", 5, InjecteeConnectBatch>,
+                pp::message_field<"overflow", 6, InjecteeOverflow>,
+                pp::message_field<"timing", 7, InjecteeTiming>,
+                pp::message_field<"resolve", 8, InjecteeResolve>>;
+
+enum class route_action : std::uint32_t { proxy, direct, block };
+
+// destinations in `network` (raw bytes in network order, 4 or 16 of them)
+// masked to `prefix` bits, with a port in [port_min, port_max]
+using RouteRule =
+    pp::message<pp::bytes_field<"network", 1>, pp::uint32_field<"prefix", 2>,
+                pp::uint32_field<"port_min", 3>,
+                pp::uint32_field<"port_max", 4>, pp::uint32_field<"action", 5>>;
+
+// how a proxy is asked for a connection: a SOCKS5 CONNECT, or an HTTP
+// CONNECT (which cannot carry UDP)
+enum class proxy_protocol : std::uint32_t { socks5, http };
+
+// a proxy among several, picked per connection in proportion to `weight`,
+// which the injector adjusts by the measured latency and failure rate
+using Upstream = pp::message<pp::message_field<"addr", 1, IpAddr>,
+                             pp::uint32_field<"weight", 2>,
+                             pp::uint32_field<"protocol", 3>>;
+
+// `pattern` is `a.com` (exactly), `*.a.com` (subdomains) or `.a.com` (both)
+using DomainRule = pp::message<pp::string_field<"pattern", 1>,
+                               pp::uint32_field<"action", 2>>;
+
+// `protocol` is the proxy_protocol of `addr`; `chain` lists proxies that
+// connections go through in order behind it (or an upstream), where `weight`
+// is not used; `udp_relay` sends proxied datagrams through a UDP ASSOCIATE
 using InjectorConfig =
     pp::message<pp::message_field<"addr", 1, IpAddr>, pp::bool_field<"log", 2>,
-                pp::bool_field<"subprocess", 3>>;
+                pp::bool_field<"subprocess", 3>,
+                pp::uint32_field<"overflow", 4>, pp::bool_field<"pipeline", 5>,
+                pp::message_field<"routes", 6, RouteRule, pp::repeated>,
+                pp::message_field<"domains", 7, DomainRule, pp::repeated>,
+                pp::message_field<"upstreams", 8, Upstream, pp::repeated>,
+                pp::uint32_field<"connect_timeout", 9>,
+                pp::bool_field<"fake_dns", 10>,
+                pp::bool_field<"shared_resolver", 11>,
+                pp::uint32_field<"protocol", 12>,
+                pp::message_field<"chain", 13, Upstream, pp::repeated>,
+                pp::bool_field<"udp_relay", 14>>;
+
+// addresses with port 0, none if the name cannot be resolved
+using InjectorResolved =
+    pp::message<pp::uint32_field<"id", 1>,
+                pp::message_field<"addrs", 2, IpAddr, pp::repeated>>;
 
 using InjectorMessage =
     pp::message<pp::string_field<"opcode", 1>,
-                pp::message_field<"config", 2, InjectorConfig>>;
+                pp::message_field<"config", 2, InjectorConfig>,
+                pp::message_field<"resolved", 3, InjectorResolved>>;
 
 template <typename M, pp::basic_fixed_string S, typename T>
 M create_message(T &&v) {
   M msg;
 
   msg["opcode"_f] = S.data;
-  msg.get<S>() = std::forward<T>(v);
+  msg.template get<S>() = std::forward<T>(v);
 
   return msg;
 }
@@ -81,7 +150,7 @@ M create_message(T &&v) {
 template <pp::basic_fixed_string S, typename M>
 M::template get_type_by_name<S>::base_type compare_message(const M &msg) {
   if (msg["opcode"_f] == S.data) {
-    return msg.get_base<S>();
+    return msg.template get_base<S>();
   }
 
   return std::nullopt;
@@ -0,0 +1,323 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PROXINJECT_COMMON_SOCKS5_CLIENT
+#define PROXINJECT_COMMON_SOCKS5_CLIENT
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <schema.hpp>
+#include <span>
+
+#ifdef _WIN32
+#include <WinSock2.h>
+#include <ws2ipdef.h>
+#else
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+constexpr const char SOCKS_VERSION = 5;
+constexpr const char SOCKS_NO_AUTHENTICATION = 0;
+
+constexpr const char SOCKS_CONNECT = 1;
+constexpr const char SOCKS_UDP_ASSOCIATE = 3;
+constexpr const char SOCKS_IPV4 = 1;
+constexpr const char SOCKS_DOMAINNAME = 3;
+constexpr const char SOCKS_IPV6 = 4;
+
+constexpr const char SOCKS_SUCCESS = 0;
+constexpr const char SOCKS_GENERAL_FAILURE = 4;
+constexpr const char SOCKS_COMMAND_NOT_SUPPORTED = 7;
+
+constexpr const size_t SOCKS_REQUEST_MAX_SIZE = 262;
+constexpr const size_t SOCKS_REPLY_MAX_SIZE = 262;
+
+// a resumable, IO-free SOCKS5 client handshake (no authentication + CONNECT):
+// the caller writes `output()` to the proxy, reports it via `sent`, reads
+// into `input()` and reports it via `received`, until `done()` or `failed()`
+//
+// `input()` never asks for more than the rest of the current reply, so bytes
+// following the CONNECT reply are left in the socket for the application and
+// reads need no MSG_PEEK (see `peek()`)
+//
+// in pipelined mode the CONNECT request is sent right after the greeting
+// without waiting for the method reply, saving one round-trip
+class socks5_client {
+public:
+  enum class state { method, reply, done, failed };
+
+private:
+  std::array<char, 3 + SOCKS_REQUEST_MAX_SIZE> out_;
+  std::size_t out_begin_ = 0;
+  std::size_t out_end_ = 0;
+
+  std::array<char, SOCKS_REPLY_MAX_SIZE> in_;
+  std::size_t in_size_ = 0;
+
+  std::array<char, SOCKS_REQUEST_MAX_SIZE> request_;
+  std::size_t request_size_ = 0;
+
+  state state_ = state::method;
+  char reply_ = SOCKS_GENERAL_FAILURE;
+  bool pipelined_;
+  bool replied_ = false;
+
+  void write(const char *data, std::size_t size) {
+    if (out_begin_ == out_end_) {
+      out_begin_ = out_end_ = 0;
+    }
+    out_end_ = std::copy(data, data + size, out_.begin() + out_end_) -
+               out_.begin();
+  }
+
+  void consume(std::size_t size) {
+    std::memmove(in_.data(), in_.data() + size, in_size_ - size);
+    in_size_ -= size;
+  }
+
+  void fail(char reply = SOCKS_GENERAL_FAILURE) {
+    state_ = state::failed;
+    reply_ = reply;
+  }
+
+  // total size of the reply being parsed, as far as it is known yet
+  std::size_t expected() const {
+    if (state_ == state::method) {
+      // both replies are at least this long, so read them at once
+      return pipelined_ ? 2 + 5 : 2;
+    } else if (state_ == state::reply) {
+      if (in_size_ < 5) {
+        return 5;
+      }
+
+      switch (in_[3]) {
+      case SOCKS_IPV4:
+        return 4 + 4 + 2;
+      case SOCKS_IPV6:
+        return 4 + 16 + 2;
+      case SOCKS_DOMAINNAME:
+        return 4 + 1 + (unsigned char)in_[4] + 2;
+      }
+    }
+
+    return 0;
+  }
+
+  void parse() {
+    if (state_ == state::method && in_size_ >= 2) {
+      if (in_[0] != SOCKS_VERSION || in_[1] != SOCKS_NO_AUTHENTICATION) {
+        return fail();
+      }
+
+      consume(2);
+      if (!pipelined_) {
+        write(request_.data(), request_size_);
+      }
+      state_ = state::reply;
+    }
+
+    if (state_ == state::reply) {
+      if (in_size_ >= 1 && in_[0] != SOCKS_VERSION) {
+        return fail();
+      }
+      if (in_size_ >= 2) {
+        replied_ = true;
+        if (in_[1] != SOCKS_SUCCESS) {
+          return fail(in_[1]);
+        }
+      }
+      if (in_size_ >= 4 && in_[3] != SOCKS_IPV4 && in_[3] != SOCKS_IPV6 &&
+          in_[3] != SOCKS_DOMAINNAME) {
+        return fail();
+      }
+
+      // the reply is kept in `in_` for `bound()`
+      if (auto size = expected(); in_size_ >= 5 && in_size_ >= size) {
+        state_ = state::done;
+        reply_ = SOCKS_SUCCESS;
+      }
+    }
+  }
+
+public:
+  // `request` is an encoded CONNECT request, see `socks5_encode_request`
+  explicit socks5_client(std::span<const char> request, bool pipelined = false)
+      : request_size_(std::min(request.size(), request_.size())),
+        pipelined_(pipelined) {
+    std::copy_n(request.begin(), request_size_, request_.begin());
+
+    const char greeting[] = {SOCKS_VERSION, 1, SOCKS_NO_AUTHENTICATION};
+    write(greeting, sizeof(greeting));
+    if (pipelined_) {
+      write(request_.data(), request_size_);
+    }
+  }
+
+  state get_state() const { return state_; }
+  bool done() const { return state_ == state::done; }
+  bool failed() const { return state_ == state::failed; }
+
+  // the reply code of the proxy, meaningful once done or failed
+  char reply() const { return reply_; }
+
+  bool pipelined() const { return pipelined_; }
+
+  // the bound address of a successful reply, in the wire format of
+  // SOCKS5 (type, address, port)
+  std::span<const char> bound() const {
+    if (!done()) {
+      return {};
+    }
+
+    return {in_.data() + 3, in_size_ - 3};
+  }
+
+  // whether the proxy has answered the CONNECT request at all; a pipelined
+  // handshake failing before that suggests the proxy cannot be pipelined
+  bool replied() const { return replied_; }
+
+  // to be called when the proxy closes or resets the connection, which fails
+  // a handshake still waiting for a reply
+  void closed() {
+    if (want_read()) {
+      fail();
+    }
+  }
+
+  // starts over without pipelining, for a new connection to the proxy
+  void restart() {
+    *this = socks5_client({request_.data(), request_size_});
+  }
+
+  bool want_write() const { return !failed() && out_begin_ != out_end_; }
+  bool want_read() const {
+    return state_ == state::method || state_ == state::reply;
+  }
+
+  std::span<const char> output() const {
+    return {out_.data() + out_begin_, out_end_ - out_begin_};
+  }
+
+  void sent(std::size_t size) {
+    out_begin_ += std::min(size, out_end_ - out_begin_);
+  }
+
+  bool peek() const { return false; }
+
+  std::span<char> input() {
+    if (!want_read()) {
+      return {};
+    }
+
+    return {in_.data() + in_size_, expected() - in_size_};
+  }
+
+  // returns how many of the bytes read belong to the handshake
+  std::size_t received(std::size_t size) {
+    size = std::min(size, expected() - in_size_);
+    in_size_ += size;
+    parse();
+    return size;
+  }
+
+  // copies as much of `data` as the handshake needs and returns its size
+  std::size_t feed(std::span<const char> data) {
+    std::size_t total = 0;
+    while (want_read() && total < data.size()) {
+      auto space = input();
+      auto size = std::min(space.size(), data.size() - total);
+      std::copy_n(data.begin() + total, size, space.begin());
+      total += received(size);
+    }
+
+    return total;
+  }
+};
+
+// encodes a CONNECT (or another `command`) request into `buf` (at least
+// SOCKS_REQUEST_MAX_SIZE bytes), returns its size or 0 if the address is not
+// supported
+inline std::size_t socks5_encode_request(char *buf, const sockaddr *addr,
+                                         char command = SOCKS_CONNECT) {
+  char *ptr = buf;
+  *ptr++ = SOCKS_VERSION;
+  *ptr++ = command;
+  *ptr++ = 0;
+
+  if (addr->sa_family == AF_INET) {
+    auto v4 = (const sockaddr_in *)addr;
+    *ptr++ = SOCKS_IPV4;
+    std::memcpy(ptr, &v4->sin_addr, 4);
+    ptr += 4;
+    std::memcpy(ptr, &v4->sin_port, 2);
+    ptr += 2;
+  } else if (addr->sa_family == AF_INET6) {
+    auto v6 = (const sockaddr_in6 *)addr;
+    *ptr++ = SOCKS_IPV6;
+    std::memcpy(ptr, &v6->sin6_addr, 16);
+    ptr += 16;
+    std::memcpy(ptr, &v6->sin6_port, 2);
+    ptr += 2;
+  } else {
+    return 0;
+  }
+
+  return ptr - buf;
+}
+
+inline std::size_t socks5_encode_request(char *buf, const IpAddr &addr,
+                                         char command = SOCKS_CONNECT) {
+  char *ptr = buf;
+  *ptr++ = SOCKS_VERSION;
+  *ptr++ = command;
+  *ptr++ = 0;
+
+  // numbers in IpAddr are in host order, the wire wants them big-endian
+  auto put = [&ptr](std::uint32_t v, int bytes) {
+    while (bytes-- > 0) {
+      *ptr++ = (char)(v >> (bytes * 8));
+    }
+  };
+
+  if (auto v4 = addr["v4_addr"_f]) {
+    *ptr++ = SOCKS_IPV4;
+    put(*v4, 4);
+  } else if (auto v6 = addr["v6_addr"_f]) {
+    if (v6->size() != 16) {
+      return 0;
+    }
+    *ptr++ = SOCKS_IPV6;
+    ptr = std::copy(v6->begin(), v6->end(), ptr);
+  } else if (auto domain = addr["domain"_f]) {
+    if (domain->empty() || domain->size() >= 256) {
+      return 0;
+    }
+    *ptr++ = SOCKS_DOMAINNAME;
+    *ptr++ = (char)domain->size();
+    ptr = std::copy(domain->begin(), domain->end(), ptr);
+  } else {
+    return 0;
+  }
+
+  put(addr["port"_f].value_or(0), 2);
+
+  return ptr - buf;
+}
+
+#endif
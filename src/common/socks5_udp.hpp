@@ -0,0 +1,72 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef PROXINJECT_COMMON_SOCKS5_UDP
+#define PROXINJECT_COMMON_SOCKS5_UDP
+
+#include <cstddef>
+#include <cstring>
+#include <socks5_client.hpp>
+#include <span>
+
+// a datagram sent through a UDP ASSOCIATE relay is prefixed with
+// RSV(2) FRAG(1) ATYP ADDR PORT, which is a CONNECT request with the first
+// three bytes zeroed
+template <typename Addr>
+inline std::size_t socks5_encode_udp_header(char *buf, const Addr &addr) {
+  auto size = socks5_encode_request(buf, addr);
+  if (size) {
+    buf[0] = buf[1] = buf[2] = 0;
+  }
+  return size;
+}
+
+// decodes ATYP ADDR PORT at the start of `data` into `addr`, returns the
+// bytes consumed or 0 if it is truncated or not an IP address
+inline std::size_t socks5_decode_address(std::span<const char> data,
+                                         sockaddr_storage &addr) {
+  addr = {};
+  if (data.size() >= 1 + 4 + 2 && data[0] == SOCKS_IPV4) {
+    auto v4 = (sockaddr_in *)&addr;
+    v4->sin_family = AF_INET;
+    std::memcpy(&v4->sin_addr, data.data() + 1, 4);
+    std::memcpy(&v4->sin_port, data.data() + 1 + 4, 2);
+    return 1 + 4 + 2;
+  } else if (data.size() >= 1 + 16 + 2 && data[0] == SOCKS_IPV6) {
+    auto v6 = (sockaddr_in6 *)&addr;
+    v6->sin6_family = AF_INET6;
+    std::memcpy(&v6->sin6_addr, data.data() + 1, 16);
+    std::memcpy(&v6->sin6_port, data.data() + 1 + 16, 2);
+    return 1 + 16 + 2;
+  }
+
+  return 0;
+}
+
+// the size of the header of a datagram received from a relay, with its
+// source decoded into `from`; 0 if the datagram is malformed or a fragment,
+// which are not supported
+inline std::size_t socks5_decode_udp_header(std::span<const char> data,
+                                            sockaddr_storage &from) {
+  if (data.size() < 3 || data[0] != 0 || data[1] != 0 || data[2] != 0) {
+    return 0;
+  }
+
+  auto size = socks5_decode_address(data.subspan(3), from);
+  return size ? 3 + size : 0;
+}
+
+#endif
@@ -63,6 +63,7 @@ inline bool all_of_digit(const auto &v) {
                      [](auto c) { return std::isdigit(c); });
 }
 
+#ifdef _WIN32
 // utf8_encode/decode from cycfi::elements
 
 // Convert a wide Unicode string to an UTF8 string
@@ -87,6 +88,7 @@ inline std::wstring utf8_decode(std::string const &str) {
   MultiByteToWideChar(CP_UTF8, 0, &str[0], (int)str.size(), &result[0], size);
   return result;
 }
+#endif
 
 inline bool filename_wildcard_match(const char *pattern, const char *str) {
   for (; *pattern; ++pattern) {
@@ -153,11 +155,13 @@ inline bool regex_match_filename(const std::string &pattern,
   return matched;
 }
 
+#ifdef _WIN32
 inline const std::wstring port_mapping_name = L"PROXINJECT_PORT_IPC_";
 
 inline std::wstring get_port_mapping_name(DWORD pid) {
   return port_mapping_name + std::to_wstring(pid);
 }
+#endif
 
 inline std::string proxinject_copyright(const std::string &version) {
   return "proxinject " + version + "\n\n" + "Copyright (c) PragmaTwice\n" +
@@ -17,50 +17,236 @@
 #define PROXINJECT_INJECTEE_CLIENT
 
 #include "async_io.hpp"
+#include "domain_table.hpp"
+#include "proxy_chain.hpp"
 #include "queue.hpp"
+#include "remote_resolver.hpp"
+#include "route_table.hpp"
 #include "schema.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <vector>
+
+#ifdef _WIN32
 #include "winnet.hpp"
+#else
+#include "posixnet.hpp"
+#endif
 
-struct injectee_config {
+struct upstream : sockaddr_buf {
+  IpAddr addr;
+  std::uint32_t weight = 1;
+  std::size_t index = 0;
+  proxy_protocol protocol = proxy_protocol::socks5;
+};
+
+// an immutable view of the config, published as a whole so that hooks can
+// read it without taking a lock or copying the message; fields used on every
+// hooked call are compiled once here
+struct config_snapshot {
   InjectorConfig cfg;
-  std::mutex mtx;
+  std::uint64_t generation = 0;
 
-  void set(const InjectorConfig &config) {
-    std::lock_guard guard(mtx);
-    cfg = config;
+  // `addr` alone is taken as a single upstream
+  std::vector<upstream> upstreams;
+  std::vector<std::uint64_t> cumulative_weights;
+  // hops behind whichever upstream is picked, encoded once
+  std::vector<proxy_hop> chain;
+  bool log = false;
+  bool subprocess = false;
+  bool pipeline = false;
+  bool fake_dns = false;
+  bool shared_resolver = false;
+  bool udp_relay = false;
+  // for proxied connects whose caller gives no timeout
+  std::chrono::milliseconds connect_timeout = std::chrono::seconds(30);
+  route_table routes;
+  domain_table domains;
+
+  // set once a pipelined handshake fails in a way suggesting that the proxy
+  // cannot handle it, falling back to sequential handshakes
+  mutable std::atomic<bool> pipeline_rejected = false;
+
+  // consecutive handshake failures seen here for each upstream, so that hooks
+  // steer around a failing proxy before the injector reweights it
+  std::unique_ptr<std::atomic<std::uint32_t>[]> failures;
+
+  config_snapshot() = default;
+
+  config_snapshot(const InjectorConfig &config, std::uint64_t generation)
+      : cfg(config), generation(generation),
+        log(config["log"_f].value_or(false)),
+        subprocess(config["subprocess"_f].value_or(false)),
+        pipeline(config["pipeline"_f].value_or(false)),
+        fake_dns(config["fake_dns"_f].value_or(false)),
+        shared_resolver(config["shared_resolver"_f].value_or(false)),
+        udp_relay(config["udp_relay"_f].value_or(false)),
+        connect_timeout(config["connect_timeout"_f].value_or(30000)),
+        routes(config["routes"_f]), domains(config["domains"_f]) {
+    auto add = [this](const IpAddr &addr, std::uint32_t weight,
+                      std::uint32_t protocol) {
+      if (auto v = to_sockaddr(addr)) {
+        upstreams.push_back(
+            {*v, addr, weight, upstreams.size(), (proxy_protocol)protocol});
+      }
+    };
+
+    // a hop that cannot be encoded stays, failing every handshake rather
+    // than letting connections skip it
+    for (const auto &u : cfg["chain"_f]) {
+      proxy_hop hop{(proxy_protocol)u["protocol"_f].value_or(0)};
+      if (const auto &addr = u["addr"_f]) {
+        hop.size = socks5_encode_request(hop.request.data(), *addr);
+      }
+      chain.push_back(hop);
+    }
+
+    for (const auto &u : cfg["upstreams"_f]) {
+      if (const auto &addr = u["addr"_f]) {
+        add(*addr, u["weight"_f].value_or(1), u["protocol"_f].value_or(0));
+      }
+    }
+    if (upstreams.empty()) {
+      if (const auto &addr = cfg["addr"_f]) {
+        add(*addr, 1, cfg["protocol"_f].value_or(0));
+      }
+    }
+
+    // all upstreams weighted down to zero still beat no proxy at all
+    if (std::all_of(upstreams.begin(), upstreams.end(),
+                    [](const upstream &u) { return u.weight == 0; })) {
+      for (auto &u : upstreams) {
+        u.weight = 1;
+      }
+    }
+
+    std::uint64_t total = 0;
+    for (const auto &u : upstreams) {
+      cumulative_weights.push_back(total += u.weight);
+    }
+
+    failures =
+        std::make_unique<std::atomic<std::uint32_t>[]>(upstreams.size());
   }
 
-  InjectorConfig get() {
-    std::lock_guard guard(mtx);
-    return cfg;
+  // an upstream index drawn in proportion to the weights
+  std::size_t sample() const {
+    thread_local std::uint64_t state = std::random_device{}() | 1;
+
+    // xorshift64
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+
+    return std::upper_bound(cumulative_weights.begin(),
+                            cumulative_weights.end(),
+                            state % cumulative_weights.back()) -
+           cumulative_weights.begin();
   }
 
-  void clear() {
-    std::lock_guard guard(mtx);
-    cfg = InjectorConfig{};
+  // the upstream for a connection routed by `action`: the better of two
+  // weighted random picks (power of two choices) by recent local failures
+  const upstream *pick(route_action action) const {
+    if (action != route_action::proxy || upstreams.empty()) {
+      return nullptr;
+    } else if (upstreams.size() == 1) {
+      return &upstreams.front();
+    }
+
+    auto a = sample(), b = sample();
+    return failures[b].load(std::memory_order_relaxed) <
+                   failures[a].load(std::memory_order_relaxed)
+               ? &upstreams[b]
+               : &upstreams[a];
+  }
+
+  // the proxy reported in connect events
+  static std::optional<IpAddr> via(const upstream *proxy) {
+    if (proxy) {
+      return proxy->addr;
+    }
+    return std::nullopt;
+  }
+
+  bool pipelining() const {
+    return pipeline && !pipeline_rejected.load(std::memory_order_relaxed);
+  }
+
+  // whether a pipelined handshake failed, or was closed or reset, before
+  // the proxy answered the request; such a connection is retried once with
+  // a sequential handshake
+  static bool pipeline_refused(const proxy_chain &client) {
+    return client.pipelined() && client.failed() && !client.replied();
+  }
+
+  // to be called once a handshake with `proxy` has finished
+  void report(const upstream &proxy, const proxy_chain &client) const {
+    // not held against the proxy, which is asked again right away
+    if (pipeline_refused(client)) {
+      pipeline_rejected.store(true, std::memory_order_relaxed);
+      return;
+    }
+
+    auto &failed = failures[proxy.index];
+    if (client.done()) {
+      failed.store(0, std::memory_order_relaxed);
+    } else {
+      failed.fetch_add(1, std::memory_order_relaxed);
+    }
   }
 };
 
+struct injectee_config {
+  std::atomic<std::shared_ptr<const config_snapshot>> current;
+  std::uint64_t generation = 0;
+
+  injectee_config() : current(std::make_shared<const config_snapshot>()) {}
+
+  // only called from the client executor
+  void set(const InjectorConfig &config) {
+    current.store(
+        std::make_shared<const config_snapshot>(config, ++generation));
+  }
+
+  std::shared_ptr<const config_snapshot> get() const { return current.load(); }
+
+  void clear() { set(InjectorConfig{}); }
+};
+
 struct injectee_client : std::enable_shared_from_this<injectee_client> {
   tcp::socket socket_;
+  framed_reader<tcp::socket> input_;
+  framed_writer<tcp::socket> output_;
   tcp::endpoint endpoint_;
   asio::steady_timer timer_;
-  blocking_queue<InjecteeMessage> &queue_;
+  mpsc_queue<InjecteeMessage> &queue_;
   injectee_config &config_;
+  remote_resolver *resolver_;
 
   injectee_client(asio::io_context &io_context, const tcp::endpoint &endpoint,
-                  blocking_queue<InjecteeMessage> &queue,
-                  injectee_config &config)
-      : socket_(io_context), endpoint_(endpoint), timer_(io_context),
-        queue_(queue), config_(config) {
+                  mpsc_queue<InjecteeMessage> &queue, injectee_config &config,
+                  remote_resolver *resolver = nullptr)
+      : socket_(io_context), input_(socket_), output_(socket_),
+        endpoint_(endpoint), timer_(io_context), queue_(queue),
+        config_(config), resolver_(resolver) {
     timer_.expires_at(std::chrono::steady_clock::time_point::max());
   }
 
   asio::awaitable<void> start() {
     co_await socket_.async_connect(endpoint_, asio::use_awaitable);
 
-    co_await async_write_message(
-        socket_, create_message<InjecteeMessage, "pid">(GetCurrentProcessId()));
+    output_.push(create_message<InjecteeMessage, "pid">(current_pid()));
+
+    // lookups bypass the event queue, which may drop messages
+    if (resolver_) {
+      resolver_->attach([this](InjecteeMessage msg) {
+        asio::post(socket_.get_executor(),
+                   [this, msg = std::move(msg)] { output_.push(msg); });
+      });
+    }
 
     asio::co_spawn(socket_.get_executor(), reader(), asio::detached);
     asio::co_spawn(socket_.get_executor(), writer(), asio::detached);
@@ -69,7 +255,7 @@ struct injectee_client : std::enable_shared_from_this<injectee_client> {
   asio::awaitable<void> reader() {
     try {
       while (true) {
-        auto msg = co_await async_read_message<InjectorMessage>(socket_);
+        auto msg = co_await input_.read<InjectorMessage>();
         asio::co_spawn(
             socket_.get_executor(),
             [this, msg = std::move(msg)] { return process(msg); },
@@ -80,11 +266,40 @@ struct injectee_client : std::enable_shared_from_this<injectee_client> {
     }
   }
 
+  // connect events that queue up while a write is in flight are sent as one
+  // "connects" frame, so batches only grow when the socket is busy
   asio::awaitable<void> writer() {
     try {
+      std::vector<InjecteeMessage> msgs;
+      InjecteeConnectBatch batch;
+      auto &connects = batch["connects"_f];
+
       while (true) {
-        InjecteeMessage msg = co_await queue_.pop();
-        co_await async_write_message(socket_, msg);
+        co_await queue_.pop_all(msgs);
+        for (const auto &msg : msgs) {
+          if (auto v = compare_message<"connect">(msg)) {
+            connects.push_back(std::move(*v));
+          } else {
+            output_.push(msg);
+          }
+        }
+        msgs.clear();
+
+        if (connects.size() == 1) {
+          output_.push(create_message<InjecteeMessage, "connect">(
+              std::move(connects.front())));
+        } else if (connects.size() > 1) {
+          output_.push(create_message<InjecteeMessage, "connects">(batch));
+        }
+        connects.clear();
+
+        if (auto [dropped, aggregated] = queue_.take_overflow();
+            dropped || aggregated) {
+          output_.push(create_message<InjecteeMessage, "overflow">(
+              InjecteeOverflow{dropped, aggregated}));
+        }
+
+        co_await output_.drained();
       }
     } catch (std::exception &) {
       stop();
@@ -93,13 +308,24 @@ struct injectee_client : std::enable_shared_from_this<injectee_client> {
 
   asio::awaitable<void> process(const InjectorMessage &msg) {
     if (auto v = compare_message<"config">(msg)) {
+      if (auto policy = (*v)["overflow"_f]) {
+        queue_.set_policy((overflow_policy)*policy);
+      }
       config_.set(*v);
+    } else if (auto v = compare_message<"resolved">(msg)) {
+      if (resolver_) {
+        resolver_->complete((*v)["id"_f].value_or(0),
+                            std::move((*v)["addrs"_f]));
+      }
     }
 
     co_return;
   }
 
   void stop() {
+    if (resolver_) {
+      resolver_->detach();
+    }
     queue_.cancel();
     config_.clear();
     socket_.close();
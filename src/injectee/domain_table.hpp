@@ -0,0 +1,240 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef PROXINJECT_INJECTEE_DOMAIN_TABLE
+#define PROXINJECT_INJECTEE_DOMAIN_TABLE
+
+#include "schema.hpp"
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// domain rules compiled into a trie over reversed labels, e.g. `a.corp.com`
+// is the path `com` -> `corp` -> `a`; patterns are
+//
+// - `a.corp.com`: exactly this domain
+// - `*.corp.com`: any subdomain of `corp.com`, but not itself
+// - `.corp.com`: `corp.com` and any subdomain of it
+//
+// the longest matching suffix wins, an exact match beats a wildcard on the
+// same node, and the first of several rules on one pattern is kept; lookups
+// are case-insensitive and do not allocate
+class domain_table {
+  static constexpr std::int8_t none = -1;
+
+  struct node {
+    std::uint32_t label_begin = 0;
+    std::uint32_t label_size = 0;
+    std::int8_t exact = none;
+    std::int8_t wildcard = none;
+  };
+
+  // edges of the trie, open-addressed by (parent, label)
+  struct edge {
+    std::uint32_t parent = empty_parent;
+    std::uint32_t child = 0;
+  };
+
+  static constexpr std::uint32_t empty_parent = ~std::uint32_t(0);
+
+  std::vector<node> nodes_;
+  std::string labels_;
+  std::vector<edge> edges_;
+  std::size_t mask_ = 0;
+
+  static char lower(char c) {
+    return c >= 'A' && c <= 'Z' ? char(c - 'A' + 'a') : c;
+  }
+
+  // FNV-1a over the lowercased label
+  static std::size_t hash(std::uint32_t parent, std::string_view label) {
+    std::uint64_t h = 0xcbf29ce484222325ull ^ parent;
+    for (char c : label) {
+      h = (h ^ (unsigned char)lower(c)) * 0x100000001b3ull;
+    }
+    return (std::size_t)(h ^ (h >> 32));
+  }
+
+  static bool equal(std::string_view stored, std::string_view label) {
+    return stored.size() == label.size() &&
+           std::equal(stored.begin(), stored.end(), label.begin(),
+                      [](char s, char l) { return s == lower(l); });
+  }
+
+  std::string_view label_of(const node &n) const {
+    return {labels_.data() + n.label_begin, n.label_size};
+  }
+
+  std::optional<std::uint32_t> child(std::uint32_t parent,
+                                     std::string_view label) const {
+    for (auto i = hash(parent, label);; ++i) {
+      const auto &e = edges_[i & mask_];
+      if (e.parent == empty_parent) {
+        return std::nullopt;
+      } else if (e.parent == parent &&
+                 equal(label_of(nodes_[e.child]), label)) {
+        return e.child;
+      }
+    }
+  }
+
+  // the trie while building, flattened afterwards
+  struct build_node {
+    std::map<std::string, std::unique_ptr<build_node>> children;
+    std::int8_t exact = none;
+    std::int8_t wildcard = none;
+  };
+
+  static void set(std::int8_t &slot, route_action action) {
+    if (slot == none) {
+      slot = (std::int8_t)action;
+    }
+  }
+
+public:
+  domain_table() = default;
+
+  template <typename Rules> explicit domain_table(const Rules &rules) {
+    build_node root;
+
+    for (const auto &rule : rules) {
+      const auto &pattern_field = rule["pattern"_f];
+      auto action = (route_action)rule["action"_f].value_or(0);
+      if (!pattern_field || action > route_action::block) {
+        continue;
+      }
+
+      std::string_view pattern = *pattern_field;
+      bool exact = true, wildcard = false;
+      if (pattern.starts_with("*.")) {
+        pattern.remove_prefix(2);
+        exact = false, wildcard = true;
+      } else if (pattern.starts_with(".")) {
+        pattern.remove_prefix(1);
+        wildcard = true;
+      }
+      if (pattern.ends_with(".")) {
+        pattern.remove_suffix(1);
+      }
+      if (pattern.empty()) {
+        continue;
+      }
+
+      build_node *current = &root;
+      while (!pattern.empty()) {
+        auto dot = pattern.find_last_of('.');
+        auto label = dot == std::string_view::npos ? pattern
+                                                   : pattern.substr(dot + 1);
+        pattern = dot == std::string_view::npos ? std::string_view{}
+                                                : pattern.substr(0, dot);
+
+        std::string key(label);
+        std::transform(key.begin(), key.end(), key.begin(), lower);
+        auto &next = current->children[key];
+        if (!next) {
+          next = std::make_unique<build_node>();
+        }
+        current = next.get();
+      }
+
+      if (exact) {
+        set(current->exact, action);
+      }
+      if (wildcard) {
+        set(current->wildcard, action);
+      }
+    }
+
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> links;
+    std::vector<const build_node *> queue{&root};
+    nodes_.emplace_back();
+    for (std::size_t i = 0; i < queue.size(); ++i) {
+      const auto &b = *queue[i];
+      nodes_[i].exact = b.exact;
+      nodes_[i].wildcard = b.wildcard;
+
+      for (const auto &[label, c] : b.children) {
+        node n;
+        n.label_begin = (std::uint32_t)labels_.size();
+        n.label_size = (std::uint32_t)label.size();
+        labels_ += label;
+        links.emplace_back((std::uint32_t)i, (std::uint32_t)nodes_.size());
+        nodes_.push_back(n);
+        queue.push_back(c.get());
+      }
+    }
+
+    // keep the load factor at most 1/2
+    edges_.resize(std::bit_ceil(std::max<std::size_t>(links.size() * 2, 2)));
+    mask_ = edges_.size() - 1;
+    for (auto [parent, c] : links) {
+      auto i = hash(parent, label_of(nodes_[c]));
+      while (edges_[i & mask_].parent != empty_parent) {
+        ++i;
+      }
+      edges_[i & mask_] = edge{parent, c};
+    }
+  }
+
+  bool empty() const { return nodes_.size() <= 1; }
+
+  std::optional<route_action> lookup(std::string_view domain) const {
+    if (empty()) {
+      return std::nullopt;
+    }
+
+    if (domain.ends_with(".")) {
+      domain.remove_suffix(1);
+    }
+
+    std::int8_t matched = none;
+    std::optional<std::uint32_t> current = 0;
+    while (!domain.empty()) {
+      auto dot = domain.find_last_of('.');
+      auto label =
+          dot == std::string_view::npos ? domain : domain.substr(dot + 1);
+      domain = dot == std::string_view::npos ? std::string_view{}
+                                             : domain.substr(0, dot);
+
+      // a wildcard applies to names below its node only
+      if (nodes_[*current].wildcard != none) {
+        matched = nodes_[*current].wildcard;
+      }
+
+      current = child(*current, label);
+      if (!current) {
+        break;
+      }
+    }
+
+    if (current && nodes_[*current].exact != none) {
+      matched = nodes_[*current].exact;
+    }
+
+    if (matched == none) {
+      return std::nullopt;
+    }
+    return (route_action)matched;
+  }
+};
+
+#endif
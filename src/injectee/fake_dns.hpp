@@ -0,0 +1,120 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef PROXINJECT_INJECTEE_FAKE_DNS
+#define PROXINJECT_INJECTEE_FAKE_DNS
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#include <WinSock2.h>
+#else
+#include <netinet/in.h>
+#endif
+
+// hands out addresses from a reserved pool in place of resolving hostnames,
+// so that a connect to one of them can send the hostname to the proxy
+//
+// the pool is 198.18.0.0/15 (RFC 2544, benchmarking), which never appears
+// as a real destination; once it is exhausted, the oldest names are evicted
+class fake_dns {
+  static constexpr std::uint32_t base = 0xC6120000; // 198.18.0.0
+  static constexpr std::uint32_t capacity = 1 << 17;
+
+  mutable std::shared_mutex mtx_;
+  std::unordered_map<std::string, std::uint32_t> offsets_;
+  // by offset, pointing into the keys of `offsets_`
+  std::vector<const std::string *> names_;
+  std::uint32_t next_ = 0;
+
+  // the network and broadcast addresses of the pool are never handed out
+  static constexpr std::uint32_t first = 1, last = capacity - 2;
+
+public:
+  fake_dns() { names_.reserve(1024); }
+
+  // the fake address (in host order) standing for `name`, stable for as
+  // long as the name is in the pool
+  std::uint32_t assign(std::string_view name) {
+    std::string key(name);
+    std::transform(key.begin(), key.end(), key.begin(),
+                   [](unsigned char c) { return (char)std::tolower(c); });
+
+    {
+      std::shared_lock guard(mtx_);
+      if (auto iter = offsets_.find(key); iter != offsets_.end()) {
+        return base + iter->second;
+      }
+    }
+
+    std::lock_guard guard(mtx_);
+    if (auto iter = offsets_.find(key); iter != offsets_.end()) {
+      return base + iter->second;
+    }
+
+    auto offset = first + next_;
+    next_ = (next_ + 1) % (last - first + 1);
+
+    auto index = offset - first;
+    if (index < names_.size()) {
+      offsets_.erase(*names_[index]);
+    } else {
+      names_.push_back(nullptr);
+    }
+
+    names_[index] = &offsets_.emplace(std::move(key), offset).first->first;
+    return base + offset;
+  }
+
+  // the name behind `addr` if it is a fake address handed out here
+  std::optional<std::string> lookup(const sockaddr *addr) const {
+    if (addr->sa_family != AF_INET) {
+      return std::nullopt;
+    }
+
+    auto v4 = ntohl(((const sockaddr_in *)addr)->sin_addr.s_addr);
+    if (v4 < base + first || v4 > base + last) {
+      return std::nullopt;
+    }
+
+    std::shared_lock guard(mtx_);
+    auto index = v4 - base - first;
+    if (index >= names_.size()) {
+      return std::nullopt;
+    }
+    return *names_[index];
+  }
+
+  static bool contains(const sockaddr *addr) {
+    if (addr->sa_family != AF_INET) {
+      return false;
+    }
+
+    auto v4 = ntohl(((const sockaddr_in *)addr)->sin_addr.s_addr);
+    return v4 >= base && v4 < base + capacity;
+  }
+};
+
+#endif
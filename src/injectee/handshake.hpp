@@ -0,0 +1,624 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PROXINJECT_INJECTEE_HANDSHAKE
+#define PROXINJECT_INJECTEE_HANDSHAKE
+
+#include "client.hpp"
+#include "minhook.hpp"
+#include "socket_table.hpp"
+#include "socks5.hpp"
+#include "winnet.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <protopuf/fixed_string.h>
+#include <span>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+struct hook_ioctlsocket;
+struct hook_closesocket;
+struct hook_WSAAsyncSelect;
+struct hook_WSAEventSelect;
+struct hook_send;
+struct hook_recv;
+struct hook_WSASend;
+struct hook_WSARecv;
+template <auto F, pp::basic_fixed_string N> struct hook_connect_fn;
+
+// the driver must bypass its own hooks while talking to the proxy
+template <auto F, typename H>
+inline auto &original_of = minhook::api<F, H>::original;
+
+// how the application asked to be notified about a socket, so that the
+// notification can be held back until the proxy handshake has finished
+struct select_registration {
+  HWND hwnd = nullptr;
+  u_int msg = 0;
+  WSAEVENT event = nullptr;
+  long events = 0;
+};
+
+// the completion port the application has associated a socket with
+struct completion_binding {
+  HANDLE port = nullptr;
+  ULONG_PTR key = 0;
+  bool skip_on_success = false;
+};
+
+// the NTSTATUS that WSAGetOverlappedResult turns back into `error`
+inline LONG ntstatus_of(int error) {
+  switch (error) {
+  case 0:
+    return 0;
+  case WSAETIMEDOUT:
+    return (LONG)0xC00000B5L; // STATUS_IO_TIMEOUT
+  case WSAECONNRESET:
+    return (LONG)0xC000020DL; // STATUS_CONNECTION_RESET
+  case WSAECONNABORTED:
+    return (LONG)0xC0000241L; // STATUS_CONNECTION_ABORTED
+  case WSAENETUNREACH:
+    return (LONG)0xC000023CL; // STATUS_NETWORK_UNREACHABLE
+  case WSAEHOSTUNREACH:
+    return (LONG)0xC000023DL; // STATUS_HOST_UNREACHABLE
+  case WSAEMSGSIZE:
+    return (LONG)0x80000005L; // STATUS_BUFFER_OVERFLOW
+  case WSA_OPERATION_ABORTED:
+    return (LONG)0xC0000120L; // STATUS_CANCELLED
+  default:
+    return (LONG)0xC0000236L; // STATUS_CONNECTION_REFUSED
+  }
+}
+
+// queues a completion packet carrying `status`, so that
+// GetQueuedCompletionStatus fails with the matching error like it does for
+// an operation winsock has failed; PostQueuedCompletionStatus cannot do that
+inline void post_completion(const completion_binding &binding,
+                            LPOVERLAPPED overlapped, LONG status,
+                            DWORD bytes) {
+  using set_io_completion_fn =
+      LONG(NTAPI *)(HANDLE, PVOID, PVOID, LONG, ULONG_PTR);
+  static auto set_io_completion = (set_io_completion_fn)GetProcAddress(
+      GetModuleHandleW(L"ntdll.dll"), "NtSetIoCompletion");
+
+  if (set_io_completion) {
+    set_io_completion(binding.port, (PVOID)binding.key, overlapped, status,
+                      bytes);
+  } else {
+    PostQueuedCompletionStatus(binding.port, bytes, binding.key, overlapped);
+  }
+}
+
+struct pending_handshake {
+  SOCKET sock;
+  std::shared_ptr<const config_snapshot> config;
+  const upstream *proxy; // owned by `config`
+  proxy_chain client;
+  std::chrono::steady_clock::time_point deadline;
+  bool nonblocking;
+  LPOVERLAPPED overlapped;
+  WSABUF payload;
+  const char *syscall = nullptr;
+  // for sockets of the injectee's own, called once the handshake is over
+  std::function<void(const pending_handshake &, bool)> done;
+};
+
+// defined along with the hooks, which own the event queue
+inline void log_chain(SOCKET s, const config_snapshot &snapshot,
+                      const proxy_chain &client, const char *syscall);
+
+// connects `s` to `proxy` once more, before `deadline`, leaving it blocking;
+// defined along with the ConnectEx hook it needs
+inline bool reconnect_proxy(SOCKET s, const upstream &proxy,
+                            std::chrono::steady_clock::time_point deadline);
+
+// moves a handshake on a non-blocking socket forward by the events polled
+// for it, returns whether it succeeded once it has finished
+inline std::optional<bool> advance_handshake(pending_handshake &h,
+                                             short revents) {
+  if ((revents & POLLWRNORM) && h.client.want_write()) {
+    auto out = h.client.output();
+    int n =
+        original_of<send, hook_send>(h.sock, out.data(), (int)out.size(), 0);
+    if (n > 0) {
+      h.client.sent(n);
+    } else if (WSAGetLastError() != WSAEWOULDBLOCK) {
+      h.client.closed();
+      return false;
+    }
+  }
+
+  if ((revents & (POLLRDNORM | POLLHUP)) && h.client.want_read()) {
+    auto in = h.client.input();
+    auto peek = h.client.peek();
+    int n = original_of<recv, hook_recv>(h.sock, in.data(), (int)in.size(),
+                                         peek ? MSG_PEEK : 0);
+    if (n > 0) {
+      // what the handshake used of peeked bytes is taken off the socket
+      auto used = (int)h.client.received(n);
+      if (peek) {
+        original_of<recv, hook_recv>(h.sock, in.data(), used, 0);
+      }
+    } else if (n == 0 || WSAGetLastError() != WSAEWOULDBLOCK) {
+      h.client.closed();
+      return false;
+    }
+  }
+
+  if (h.client.done() || h.client.failed()) {
+    return h.client.done();
+  }
+
+  if (revents & (POLLERR | POLLNVAL)) {
+    h.client.closed();
+    return false;
+  } else if (std::chrono::steady_clock::now() >= h.deadline) {
+    return false;
+  }
+
+  return std::nullopt;
+}
+
+// gives a handshake that the proxy refused to pipeline one sequential try on
+// a new connection, returns whether it is running again; the connection is
+// made synchronously, but never past the deadline
+inline bool retry_sequential(pending_handshake &h) {
+  if (!config_snapshot::pipeline_refused(h.client)) {
+    return false;
+  }
+
+  h.config->report(*h.proxy, h.client);
+  h.client.restart();
+  if (!reconnect_proxy(h.sock, *h.proxy, h.deadline)) {
+    return false;
+  }
+
+  u_long nb = TRUE;
+  original_of<ioctlsocket, hook_ioctlsocket>(h.sock, FIONBIO, &nb);
+  return true;
+}
+
+// runs SOCKS5 handshakes of non-blocking and overlapped sockets on a single
+// thread polling all of them, so that hooked calls can return immediately
+class handshake_driver {
+  std::mutex mtx_;
+  std::vector<pending_handshake> incoming_;
+  std::unordered_map<SOCKET, select_registration> registrations_;
+  std::unordered_map<SOCKET, completion_binding> ports_;
+  socket_table<SOCKET> pending_;
+
+  // sockets closed by the application while their handshake may be active,
+  // and a count of the times the driver has dropped them
+  std::vector<SOCKET> closed_;
+  std::uint64_t sweeps_ = 0;
+  std::condition_variable swept_;
+  // the socket whose finished handshake is being reported to the application
+  SOCKET finishing_ = INVALID_SOCKET;
+
+  SOCKET wakeup_;
+  sockaddr_in wakeup_addr_{};
+  std::atomic<bool> stopped_ = false;
+  std::thread thread_;
+
+  static void apply(SOCKET s, const select_registration &reg) {
+    if (reg.event) {
+      original_of<WSAEventSelect, hook_WSAEventSelect>(s, reg.event,
+                                                       reg.events);
+    } else {
+      original_of<WSAAsyncSelect, hook_WSAAsyncSelect>(s, reg.hwnd, reg.msg,
+                                                       reg.events);
+    }
+  }
+
+  static void suspend(SOCKET s, const select_registration &reg) {
+    apply(s, select_registration{reg.hwnd, 0, reg.event, 0});
+  }
+
+  std::optional<completion_binding> binding_locked(SOCKET s) const {
+    if (auto iter = ports_.find(s); iter != ports_.end()) {
+      return iter->second;
+    }
+
+    return std::nullopt;
+  }
+
+  void wake() {
+    char c = 0;
+    sendto(wakeup_, &c, 1, 0, (const sockaddr *)&wakeup_addr_,
+           sizeof(wakeup_addr_));
+  }
+
+  // the payload is sent on the application's OVERLAPPED, so that winsock
+  // delivers the completion through whatever mechanism it has set up
+  void complete(pending_handshake &h, bool success) {
+    int error = std::chrono::steady_clock::now() >= h.deadline
+                    ? WSAETIMEDOUT
+                    : WSAECONNREFUSED;
+    if (success) {
+      DWORD sent = 0;
+      if (original_of<WSASend, hook_WSASend>(h.sock, &h.payload, 1, &sent, 0,
+                                             h.overlapped, nullptr) == 0) {
+        // the connect was reported pending, so its packet must not be skipped
+        if (auto binding = binding_of(h.sock);
+            binding && binding->skip_on_success) {
+          complete(h.sock, h.overlapped, 0, sent);
+        }
+        return;
+      }
+
+      if (WSAGetLastError() == WSA_IO_PENDING) {
+        return;
+      }
+      error = WSAGetLastError();
+    }
+
+    shutdown(h.sock, SD_BOTH);
+    complete(h.sock, h.overlapped, error, 0);
+  }
+
+  void restore(const pending_handshake &h) {
+    u_long nb = h.nonblocking;
+    original_of<ioctlsocket, hook_ioctlsocket>(h.sock, FIONBIO, &nb);
+
+    std::optional<select_registration> reg;
+    {
+      std::lock_guard guard(mtx_);
+      pending_.clear(h.sock);
+      if (auto iter = registrations_.find(h.sock);
+          iter != registrations_.end()) {
+        reg = iter->second;
+      }
+    }
+
+    // registering again makes winsock report FD_CONNECT/FD_WRITE right away
+    if (reg) {
+      apply(h.sock, *reg);
+    }
+  }
+
+  void finish(pending_handshake &h, bool success) {
+    h.config->report(*h.proxy, h.client);
+    log_chain(h.sock, *h.config, h.client, h.syscall);
+    restore(h);
+
+    if (h.done) {
+      h.done(h, success);
+    } else if (h.overlapped) {
+      complete(h, success);
+    } else if (!success) {
+      shutdown(h.sock, SD_BOTH);
+    }
+  }
+
+  void run() {
+    std::vector<pending_handshake> active;
+    std::vector<WSAPOLLFD> fds;
+
+    while (!stopped_) {
+      std::vector<std::pair<LPOVERLAPPED, std::optional<completion_binding>>>
+          aborted;
+      {
+        std::lock_guard guard(mtx_);
+        for (auto &h : incoming_) {
+          active.push_back(std::move(h));
+        }
+        incoming_.clear();
+
+        // the handles of closed sockets are not touched again, as they may
+        // already belong to new ones
+        for (auto s : closed_) {
+          for (size_t i = active.size(); i-- > 0;) {
+            if (active[i].sock != s) {
+              continue;
+            }
+            if (active[i].overlapped) {
+              aborted.emplace_back(active[i].overlapped, binding_locked(s));
+            }
+            active[i] = std::move(active.back());
+            active.pop_back();
+          }
+        }
+        if (!closed_.empty()) {
+          closed_.clear();
+          ++sweeps_;
+          swept_.notify_all();
+        }
+      }
+
+      for (const auto &[overlapped, binding] : aborted) {
+        complete(binding, overlapped, WSA_OPERATION_ABORTED, 0);
+      }
+
+      auto now = std::chrono::steady_clock::now();
+      int timeout = -1;
+
+      fds.clear();
+      fds.push_back({wakeup_, POLLRDNORM, 0});
+      for (const auto &h : active) {
+        short events = 0;
+        if (h.client.want_write())
+          events |= POLLWRNORM;
+        if (h.client.want_read())
+          events |= POLLRDNORM;
+        fds.push_back({h.sock, events, 0});
+
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        h.deadline - now)
+                        .count();
+        left = std::max<long long>(left, 0);
+        if (timeout < 0 || left < timeout) {
+          timeout = (int)left;
+        }
+      }
+
+      if (WSAPoll(fds.data(), (ULONG)fds.size(), timeout) == SOCKET_ERROR) {
+        continue;
+      }
+
+      if (fds[0].revents) {
+        char buf[64];
+        while (recv(wakeup_, buf, sizeof(buf), 0) > 0)
+          ;
+      }
+
+      for (size_t i = active.size(); i-- > 0;) {
+        if (auto success = advance_handshake(active[i], fds[i + 1].revents)) {
+          if (!*success && retry_sequential(active[i])) {
+            continue;
+          }
+
+          {
+            std::lock_guard guard(mtx_);
+            finishing_ = active[i].sock;
+          }
+          finish(active[i], *success);
+          {
+            std::lock_guard guard(mtx_);
+            finishing_ = INVALID_SOCKET;
+          }
+          active[i] = std::move(active.back());
+          active.pop_back();
+        }
+      }
+    }
+  }
+
+public:
+  static constexpr auto timeout = std::chrono::seconds(30);
+
+  handshake_driver() : wakeup_(socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) {
+    wakeup_addr_.sin_family = AF_INET;
+    wakeup_addr_.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int size = sizeof(wakeup_addr_);
+    bind(wakeup_, (const sockaddr *)&wakeup_addr_, size);
+    getsockname(wakeup_, (sockaddr *)&wakeup_addr_, &size);
+
+    u_long nb = TRUE;
+    original_of<ioctlsocket, hook_ioctlsocket>(wakeup_, FIONBIO, &nb);
+
+    thread_ = std::thread([this] { run(); });
+  }
+
+  handshake_driver(const handshake_driver &) = delete;
+
+  ~handshake_driver() {
+    {
+      std::lock_guard guard(mtx_);
+      stopped_ = true;
+    }
+    swept_.notify_all();
+    wake();
+    thread_.join();
+    closesocket(wakeup_);
+  }
+
+  // whether application I/O on `s` must wait for the proxy handshake
+  bool in_progress(SOCKET s) const { return pending_.get(s); }
+
+  // records a WSAEventSelect/WSAAsyncSelect call, returns true if it has to
+  // be deferred because a handshake is in progress on the socket
+  bool remember(SOCKET s, const select_registration &reg) {
+    std::lock_guard guard(mtx_);
+    if (reg.events) {
+      registrations_[s] = reg;
+    } else {
+      registrations_.erase(s);
+    }
+
+    return pending_.get(s);
+  }
+
+  // drops what is known of `s`, which the application is closing; a
+  // handshake still running on it is abandoned, and its overlapped connect
+  // completes as aborted, before the handle is closed
+  void forget(SOCKET s) {
+    std::vector<pending_handshake> dropped;
+    {
+      std::unique_lock lock(mtx_);
+      registrations_.erase(s);
+
+      for (size_t i = incoming_.size(); i-- > 0;) {
+        if (incoming_[i].sock == s) {
+          dropped.push_back(std::move(incoming_[i]));
+          incoming_.erase(incoming_.begin() + i);
+        }
+      }
+
+      // the driver thread closes only sockets of its own, which never get
+      // here, so waiting for it cannot deadlock
+      if ((pending_.get(s) || finishing_ == s) && !stopped_ &&
+          std::this_thread::get_id() != thread_.get_id()) {
+        closed_.push_back(s);
+        auto sweep = sweeps_;
+        lock.unlock();
+        wake();
+        lock.lock();
+        swept_.wait(lock, [&] { return sweeps_ != sweep || stopped_; });
+      }
+    }
+
+    for (auto &h : dropped) {
+      if (h.overlapped) {
+        complete(s, h.overlapped, WSA_OPERATION_ABORTED, 0);
+      }
+    }
+
+    std::lock_guard guard(mtx_);
+    pending_.clear(s);
+    ports_.erase(s);
+  }
+
+  // records a CreateIoCompletionPort call associating `s` with `port`
+  void bind(SOCKET s, HANDLE port, ULONG_PTR key) {
+    std::lock_guard guard(mtx_);
+    auto &binding = ports_[s];
+    binding.port = port;
+    binding.key = key;
+  }
+
+  // records a SetFileCompletionNotificationModes call on `s`
+  void notify_modes(SOCKET s, UCHAR flags) {
+    std::lock_guard guard(mtx_);
+    if (auto iter = ports_.find(s); iter != ports_.end()) {
+      iter->second.skip_on_success =
+          flags & FILE_SKIP_COMPLETION_PORT_ON_SUCCESS;
+    }
+  }
+
+  // the completion port the application has associated `s` with, if any
+  std::optional<completion_binding> binding_of(SOCKET s) {
+    std::lock_guard guard(mtx_);
+    return binding_locked(s);
+  }
+
+  // completes an overlapped operation of the application on `s` with
+  // `error`, or 0 for success, notifying it the way winsock would: by its
+  // event and, unless the low bit of the event opts out, its completion port
+  void complete(SOCKET s, LPOVERLAPPED overlapped, int error, DWORD bytes) {
+    complete(binding_of(s), overlapped, error, bytes);
+  }
+
+  // the same for a socket whose completion port has been looked up before,
+  // which an operation outliving the socket needs
+  static void complete(const std::optional<completion_binding> &binding,
+                       LPOVERLAPPED overlapped, int error, DWORD bytes) {
+    auto status = ntstatus_of(error);
+    overlapped->Internal = (ULONG_PTR)status;
+    overlapped->InternalHigh = bytes;
+
+    auto event = (ULONG_PTR)overlapped->hEvent;
+    if (event & ~(ULONG_PTR)1) {
+      SetEvent((HANDLE)(event & ~(ULONG_PTR)1));
+    }
+
+    if (binding && !(event & 1)) {
+      post_completion(*binding, overlapped, status, bytes);
+    }
+  }
+
+  // connects `s` to `proxy`, an upstream of `config`, and runs the handshake
+  // in the background; on false, the error of connecting is left in
+  // WSAGetLastError
+  bool start(SOCKET s, std::shared_ptr<const config_snapshot> config,
+             const upstream &proxy, std::span<const char> request,
+             const char *syscall, bool nonblocking,
+             LPOVERLAPPED overlapped = nullptr,
+             PVOID payload = nullptr, DWORD payload_size = 0) {
+    return launch(pending_handshake{
+        s,
+        config,
+        &proxy,
+        proxy_chain(request, proxy.protocol, config->chain,
+                    config->pipelining()),
+        std::chrono::steady_clock::now() + timeout,
+        nonblocking,
+        overlapped,
+        {payload_size, (CHAR *)payload},
+        syscall});
+  }
+
+  // the same for `s`, a socket that the application does not know about,
+  // calling `done` on the driver thread once the handshake is over (unless
+  // false is returned); its deadline is the connect timeout of `config`
+  bool start_own(SOCKET s, std::shared_ptr<const config_snapshot> config,
+                 const upstream &proxy, std::span<const char> request,
+                 const char *syscall,
+                 std::function<void(const pending_handshake &, bool)> done) {
+    auto deadline = std::chrono::steady_clock::now() + config->connect_timeout;
+    return launch(pending_handshake{
+        s,
+        config,
+        &proxy,
+        proxy_chain(request, proxy.protocol, config->chain,
+                    config->pipelining()),
+        deadline,
+        false,
+        nullptr,
+        {},
+        syscall,
+        std::move(done)});
+  }
+
+private:
+  bool launch(pending_handshake h) {
+    auto s = h.sock;
+
+    // a chain with a hop that cannot be encoded never reaches the proxy
+    if (h.client.failed()) {
+      WSASetLastError(WSAECONNREFUSED);
+      return false;
+    }
+
+    {
+      std::lock_guard guard(mtx_);
+      if (pending_.get(s)) {
+        WSASetLastError(WSAEALREADY);
+        return false;
+      }
+      pending_.set(s, true);
+      if (auto iter = registrations_.find(s); iter != registrations_.end()) {
+        suspend(s, iter->second);
+      }
+    }
+
+    u_long nb = TRUE;
+    original_of<ioctlsocket, hook_ioctlsocket>(s, FIONBIO, &nb);
+
+    if (original_of<connect, hook_connect_fn<connect, "connect">>(
+            s, h.proxy->get(), h.proxy->size) == SOCKET_ERROR &&
+        WSAGetLastError() != WSAEWOULDBLOCK) {
+      int err = WSAGetLastError();
+      restore(h);
+      WSASetLastError(err);
+      return false;
+    }
+
+    {
+      std::lock_guard guard(mtx_);
+      incoming_.push_back(std::move(h));
+    }
+    wake();
+
+    return true;
+  }
+};
+
+#endif
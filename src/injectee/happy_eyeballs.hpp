@@ -0,0 +1,195 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef PROXINJECT_INJECTEE_HAPPY_EYEBALLS
+#define PROXINJECT_INJECTEE_HAPPY_EYEBALLS
+
+#include "client.hpp"
+#include "handshake.hpp"
+#include "winnet.hpp"
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+
+// an address of a connect call that would be proxied
+struct race_candidate {
+  std::size_t index; // into the address list of the call
+  const sockaddr *name;
+  std::optional<IpAddr> fake; // the hostname behind a fake address
+};
+
+struct race_winner {
+  std::size_t index;
+  const upstream *proxy; // owned by the snapshot raced with
+};
+
+// the order of attempts, alternating between address families starting from
+// the first one listed, as RFC 8305 recommends
+inline std::vector<race_candidate>
+interleave_families(std::span<const race_candidate> candidates) {
+  std::vector<race_candidate> first, second;
+  for (const auto &c : candidates) {
+    (c.name->sa_family == candidates.front().name->sa_family ? first : second)
+        .push_back(c);
+  }
+
+  std::vector<race_candidate> order;
+  for (std::size_t i = 0; i < std::max(first.size(), second.size()); ++i) {
+    if (i < first.size())
+      order.push_back(first[i]);
+    if (i < second.size())
+      order.push_back(second[i]);
+  }
+
+  return order;
+}
+
+// races proxy handshakes for `candidates` on helper sockets, starting one
+// every `delay` or as soon as the previous attempts have all failed, and
+// returns the first to succeed; the helpers are all closed on return, since
+// a tunnel cannot be moved into another socket
+inline std::optional<race_winner>
+race_proxied(const std::shared_ptr<const config_snapshot> &snapshot,
+             std::span<const race_candidate> candidates,
+             std::chrono::steady_clock::time_point deadline,
+             std::chrono::milliseconds delay = std::chrono::milliseconds(250)) {
+  auto order = interleave_families(candidates);
+
+  std::vector<pending_handshake> attempts;
+  std::vector<race_candidate> targets;
+  std::vector<WSAPOLLFD> fds;
+  std::optional<race_winner> winner;
+
+  auto close = [](SOCKET s) {
+    original_of<closesocket, hook_closesocket>(s);
+  };
+
+  auto launch = [&](const race_candidate &c) {
+    auto proxy = snapshot->pick(route_action::proxy);
+    char req[SOCKS_REQUEST_MAX_SIZE];
+    auto size = c.fake ? socks5_encode_request(req, *c.fake)
+                       : socks5_encode_request(req, c.name);
+    if (!proxy || !size) {
+      return;
+    }
+
+    SOCKET sock = socket(proxy->get()->sa_family, SOCK_STREAM, IPPROTO_TCP);
+    if (sock == INVALID_SOCKET) {
+      return;
+    }
+
+    u_long nb = TRUE;
+    original_of<ioctlsocket, hook_ioctlsocket>(sock, FIONBIO, &nb);
+
+    if (original_of<connect, hook_connect_fn<connect, "connect">>(
+            sock, proxy->get(), proxy->size) == SOCKET_ERROR &&
+        WSAGetLastError() != WSAEWOULDBLOCK) {
+      close(sock);
+      return;
+    }
+
+    attempts.push_back({sock,
+                        snapshot,
+                        proxy,
+                        proxy_chain({req, size}, proxy->protocol,
+                                    snapshot->chain, snapshot->pipelining()),
+                        deadline,
+                        true,
+                        nullptr,
+                        {}});
+    targets.push_back(c);
+  };
+
+  std::size_t next = 0;
+  auto next_start = std::chrono::steady_clock::now();
+
+  while (!winner) {
+    auto now = std::chrono::steady_clock::now();
+    if (now >= deadline) {
+      break;
+    }
+
+    if (next < order.size() && (attempts.empty() || now >= next_start)) {
+      launch(order[next++]);
+      next_start = now + delay;
+      continue;
+    }
+
+    if (attempts.empty()) {
+      break;
+    }
+
+    auto until =
+        next < order.size() ? std::min(next_start, deadline) : deadline;
+    auto timeout =
+        std::chrono::duration_cast<std::chrono::milliseconds>(until - now);
+
+    fds.clear();
+    for (const auto &h : attempts) {
+      short events = 0;
+      if (h.client.want_write())
+        events |= POLLWRNORM;
+      if (h.client.want_read())
+        events |= POLLRDNORM;
+      fds.push_back({h.sock, events, 0});
+    }
+
+    if (WSAPoll(fds.data(), (ULONG)fds.size(),
+                (INT)std::max<long long>(timeout.count(), 0)) ==
+        SOCKET_ERROR) {
+      break;
+    }
+
+    for (std::size_t i = attempts.size(); i-- > 0;) {
+      auto &h = attempts[i];
+      if (auto success = advance_handshake(h, fds[i].revents)) {
+        snapshot->report(*h.proxy, h.client);
+        if (*success && !winner) {
+          winner = race_winner{targets[i].index, h.proxy};
+        }
+
+        // a proxy refusing the pipelined handshake is asked once more in
+        // sequence, on a new helper since pipelining is now off
+        auto retry =
+            !*success && config_snapshot::pipeline_refused(h.client)
+                ? std::optional<race_candidate>(targets[i])
+                : std::nullopt;
+
+        close(h.sock);
+        attempts[i] = std::move(attempts.back());
+        attempts.pop_back();
+        targets[i] = targets.back();
+        targets.pop_back();
+
+        if (retry) {
+          launch(*retry);
+        }
+      }
+    }
+  }
+
+  // the losers are cancelled without counting against their upstreams
+  for (const auto &h : attempts) {
+    close(h.sock);
+  }
+
+  return winner;
+}
+
+#endif
@@ -17,22 +17,37 @@
 #define PROXINJECT_INJECTEE_HOOK
 
 #include "client.hpp"
+#include "fake_dns.hpp"
+#include "handshake.hpp"
+#include "happy_eyeballs.hpp"
 #include "minhook.hpp"
+#include "socket_table.hpp"
 #include "socks5.hpp"
+#include "udp_relay.hpp"
 #include "utils.hpp"
 #include "winnet.hpp"
+#include <condition_variable>
 #include <map>
+#include <numeric>
 #include <protopuf/fixed_string.h>
 #include <string>
+#include <unordered_set>
 
-inline blocking_queue<InjecteeMessage> *queue = nullptr;
+inline mpsc_queue<InjecteeMessage> *queue = nullptr;
 inline injectee_config *config = nullptr;
-inline std::map<SOCKET, bool> *nbio_map = nullptr;
+inline socket_table<SOCKET> *nbio_map = nullptr;
+inline handshake_driver *handshakes = nullptr;
+inline fake_dns *fake_names = nullptr;
+inline remote_resolver *resolver = nullptr;
+inline udp_associations<SOCKET> *udp = nullptr;
+
+class overlapped_receives;
+inline overlapped_receives *receives = nullptr;
 
 struct hook_ioctlsocket : minhook::api<ioctlsocket, hook_ioctlsocket> {
   static int WSAAPI detour(SOCKET s, long cmd, u_long FAR *argp) {
     if (nbio_map && cmd == FIONBIO) {
-      (*nbio_map)[s] = *argp;
+      nbio_map->set(s, *argp);
     }
 
     return original(s, cmd, argp);
@@ -41,7 +56,12 @@ struct hook_ioctlsocket : minhook::api<ioctlsocket, hook_ioctlsocket> {
 struct hook_WSAAsyncSelect : minhook::api<WSAAsyncSelect, hook_WSAAsyncSelect> {
   static int WSAAPI detour(SOCKET s, HWND hWnd, u_int wMsg, long lEvent) {
     if (nbio_map) {
-      (*nbio_map)[s] = true;
+      nbio_map->set(s, true);
+    }
+
+    if (handshakes &&
+        handshakes->remember(s, select_registration{hWnd, wMsg, {}, lEvent})) {
+      return 0;
     }
 
     return original(s, hWnd, wMsg, lEvent);
@@ -51,26 +71,164 @@ struct hook_WSAEventSelect : minhook::api<WSAEventSelect, hook_WSAEventSelect> {
   static int WSAAPI detour(SOCKET s, WSAEVENT hEventObject,
                            long lNetworkEvents) {
     if (nbio_map) {
-      (*nbio_map)[s] = true;
+      nbio_map->set(s, true);
+    }
+
+    if (handshakes &&
+        handshakes->remember(
+            s, select_registration{{}, {}, hEventObject, lNetworkEvents})) {
+      return 0;
     }
 
     return original(s, hEventObject, lNetworkEvents);
   }
 };
+struct hook_closesocket : minhook::api<closesocket, hook_closesocket> {
+  static int WSAAPI detour(SOCKET s) {
+    if (nbio_map) {
+      nbio_map->clear(s);
+    }
+    if (handshakes) {
+      handshakes->forget(s);
+    }
+    if (udp) {
+      auto control = udp->remove(s);
+      if (control && *control != INVALID_SOCKET) {
+        original(*control);
+      }
+    }
+
+    return original(s);
+  }
+};
+
+// overlapped operations the injectee completes by itself have to reach the
+// completion port the application has associated the socket with
+struct hook_CreateIoCompletionPort
+    : minhook::api<CreateIoCompletionPort, hook_CreateIoCompletionPort> {
+  static HANDLE WINAPI detour(HANDLE FileHandle, HANDLE ExistingCompletionPort,
+                              ULONG_PTR CompletionKey,
+                              DWORD NumberOfConcurrentThreads) {
+    auto port = original(FileHandle, ExistingCompletionPort, CompletionKey,
+                         NumberOfConcurrentThreads);
+
+    int type = 0;
+    int size = sizeof(type);
+    if (port && handshakes && FileHandle != INVALID_HANDLE_VALUE &&
+        getsockopt((SOCKET)FileHandle, SOL_SOCKET, SO_TYPE, (char *)&type,
+                   &size) == 0) {
+      handshakes->bind((SOCKET)FileHandle, port, CompletionKey);
+    }
+
+    return port;
+  }
+};
+
+struct hook_SetFileCompletionNotificationModes
+    : minhook::api<SetFileCompletionNotificationModes,
+                   hook_SetFileCompletionNotificationModes> {
+  static BOOL WINAPI detour(HANDLE FileHandle, UCHAR Flags) {
+    auto ret = original(FileHandle, Flags);
+    if (ret && handshakes) {
+      handshakes->notify_modes((SOCKET)FileHandle, Flags);
+    }
+
+    return ret;
+  }
+};
+
+// application I/O must not interleave with a proxy handshake in progress
+inline bool handshake_in_progress(SOCKET s) {
+  if (handshakes && handshakes->in_progress(s)) {
+    WSASetLastError(WSAEWOULDBLOCK);
+    return true;
+  }
+
+  return false;
+}
+
+// receives on `s` for the application if it has a UDP association that has
+// not been refused, unwrapping datagrams from the relay; nullopt if it has
+// none, or if the receive is overlapped and cannot be carried out; defined
+// along with the datagram hooks
+inline std::optional<int>
+receive_datagram(SOCKET s, LPWSABUF bufs, DWORD count, LPDWORD received,
+                 LPDWORD flags, sockaddr *from, LPINT fromlen, LPWSAMSG msg,
+                 LPWSAOVERLAPPED overlapped,
+                 LPWSAOVERLAPPED_COMPLETION_ROUTINE routine);
+
+struct hook_send : minhook::api<send, hook_send> {
+  static int WSAAPI detour(SOCKET s, const char *buf, int len, int flags) {
+    if (handshake_in_progress(s)) {
+      return SOCKET_ERROR;
+    }
+
+    return original(s, buf, len, flags);
+  }
+};
+struct hook_recv : minhook::api<recv, hook_recv> {
+  static int WSAAPI detour(SOCKET s, char *buf, int len, int flags) {
+    if (handshake_in_progress(s)) {
+      return SOCKET_ERROR;
+    }
+
+    WSABUF one{(ULONG)len, buf};
+    DWORD received = 0, in_flags = flags;
+    if (auto ret = receive_datagram(s, &one, 1, &received, &in_flags, nullptr,
+                                    nullptr, nullptr, nullptr, nullptr)) {
+      return *ret == SOCKET_ERROR ? SOCKET_ERROR : (int)received;
+    }
+
+    return original(s, buf, len, flags);
+  }
+};
+struct hook_WSASend : minhook::api<WSASend, hook_WSASend> {
+  static int WSAAPI
+  detour(SOCKET s, LPWSABUF lpBuffers, DWORD dwBufferCount,
+         LPDWORD lpNumberOfBytesSent, DWORD dwFlags,
+         LPWSAOVERLAPPED lpOverlapped,
+         LPWSAOVERLAPPED_COMPLETION_ROUTINE lpCompletionRoutine) {
+    if (handshake_in_progress(s)) {
+      return SOCKET_ERROR;
+    }
 
+    return original(s, lpBuffers, dwBufferCount, lpNumberOfBytesSent, dwFlags,
+                    lpOverlapped, lpCompletionRoutine);
+  }
+};
+struct hook_WSARecv : minhook::api<WSARecv, hook_WSARecv> {
+  static int WSAAPI
+  detour(SOCKET s, LPWSABUF lpBuffers, DWORD dwBufferCount,
+         LPDWORD lpNumberOfBytesRecvd, LPDWORD lpFlags,
+         LPWSAOVERLAPPED lpOverlapped,
+         LPWSAOVERLAPPED_COMPLETION_ROUTINE lpCompletionRoutine) {
+    if (handshake_in_progress(s)) {
+      return SOCKET_ERROR;
+    }
+
+    if (auto ret = receive_datagram(s, lpBuffers, dwBufferCount,
+                                    lpNumberOfBytesRecvd, lpFlags, nullptr,
+                                    nullptr, nullptr, lpOverlapped,
+                                    lpCompletionRoutine)) {
+      return *ret;
+    }
+
+    return original(s, lpBuffers, dwBufferCount, lpNumberOfBytesRecvd, lpFlags,
+                    lpOverlapped, lpCompletionRoutine);
+  }
+};
+
+// switches a socket to blocking mode (or the other way) for the scope,
+// restoring the mode the application has set afterwards
 struct blocking_scope {
   SOCKET sock;
 
-  blocking_scope(SOCKET s) : sock(s) {
-    u_long nb = FALSE;
+  blocking_scope(SOCKET s, u_long nb = FALSE) : sock(s) {
     hook_ioctlsocket::original(sock, FIONBIO, &nb);
   }
   ~blocking_scope() {
     if (nbio_map) {
-      u_long nb = FALSE;
-      if (auto iter = nbio_map->find(sock); iter != nbio_map->end()) {
-        nb = (u_long)iter->second;
-      }
+      u_long nb = nbio_map->get(sock);
       hook_ioctlsocket::original(sock, FIONBIO, &nb);
     }
   }
@@ -79,6 +237,225 @@ struct blocking_scope {
   blocking_scope(blocking_scope &&) = delete;
 };
 
+// reports how long the hops of a chained handshake took, which the connect
+// event sent before it cannot tell
+inline void log_chain(SOCKET s, const config_snapshot &snapshot,
+                      const proxy_chain &client, const char *syscall) {
+  if (!queue || !snapshot.log || snapshot.chain.empty() || !syscall) {
+    return;
+  }
+
+  InjecteeTiming timing;
+  timing["handle"_f] = (std::uint32_t)s;
+  timing["syscall"_f] = syscall;
+  timing["hop_us"_f] = client.hop_us();
+  if (!timing["hop_us"_f].empty()) {
+    timing["handshake_us"_f] = std::accumulate(
+        timing["hop_us"_f].begin(), timing["hop_us"_f].end(), 0u);
+  }
+  timing["success"_f] = client.done();
+  timing["timed_out"_f] = false;
+  queue->push(create_message<InjecteeMessage, "timing">(std::move(timing)));
+}
+
+// runs the proxy handshake for `request` on a socket connected to `proxy`
+inline bool proxy_handshake(SOCKET s, const config_snapshot &snapshot,
+                            const upstream &proxy,
+                            std::span<const char> request,
+                            const char *syscall) {
+  proxy_chain client(request, proxy.protocol, snapshot.chain,
+                     snapshot.pipelining());
+  auto res = socks5_connect(s, client);
+
+  // a proxy refusing the pipelined handshake is asked once more in sequence
+  if (config_snapshot::pipeline_refused(client)) {
+    snapshot.report(proxy, client);
+    client.restart();
+    res = reconnect_proxy(s, proxy,
+                          std::chrono::steady_clock::now() +
+                              snapshot.connect_timeout)
+              ? socks5_connect(s, client)
+              : SOCKS_GENERAL_FAILURE;
+  }
+  snapshot.report(proxy, client);
+  log_chain(s, snapshot, client, syscall);
+
+  if (res != SOCKS_SUCCESS) {
+    shutdown(s, SD_BOTH);
+    return false;
+  }
+
+  return true;
+}
+
+// the deadline of a connect call, from its own timeout if it has one
+inline std::chrono::steady_clock::time_point
+deadline_of(const timeval *timeout, const config_snapshot &snapshot) {
+  auto now = std::chrono::steady_clock::now();
+  if (timeout) {
+    return now + std::chrono::seconds(timeout->tv_sec) +
+           std::chrono::microseconds(timeout->tv_usec);
+  }
+
+  return now + snapshot.connect_timeout;
+}
+
+// what is left until `deadline`, for calls taking a timeval
+inline timeval remaining(std::chrono::steady_clock::time_point deadline) {
+  auto left = std::chrono::duration_cast<std::chrono::microseconds>(
+      deadline - std::chrono::steady_clock::now());
+  auto us = std::max<long long>(left.count(), 0);
+  return timeval{(long)(us / 1000000), (long)(us % 1000000)};
+}
+
+// connects `s` to `proxy` and runs the proxy handshake for `request`, both
+// before `deadline` instead of blocking for as long as the proxy takes; on
+// false, the error is left in WSAGetLastError
+//
+// the finished handshake is copied to `reply` if given, and `reached` tells
+// whether `s` got connected to the proxy, after which it cannot connect again
+inline bool proxy_connect_until(SOCKET s,
+                                std::shared_ptr<const config_snapshot> snapshot,
+                                const upstream &proxy,
+                                std::span<const char> request,
+                                std::chrono::steady_clock::time_point deadline,
+                                const char *syscall,
+                                proxy_chain *reply = nullptr,
+                                bool *reached = nullptr) {
+  using namespace std::chrono;
+
+  blocking_scope scope(s, TRUE);
+  pending_handshake h{s,
+                      snapshot,
+                      &proxy,
+                      proxy_chain(request, proxy.protocol, snapshot->chain,
+                                  snapshot->pipelining()),
+                      deadline,
+                      false,
+                      nullptr,
+                      {}};
+
+  // the events polled, 0 once the deadline has passed
+  auto wait = [&](short events) -> short {
+    auto left = duration_cast<milliseconds>(deadline - steady_clock::now());
+    if (left.count() <= 0) {
+      return 0;
+    }
+
+    WSAPOLLFD fd{s, events, 0};
+    if (WSAPoll(&fd, 1, (INT)left.count()) == SOCKET_ERROR) {
+      return POLLERR;
+    }
+    return fd.revents;
+  };
+
+  auto started = steady_clock::now();
+  std::optional<steady_clock::time_point> connected;
+  int err = 0;
+
+  if (original_of<connect, hook_connect_fn<connect, "connect">>(
+          s, proxy.get(), proxy.size) == 0) {
+    connected = steady_clock::now();
+  } else if (WSAGetLastError() != WSAEWOULDBLOCK) {
+    err = WSAGetLastError();
+  } else if (auto revents = wait(POLLWRNORM); !revents) {
+    err = WSAETIMEDOUT;
+  } else if (revents & (POLLERR | POLLHUP)) {
+    int size = sizeof(err);
+    getsockopt(s, SOL_SOCKET, SO_ERROR, (char *)&err, &size);
+    err = err ? err : WSAECONNREFUSED;
+  } else {
+    connected = steady_clock::now();
+  }
+
+  if (reached) {
+    *reached = connected.has_value();
+  }
+
+  if (connected) {
+    std::optional<bool> success;
+    while (!success) {
+      short events = 0;
+      if (h.client.want_write())
+        events |= POLLWRNORM;
+      if (h.client.want_read())
+        events |= POLLRDNORM;
+      // nothing to wait for once a chain has failed to start
+      success = events ? advance_handshake(h, wait(events))
+                       : std::optional<bool>(h.client.done());
+      if (success == false && retry_sequential(h)) {
+        success.reset();
+      }
+    }
+    snapshot->report(proxy, h.client);
+    if (reply) {
+      *reply = h.client;
+    }
+
+    if (!*success) {
+      shutdown(s, SD_BOTH);
+      err = steady_clock::now() >= deadline ? WSAETIMEDOUT : WSAECONNREFUSED;
+    }
+  }
+
+  if (queue && snapshot->log) {
+    auto us = [](auto d) {
+      return (std::uint32_t)duration_cast<microseconds>(d).count();
+    };
+
+    InjecteeTiming timing;
+    timing["handle"_f] = (std::uint32_t)s;
+    timing["syscall"_f] = syscall;
+    timing["connect_us"_f] = us(connected.value_or(steady_clock::now()) -
+                                started);
+    if (connected) {
+      timing["handshake_us"_f] = us(steady_clock::now() - *connected);
+      if (!snapshot->chain.empty()) {
+        timing["hop_us"_f] = h.client.hop_us();
+      }
+    }
+    timing["success"_f] = !err;
+    timing["timed_out"_f] = err == WSAETIMEDOUT;
+    queue->push(create_message<InjecteeMessage, "timing">(std::move(timing)));
+  }
+
+  WSASetLastError(err);
+  return !err;
+}
+
+// where a connect to `name` goes, looking through the fake addresses handed
+// out by the resolver hooks to the hostnames behind them
+struct connect_target {
+  const sockaddr *name;
+  std::optional<IpAddr> fake;
+  route_action action;
+
+  connect_target(const config_snapshot &snapshot, const sockaddr *name)
+      : name(name) {
+    if (fake_names && fake_dns::contains(name)) {
+      if (auto domain = fake_names->lookup(name)) {
+        fake = IpAddr({}, {}, *domain,
+                      ntohs(((const sockaddr_in *)name)->sin_port));
+      }
+    }
+
+    action = fake ? snapshot.domains.lookup(*(*fake)["domain"_f])
+                        .value_or(route_action::proxy)
+                  : snapshot.routes.route(name);
+  }
+
+  // the destination reported in connect events
+  std::optional<IpAddr> addr() const { return fake ? fake : to_ip_addr(name); }
+
+  std::size_t encode(char *req) const {
+    return fake ? socks5_encode_request(req, *fake)
+                : socks5_encode_request(req, name);
+  }
+
+  // the real address behind a fake one, for connecting without the proxy
+  std::optional<sockaddr_buf> resolve() const;
+};
+
 template <auto F, pp::basic_fixed_string N>
 struct hook_connect_fn : minhook::api<F, hook_connect_fn<F, N>> {
   using base = minhook::api<F, hook_connect_fn<F, N>>;
@@ -87,37 +464,55 @@ struct hook_connect_fn : minhook::api<F, hook_connect_fn<F, N>> {
   static int WSAAPI detour(SOCKET s, const sockaddr *name, int namelen,
                            T... args) {
     if (is_inet(name) && config && !is_localhost(name)) {
-      auto cfg = config->get();
-      if (auto v = to_ip_addr(name)) {
+      auto snapshot = config->get();
+      connect_target target(*snapshot, name);
+      auto action = target.action;
+      auto proxy = snapshot->pick(action);
 
-        auto proxy = cfg["addr"_f];
-        auto log = cfg["log"_f];
-        if (queue && log && log.value()) {
+      if (queue && snapshot->log) {
+        if (auto v = target.addr()) {
           queue->push(create_message<InjecteeMessage, "connect">(
-              InjecteeConnect{(std::uint32_t)s, *v, proxy, N}));
+              InjecteeConnect{(std::uint32_t)s, *v, snapshot->via(proxy),
+                              N}));
         }
+      }
 
-        if (proxy) {
-          if (auto [addr, addr_size] = to_sockaddr(*proxy);
-              addr && !sockequal(addr.get(), name)) {
-            blocking_scope scope(s);
+      if (action == route_action::block) {
+        WSASetLastError(WSAECONNREFUSED);
+        return SOCKET_ERROR;
+      }
 
-            auto ret = base::original(s, addr.get(), addr_size, args...);
-            if (ret)
-              return ret;
+      char req[SOCKS_REQUEST_MAX_SIZE];
+      auto size = target.encode(req);
 
-            if (!socks5_handshake(s)) {
-              shutdown(s, SD_BOTH);
-              return SOCKET_ERROR;
-            }
-            if (socks5_request(s, name) != SOCKS_SUCCESS) {
-              shutdown(s, SD_BOTH);
-              return SOCKET_ERROR;
-            }
-
-            return 0;
+      if (proxy && size && !sockequal(proxy->get(), name)) {
+        if (handshakes && nbio_map && nbio_map->get(s)) {
+          if (handshakes->start(s, snapshot, *proxy, {req, size}, N.data,
+                                true)) {
+            WSASetLastError(WSAEWOULDBLOCK);
           }
+          return SOCKET_ERROR;
         }
+
+        blocking_scope scope(s);
+
+        auto ret = base::original(s, proxy->get(), proxy->size, args...);
+        if (ret)
+          return ret;
+
+        if (!proxy_handshake(s, *snapshot, *proxy, {req, size}, N.data)) {
+          return SOCKET_ERROR;
+        }
+
+        return 0;
+      }
+
+      if (target.fake) {
+        if (auto real = target.resolve()) {
+          return base::original(s, real->get(), real->size, args...);
+        }
+        WSASetLastError(WSAHOST_NOT_FOUND);
+        return SOCKET_ERROR;
       }
     }
     return base::original(s, name, namelen, args...);
@@ -135,60 +530,122 @@ struct hook_WSAConnectByList
                             LPSOCKADDR RemoteAddress, const timeval *timeout,
                             LPWSAOVERLAPPED Reserved) {
     if (config) {
-      auto cfg = config->get();
-      auto proxy = cfg["addr"_f];
-      auto log = cfg["log"_f];
+      auto snapshot = config->get();
+
+      // with a proxy or routing rules, addresses are tried one by one here
+      bool routed = !snapshot->upstreams.empty() || !snapshot->routes.empty();
+
+      std::vector<race_candidate> candidates;
+      for (size_t i = 0; routed && i < SocketAddress->iAddressCount; ++i) {
+        LPSOCKADDR name = SocketAddress->Address[i].lpSockaddr;
+        if (is_inet(name) && !is_localhost(name)) {
+          connect_target target(*snapshot, name);
+          if (target.action == route_action::proxy &&
+              !snapshot->upstreams.empty()) {
+            candidates.push_back({i, name, target.fake});
+          }
+        }
+      }
+
+      // proxied addresses are raced first, then the winner is connected
+      // again on `s`; if none wins they are not retried one by one
+      auto deadline = deadline_of(timeout, *snapshot);
+      std::optional<race_winner> winner;
+      bool raced = candidates.size() > 1;
+      if (raced) {
+        winner = race_proxied(snapshot, candidates, deadline);
+      }
 
+      std::vector<size_t> order;
+      if (winner) {
+        order.push_back(winner->index);
+      }
       for (size_t i = 0; i < SocketAddress->iAddressCount; ++i) {
+        if (!winner || i != winner->index) {
+          order.push_back(i);
+        }
+      }
+
+      for (size_t i : order) {
         LPSOCKADDR name = SocketAddress->Address[i].lpSockaddr;
 
+        std::optional<sockaddr_buf> real;
         if (is_inet(name) && !is_localhost(name)) {
-          if (auto v = to_ip_addr(name)) {
+          connect_target target(*snapshot, name);
+          auto action = target.action;
+          auto proxy = snapshot->pick(action);
+          if (winner && i == winner->index) {
+            proxy = winner->proxy;
+          }
 
-            if (queue && log && log.value()) {
+          if (queue && snapshot->log) {
+            if (auto v = target.addr()) {
               queue->push(
                   create_message<InjecteeMessage, "connect">(InjecteeConnect{
-                      (std::uint32_t)s, *v, proxy, "WSAConnectByList"}));
+                      (std::uint32_t)s, *v, snapshot->via(proxy),
+                      "WSAConnectByList"}));
             }
+          }
 
-            if (proxy) {
-              if (auto [addr, addr_size] = to_sockaddr(*proxy);
-                  addr && !sockequal(addr.get(), name)) {
-                blocking_scope scope(s);
-
-                auto ret = hook_connect::original(s, addr.get(), addr_size);
-                if (ret)
-                  return ret;
-
-                if (!socks5_handshake(s)) {
-                  shutdown(s, SD_BOTH);
-                  continue;
-                }
-                if (socks5_request(s, name) != SOCKS_SUCCESS) {
-                  shutdown(s, SD_BOTH);
-                  continue;
-                }
-
-                *RemoteAddressLength =
-                    std::min(*RemoteAddressLength, (DWORD)addr_size);
-                memcpy(RemoteAddress, addr.get(), *RemoteAddressLength);
-
-                sockaddr local;
-                int local_size = sizeof(local);
-                getsockname(s, &local, &local_size);
-
-                *LocalAddressLength =
-                    std::min(*LocalAddressLength, (DWORD)local_size);
-                memcpy(LocalAddress, &local, *LocalAddressLength);
-
-                return TRUE;
-              }
+          if (!routed || action == route_action::block) {
+            continue;
+          }
+
+          char req[SOCKS_REQUEST_MAX_SIZE];
+          auto size = target.encode(req);
+
+          if (proxy && size && !sockequal(proxy->get(), name)) {
+            if (raced && !winner) {
+              continue;
+            }
+
+            // a handshake that failed leaves `s` connected to the proxy, so
+            // its error is returned rather than WSAEISCONN from the next try
+            bool reached = false;
+            if (!proxy_connect_until(s, snapshot, *proxy, {req, size},
+                                     deadline, "WSAConnectByList", nullptr,
+                                     &reached)) {
+              if (reached || WSAGetLastError() == WSAETIMEDOUT)
+                return FALSE;
+              continue;
             }
+
+            *RemoteAddressLength =
+                std::min(*RemoteAddressLength, (DWORD)proxy->size);
+            memcpy(RemoteAddress, proxy->get(), *RemoteAddressLength);
+
+            sockaddr local;
+            int local_size = sizeof(local);
+            getsockname(s, &local, &local_size);
+
+            *LocalAddressLength =
+                std::min(*LocalAddressLength, (DWORD)local_size);
+            memcpy(LocalAddress, &local, *LocalAddressLength);
+
+            return TRUE;
+          }
+
+          if (target.fake && !(real = target.resolve())) {
+            continue;
           }
+        } else if (!routed) {
+          continue;
+        }
+
+        // direct attempts share the deadline if the caller has given one
+        SOCKET_ADDRESS_LIST single{1, {SocketAddress->Address[i]}};
+        if (real) {
+          single.Address[0] = {(LPSOCKADDR)real->get(), real->size};
+        }
+        auto left = remaining(deadline);
+        if (original(s, &single, LocalAddressLength, LocalAddress,
+                     RemoteAddressLength, RemoteAddress,
+                     timeout ? &left : nullptr, Reserved)) {
+          return TRUE;
         }
       }
 
-      if (proxy)
+      if (routed)
         return FALSE;
     }
 
@@ -203,24 +660,32 @@ inline const std::map<std::string, std::uint16_t> service_map = {
 #undef X
 };
 
-inline std::optional<IpAddr> ipaddr_from_name(const std::string &nodename,
-                                              const std::string &servicename) {
-  std::uint16_t port;
-  if (std::all_of(servicename.begin(), servicename.end(),
+inline std::optional<std::uint16_t>
+port_of_service(const std::string &servicename) {
+  if (!servicename.empty() &&
+      std::all_of(servicename.begin(), servicename.end(),
                   [](char c) { return std::isdigit(c); })) {
-    port = std::stoi(servicename);
+    return (std::uint16_t)std::stoi(servicename);
   } else if (auto iter = service_map.find(servicename);
              iter != service_map.end()) {
-    port = iter->second;
-  } else {
+    return iter->second;
+  }
+
+  return std::nullopt;
+}
+
+inline std::optional<IpAddr> ipaddr_from_name(const std::string &nodename,
+                                              const std::string &servicename) {
+  auto port = port_of_service(servicename);
+  if (!port) {
     return std::nullopt;
   }
 
   asio::error_code ec;
   if (auto addr = ip::make_address(nodename, ec); !ec) {
-    return from_asio(addr, port);
+    return from_asio(addr, *port);
   } else {
-    return IpAddr({}, {}, nodename, port);
+    return IpAddr({}, {}, nodename, *port);
   }
 }
 
@@ -242,51 +707,54 @@ struct hook_WSAConnectByName : minhook::api<F, hook_WSAConnectByName<F, N>> {
                             const struct timeval *timeout,
                             LPWSAOVERLAPPED Reserved) {
     if (config) {
-      auto cfg = config->get();
-      auto proxy = cfg["addr"_f];
-      auto log = cfg["log"_f];
+      auto snapshot = config->get();
 
       if (auto addr = ipaddr_from_name(nodename, servicename)) {
-        if (queue && log && log.value()) {
+        auto action = route_action::proxy;
+        if (const auto &domain = (*addr)["domain"_f]) {
+          action = snapshot->domains.lookup(*domain).value_or(action);
+        } else if (auto name = to_sockaddr(*addr)) {
+          action = snapshot->routes.route(name->get());
+        }
+        auto proxy = snapshot->pick(action);
+
+        if (queue && snapshot->log) {
           queue->push(create_message<InjecteeMessage, "connect">(
-              InjecteeConnect{(std::uint32_t)s, addr, proxy, N}));
+              InjecteeConnect{(std::uint32_t)s, addr, snapshot->via(proxy),
+                              N}));
         }
 
-        if (proxy) {
-          if (auto [proxysa, addr_size] = to_sockaddr(*proxy); proxysa) {
-            blocking_scope scope(s);
+        if (action == route_action::block) {
+          WSASetLastError(WSAECONNREFUSED);
+          return FALSE;
+        }
 
-            auto ret = hook_connect::original(s, proxysa.get(), addr_size);
-            if (ret)
-              return ret;
+        char req[SOCKS_REQUEST_MAX_SIZE];
+        auto size = socks5_encode_request(req, *addr);
 
-            if (!socks5_handshake(s)) {
-              shutdown(s, SD_BOTH);
-              return FALSE;
-            }
-            if (socks5_request(s, *addr) != SOCKS_SUCCESS) {
-              shutdown(s, SD_BOTH);
-              return FALSE;
-            }
+        if (proxy && size) {
+          if (!proxy_connect_until(s, snapshot, *proxy, {req, size},
+                                   deadline_of(timeout, *snapshot), N.data)) {
+            return FALSE;
+          }
 
-            sockaddr peer;
-            int peer_size = sizeof(peer);
-            getsockname(s, &peer, &peer_size);
+          sockaddr peer;
+          int peer_size = sizeof(peer);
+          getsockname(s, &peer, &peer_size);
 
-            *RemoteAddressLength =
-                std::min(*RemoteAddressLength, (DWORD)peer_size);
-            memcpy(RemoteAddress, &peer, *RemoteAddressLength);
+          *RemoteAddressLength =
+              std::min(*RemoteAddressLength, (DWORD)peer_size);
+          memcpy(RemoteAddress, &peer, *RemoteAddressLength);
 
-            sockaddr local;
-            int local_size = sizeof(local);
-            getsockname(s, &local, &local_size);
+          sockaddr local;
+          int local_size = sizeof(local);
+          getsockname(s, &local, &local_size);
 
-            *LocalAddressLength =
-                std::min(*LocalAddressLength, (DWORD)local_size);
-            memcpy(LocalAddress, &local, *LocalAddressLength);
+          *LocalAddressLength =
+              std::min(*LocalAddressLength, (DWORD)local_size);
+          memcpy(LocalAddress, &local, *LocalAddressLength);
 
-            return TRUE;
-          }
+          return TRUE;
         }
       }
     }
@@ -302,6 +770,198 @@ struct hook_WSAConnectByNameA
 struct hook_WSAConnectByNameW
     : hook_WSAConnectByName<WSAConnectByNameW, "WSAConnectByNameW"> {};
 
+// a name worth looking up, rather than localhost or an address literal
+inline bool is_hostname(const std::string &name) {
+  asio::error_code ec;
+  ip::make_address(name, ec);
+  return ec && !name.empty() && _stricmp(name.c_str(), "localhost") != 0;
+}
+
+// whether a lookup can be answered with a fake address: the caller accepts
+// an IPv4 address and a stream socket
+template <typename AddrInfo> inline bool fakeable(const AddrInfo *hints) {
+  return !hints ||
+         ((hints->ai_family == AF_UNSPEC || hints->ai_family == AF_INET) &&
+          hints->ai_socktype != SOCK_DGRAM);
+}
+
+// result lists built here rather than by winsock, so freed here as well
+inline std::mutex owned_addrinfo_mtx;
+inline std::unordered_set<const void *> owned_addrinfo;
+
+template <typename AddrInfo> struct addrinfo_node {
+  AddrInfo info;
+  sockaddr_storage addr;
+};
+
+// a list of `addrs` as getaddrinfo would return it for `hints`, or nullptr
+// if none of them fit
+template <typename Char, typename AddrInfo>
+AddrInfo *make_addrinfo(const std::vector<IpAddr> &addrs, std::uint16_t port,
+                        const AddrInfo *hints, const Char *canonname) {
+  int family = hints ? hints->ai_family : AF_UNSPEC;
+  AddrInfo *head = nullptr, **tail = &head;
+
+  for (const auto &addr : addrs) {
+    auto node = new addrinfo_node<AddrInfo>{};
+    auto &info = node->info;
+
+    if (auto v4 = addr["v4_addr"_f]; v4 && family != AF_INET6) {
+      auto sin = (sockaddr_in *)&node->addr;
+      sin->sin_family = AF_INET;
+      sin->sin_addr.s_addr = htonl(*v4);
+      sin->sin_port = htons(port);
+      info.ai_addrlen = sizeof(sockaddr_in);
+    } else if (auto v6 = addr["v6_addr"_f];
+               v6 && v6->size() == 16 && family != AF_INET) {
+      // the injector encodes them with from_asio, in network order
+      auto sin6 = (sockaddr_in6 *)&node->addr;
+      sin6->sin6_family = AF_INET6;
+      std::copy(v6->begin(), v6->end(), sin6->sin6_addr.u.Byte);
+      sin6->sin6_port = htons(port);
+      info.ai_addrlen = sizeof(sockaddr_in6);
+    } else {
+      delete node;
+      continue;
+    }
+
+    info.ai_family = node->addr.ss_family;
+    info.ai_socktype = hints ? hints->ai_socktype : 0;
+    info.ai_protocol = hints ? hints->ai_protocol : 0;
+    info.ai_addr = (sockaddr *)&node->addr;
+    *tail = &info;
+    tail = &info.ai_next;
+  }
+
+  if (head && hints && (hints->ai_flags & AI_CANONNAME)) {
+    auto size = std::char_traits<Char>::length(canonname) + 1;
+    head->ai_canonname = std::copy_n(canonname, size, new Char[size]) - size;
+  }
+
+  if (head) {
+    std::lock_guard guard(owned_addrinfo_mtx);
+    owned_addrinfo.insert(head);
+  }
+  return head;
+}
+
+// in fake-ip mode, answers lookups of hostnames that would be proxied with
+// an address standing for the name, which `connect_target` maps back; the
+// result still comes from the original function (resolving the address
+// literally), so that the application can free it as usual
+//
+// with the shared resolver, other hostnames are looked up by the injector,
+// falling back to the original function if it does not answer in time
+template <auto F, typename Char, typename AddrInfo>
+struct hook_getaddrinfo_fn
+    : minhook::api<F, hook_getaddrinfo_fn<F, Char, AddrInfo>> {
+  using base = minhook::api<F, hook_getaddrinfo_fn<F, Char, AddrInfo>>;
+
+  static std::string narrow(const Char *str) {
+    if constexpr (std::is_same_v<Char, wchar_t>) {
+      return utf8_encode(str);
+    } else {
+      return str;
+    }
+  }
+
+  static INT WSAAPI detour(const Char *node, const Char *service,
+                           const AddrInfo *hints, AddrInfo **result) {
+    if (node && config && !(hints && (hints->ai_flags & AI_NUMERICHOST))) {
+      auto snapshot = config->get();
+      auto name = narrow(node);
+
+      if (!is_hostname(name)) {
+        return base::original(node, service, hints, result);
+      }
+
+      if (fake_names && snapshot->fake_dns && !snapshot->upstreams.empty() &&
+          fakeable(hints) &&
+          snapshot->domains.lookup(name).value_or(route_action::proxy) ==
+              route_action::proxy) {
+        auto literal = ip::address_v4(fake_names->assign(name)).to_string();
+        std::basic_string<Char> fake(literal.begin(), literal.end());
+
+        AddrInfo literal_hints{};
+        if (hints) {
+          literal_hints = *hints;
+        }
+        literal_hints.ai_family = AF_INET;
+        literal_hints.ai_flags |= AI_NUMERICHOST;
+
+        return base::original(fake.c_str(), service, &literal_hints, result);
+      }
+
+      auto port = service ? port_of_service(narrow(service))
+                          : std::optional<std::uint16_t>(0);
+      if (resolver && snapshot->shared_resolver && port) {
+        if (auto addrs = resolver->query(name)) {
+          if ((*result = make_addrinfo(*addrs, *port, hints, node))) {
+            return 0;
+          }
+          WSASetLastError(WSAHOST_NOT_FOUND);
+          return WSAHOST_NOT_FOUND;
+        }
+      }
+    }
+
+    return base::original(node, service, hints, result);
+  }
+};
+
+template <auto F, typename AddrInfo>
+struct hook_freeaddrinfo_fn
+    : minhook::api<F, hook_freeaddrinfo_fn<F, AddrInfo>> {
+  using base = minhook::api<F, hook_freeaddrinfo_fn<F, AddrInfo>>;
+
+  static VOID WSAAPI detour(AddrInfo *info) {
+    if (info) {
+      std::unique_lock guard(owned_addrinfo_mtx);
+      if (owned_addrinfo.erase(info)) {
+        guard.unlock();
+
+        delete[] info->ai_canonname;
+        while (info) {
+          auto next = info->ai_next;
+          delete (addrinfo_node<AddrInfo> *)info;
+          info = next;
+        }
+        return;
+      }
+    }
+
+    base::original(info);
+  }
+};
+
+struct hook_getaddrinfo
+    : hook_getaddrinfo_fn<getaddrinfo, char, ADDRINFOA> {};
+struct hook_GetAddrInfoW
+    : hook_getaddrinfo_fn<GetAddrInfoW, wchar_t, ADDRINFOW> {};
+struct hook_freeaddrinfo : hook_freeaddrinfo_fn<freeaddrinfo, ADDRINFOA> {};
+struct hook_FreeAddrInfoW : hook_freeaddrinfo_fn<FreeAddrInfoW, ADDRINFOW> {};
+
+inline std::optional<sockaddr_buf> connect_target::resolve() const {
+  // the socket was created for the IPv4 fake address
+  ADDRINFOA hints{};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+
+  auto port = std::to_string(*(*fake)["port"_f]);
+  PADDRINFOA result = nullptr;
+  if (hook_getaddrinfo::original((*fake)["domain"_f]->c_str(), port.c_str(),
+                                 &hints, &result) != 0 ||
+      !result) {
+    return std::nullopt;
+  }
+
+  sockaddr_buf res;
+  res.size = (int)std::min(result->ai_addrlen, sizeof(res.storage));
+  memcpy(&res.storage, result->ai_addr, res.size);
+  freeaddrinfo(result);
+  return res;
+}
+
 template <typename Char> struct startup_info_ptr_impl;
 
 template <>
@@ -332,10 +992,7 @@ struct hook_CreateProcess : minhook::api<F, hook_CreateProcess<F>> {
         lpCurrentDirectory, lpStartupInfo, lpProcessInformation);
 
     if (res && config) {
-      auto cfg = config->get();
-      auto subprocess = cfg["subprocess"_f];
-
-      if (queue && subprocess && subprocess.value()) {
+      if (queue && config->get()->subprocess) {
         queue->push(create_message<InjecteeMessage, "subpid">(
             lpProcessInformation->dwProcessId));
       }
@@ -375,48 +1032,69 @@ struct hook_ConnectEx {
                             PVOID lpSendBuffer, DWORD dwSendDataLength,
                             LPDWORD lpdwBytesSent, LPOVERLAPPED lpOverlapped) {
     if (is_inet(name) && config && !is_localhost(name)) {
-      auto cfg = config->get();
-      if (auto v = to_ip_addr(name)) {
+      auto snapshot = config->get();
+      connect_target target(*snapshot, name);
+      auto action = target.action;
+      auto proxy = snapshot->pick(action);
 
-        auto proxy = cfg["addr"_f];
-        auto log = cfg["log"_f];
-        if (queue && log && log.value()) {
+      if (queue && snapshot->log) {
+        if (auto v = target.addr()) {
           queue->push(create_message<InjecteeMessage, "connect">(
-              InjecteeConnect{(std::uint32_t)s, *v, proxy, "ConnectEx"}));
+              InjecteeConnect{(std::uint32_t)s, *v, snapshot->via(proxy),
+                              "ConnectEx"}));
         }
+      }
 
-        if (proxy) {
-          if (auto [addr, addr_size] = to_sockaddr(*proxy);
-              addr && !sockequal(addr.get(), name)) {
-            blocking_scope scope(s);
+      if (action == route_action::block) {
+        WSASetLastError(WSAECONNREFUSED);
+        return FALSE;
+      }
 
-            auto ret = hook_connect::original(s, addr.get(), addr_size);
-            if (ret)
-              return ret;
+      char req[SOCKS_REQUEST_MAX_SIZE];
+      auto size = target.encode(req);
 
-            if (!socks5_handshake(s)) {
-              shutdown(s, SD_BOTH);
-              return FALSE;
-            }
-            if (socks5_request(s, name) != SOCKS_SUCCESS) {
-              shutdown(s, SD_BOTH);
-              return FALSE;
-            }
+      if (proxy && size && !sockequal(proxy->get(), name)) {
+        if (handshakes && lpOverlapped) {
+          if (handshakes->start(s, snapshot, *proxy, {req, size},
+                                "ConnectEx", nbio_map && nbio_map->get(s),
+                                lpOverlapped,
+                                lpSendBuffer, dwSendDataLength)) {
+            WSASetLastError(WSA_IO_PENDING);
+          }
+          return FALSE;
+        }
 
-            if (lpSendBuffer) {
-              int len =
-                  send(s, (const char *)lpSendBuffer, dwSendDataLength, 0);
-              if (len == SOCKET_ERROR) {
-                shutdown(s, SD_BOTH);
-                return FALSE;
-              }
+        blocking_scope scope(s);
 
-              *lpdwBytesSent = len;
-            }
+        auto ret = hook_connect::original(s, proxy->get(), proxy->size);
+        if (ret)
+          return ret;
 
-            return TRUE;
+        if (!proxy_handshake(s, *snapshot, *proxy, {req, size},
+                             "ConnectEx")) {
+          return FALSE;
+        }
+
+        if (lpSendBuffer) {
+          int len = send(s, (const char *)lpSendBuffer, dwSendDataLength, 0);
+          if (len == SOCKET_ERROR) {
+            shutdown(s, SD_BOTH);
+            return FALSE;
           }
+
+          *lpdwBytesSent = len;
+        }
+
+        return TRUE;
+      }
+
+      if (target.fake) {
+        if (auto real = target.resolve()) {
+          return original(s, real->get(), real->size, lpSendBuffer,
+                          dwSendDataLength, lpdwBytesSent, lpOverlapped);
         }
+        WSASetLastError(WSAHOST_NOT_FOUND);
+        return FALSE;
       }
     }
     return original(s, name, namelen, lpSendBuffer, dwSendDataLength,
@@ -431,6 +1109,748 @@ struct hook_ConnectEx {
   static minhook::status remove() { return minhook::remove(ConnectEx); }
 };
 
+// winsock lets a connected socket connect again only through DisconnectEx
+// with TF_REUSE_SOCKET followed by ConnectEx
+inline bool reconnect_proxy(SOCKET s, const upstream &proxy,
+                            std::chrono::steady_clock::time_point deadline) {
+  static auto disconnect = [] {
+    SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    DWORD numBytes = 0;
+    GUID guid = WSAID_DISCONNECTEX;
+    LPFN_DISCONNECTEX DisconnectExPtr = nullptr;
+
+    WSAIoctl(s, SIO_GET_EXTENSION_FUNCTION_POINTER, (void *)&guid,
+             sizeof(guid), (void *)&DisconnectExPtr, sizeof(DisconnectExPtr),
+             &numBytes, nullptr, nullptr);
+
+    closesocket(s);
+    return DisconnectExPtr;
+  }();
+
+  if (!disconnect || !hook_ConnectEx::original) {
+    return false;
+  }
+
+  u_long nb = FALSE;
+  hook_ioctlsocket::original(s, FIONBIO, &nb);
+
+  // an abortive close keeps the socket out of TIME_WAIT
+  linger hard{1, 0};
+  setsockopt(s, SOL_SOCKET, SO_LINGER, (const char *)&hard, sizeof(hard));
+  bool ok = disconnect(s, nullptr, TF_REUSE_SOCKET, 0);
+  linger none{0, 0};
+  setsockopt(s, SOL_SOCKET, SO_LINGER, (const char *)&none, sizeof(none));
+  if (!ok) {
+    return false;
+  }
+
+  // ConnectEx wants a bound socket, which fails harmlessly if it still is
+  sockaddr_storage any{};
+  any.ss_family = proxy.get()->sa_family;
+  bind(s, (const sockaddr *)&any,
+       any.ss_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in));
+
+  // the low bit of the event keeps the completion off the application's port
+  WSAEVENT event = WSACreateEvent();
+  OVERLAPPED overlapped{};
+  overlapped.hEvent = (HANDLE)((ULONG_PTR)event | 1);
+
+  DWORD bytes = 0;
+  ok = hook_ConnectEx::original(s, proxy.get(), proxy.size, nullptr, 0,
+                                &bytes, &overlapped) ||
+       WSAGetLastError() == WSA_IO_PENDING;
+  if (ok) {
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now());
+    if (WSAWaitForMultipleEvents(1, &event, FALSE,
+                                 (DWORD)std::max<long long>(left.count(), 0),
+                                 FALSE) != WSA_WAIT_EVENT_0) {
+      CancelIoEx((HANDLE)s, &overlapped);
+      WSAWaitForMultipleEvents(1, &event, FALSE, WSA_INFINITE, FALSE);
+    }
+
+    DWORD flags = 0;
+    ok = WSAGetOverlappedResult(s, &overlapped, &bytes, FALSE, &flags);
+  }
+  WSACloseEvent(event);
+
+  if (ok) {
+    setsockopt(s, SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, nullptr, 0);
+  }
+  return ok;
+}
+
+inline bool is_datagram(SOCKET s) {
+  int type = 0;
+  int size = sizeof(type);
+  return getsockopt(s, SOL_SOCKET, SO_TYPE, (char *)&type, &size) == 0 &&
+         type == SOCK_DGRAM;
+}
+
+struct hook_WSASendTo;
+
+// starts a UDP ASSOCIATE for `s` through `proxy` on the handshake driver and
+// returns the association right away; it holds datagrams until the proxy
+// has answered, and keeps a refusal, so that later datagrams fail at once
+inline std::shared_ptr<udp_association<SOCKET>>
+associate(SOCKET s, const std::shared_ptr<const config_snapshot> &snapshot,
+          const upstream &proxy) {
+  auto [assoc, made] = udp->make(s);
+  if (!made) {
+    return assoc;
+  }
+
+  // the address datagrams will come from is not known yet
+  sockaddr_in any{};
+  any.sin_family = AF_INET;
+
+  char req[SOCKS_REQUEST_MAX_SIZE];
+  auto size =
+      socks5_encode_request(req, (const sockaddr *)&any, SOCKS_UDP_ASSOCIATE);
+
+  auto settle = [s, assoc](SOCKET control,
+                           const std::optional<sockaddr_buf> &relay) {
+    if (!relay && control != INVALID_SOCKET) {
+      hook_closesocket::original(control);
+      control = INVALID_SOCKET;
+    }
+
+    auto send = [&](std::span<const char> datagram) {
+      WSABUF one{(ULONG)datagram.size(), (CHAR *)datagram.data()};
+      DWORD sent = 0;
+      original_of<WSASendTo, hook_WSASendTo>(s, &one, 1, &sent, 0,
+                                             relay->get(), relay->size,
+                                             nullptr, nullptr);
+    };
+    if (!assoc->settle(control, relay, send) && control != INVALID_SOCKET) {
+      hook_closesocket::original(control);
+    }
+  };
+
+  // an HTTP proxy has no UDP to offer, and datagrams cannot follow a chain
+  // (they would skip its hops); either is kept as a refusal
+  SOCKET control =
+      proxy.protocol == proxy_protocol::socks5 && snapshot->chain.empty()
+          ? socket(proxy.get()->sa_family, SOCK_STREAM, IPPROTO_TCP)
+          : INVALID_SOCKET;
+
+  if (control == INVALID_SOCKET || !handshakes ||
+      !handshakes->start_own(
+          control, snapshot, proxy, {req, size}, "UDP ASSOCIATE",
+          [settle](const pending_handshake &h, bool success) {
+            std::optional<sockaddr_buf> relay;
+            if (success) {
+              relay = relay_address(h.client.bound(), *h.proxy);
+            }
+            settle(h.sock, relay);
+          })) {
+    settle(control, std::nullopt);
+  }
+  return assoc;
+}
+
+// completes an overlapped operation that the hooks have carried out for the
+// application, the way winsock would: by queueing its completion routine to
+// `thread`, or else through its event and the completion port `binding` of
+// its socket; returns what the hooked call returns, which is that the
+// operation is pending
+inline int complete_overlapped(const std::optional<completion_binding> &binding,
+                               LPWSAOVERLAPPED overlapped,
+                               LPWSAOVERLAPPED_COMPLETION_ROUTINE routine,
+                               HANDLE thread, int error, DWORD bytes,
+                               DWORD flags = 0) {
+  struct completion {
+    LPWSAOVERLAPPED_COMPLETION_ROUTINE routine;
+    LPWSAOVERLAPPED overlapped;
+    DWORD error, bytes, flags;
+  };
+
+  if (routine) {
+    overlapped->Internal = (ULONG_PTR)ntstatus_of(error);
+    overlapped->InternalHigh = bytes;
+
+    auto c = new completion{routine, overlapped, (DWORD)error, bytes, flags};
+    if (!QueueUserAPC(
+            [](ULONG_PTR p) {
+              std::unique_ptr<completion> c((completion *)p);
+              c->routine(c->error, c->bytes, c->overlapped, c->flags);
+            },
+            thread, (ULONG_PTR)c)) {
+      delete c;
+    }
+  } else {
+    handshake_driver::complete(binding, overlapped, error, bytes);
+  }
+
+  WSASetLastError(WSA_IO_PENDING);
+  return SOCKET_ERROR;
+}
+
+// wraps datagrams from `s` to proxied destinations in the SOCKS5 UDP header
+// and sends them to the relay of its association; the payload is sent from
+// the application's buffers as they are, behind a separate header buffer
+//
+// relayed sends are always made synchronously, which UDP sends rarely have
+// to wait for, so that the header on the stack outlives them; an overlapped
+// one is then completed with the size of the payload alone
+struct hook_WSASendTo : minhook::api<WSASendTo, hook_WSASendTo> {
+  static int WSAAPI detour(SOCKET s, LPWSABUF lpBuffers, DWORD dwBufferCount,
+                           LPDWORD lpNumberOfBytesSent, DWORD dwFlags,
+                           const sockaddr *lpTo, int iTolen,
+                           LPWSAOVERLAPPED lpOverlapped,
+                           LPWSAOVERLAPPED_COMPLETION_ROUTINE
+                               lpCompletionRoutine) {
+    if (lpTo && udp && config && is_inet(lpTo) && !is_localhost(lpTo)) {
+      auto snapshot = config->get();
+      connect_target target(*snapshot, lpTo);
+
+      if (target.action == route_action::block) {
+        WSASetLastError(WSAECONNREFUSED);
+        return SOCKET_ERROR;
+      }
+
+      // without the relay, proxied destinations get datagrams directly
+      auto relayed =
+          snapshot->udp_relay && target.action == route_action::proxy;
+      auto assoc = relayed ? udp->get(s) : nullptr;
+      if (!assoc && relayed) {
+        auto proxy = snapshot->pick(target.action);
+        if (proxy && is_datagram(s)) {
+          assoc = associate(s, snapshot, *proxy);
+        }
+      }
+
+      if (assoc) {
+        char header[SOCKS_REQUEST_MAX_SIZE];
+        auto size = target.fake ? socks5_encode_udp_header(header, *target.fake)
+                                : socks5_encode_udp_header(header, lpTo);
+        DWORD payload = 0;
+        for (DWORD i = 0; i < dwBufferCount; ++i) {
+          payload += lpBuffers[i].len;
+        }
+
+        bool held = assoc->state() == udp_state::pending && assoc->hold([&] {
+          std::vector<char> datagram(header, header + size);
+          for (DWORD i = 0; i < dwBufferCount; ++i) {
+            datagram.insert(datagram.end(), lpBuffers[i].buf,
+                            lpBuffers[i].buf + lpBuffers[i].len);
+          }
+          return datagram;
+        });
+        if (!held && !assoc->relayed()) {
+          WSASetLastError(WSAENETUNREACH);
+          return SOCKET_ERROR;
+        }
+
+        if (!held) {
+          WSABUF stack[16];
+          std::vector<WSABUF> heap;
+          WSABUF *bufs = stack;
+          if (dwBufferCount + 1 > std::size(stack)) {
+            heap.resize(dwBufferCount + 1);
+            bufs = heap.data();
+          }
+          bufs[0] = {(ULONG)size, header};
+          std::copy_n(lpBuffers, dwBufferCount, bufs + 1);
+
+          const auto &relay = assoc->relay();
+          DWORD sent = 0;
+          if (original(s, bufs, dwBufferCount + 1, &sent, dwFlags,
+                       relay.get(), relay.size, nullptr,
+                       nullptr) == SOCKET_ERROR &&
+              // an overlapped datagram finding the send buffer of a
+              // non-blocking socket full is dropped, as the network may
+              (!lpOverlapped || WSAGetLastError() != WSAEWOULDBLOCK)) {
+            return SOCKET_ERROR;
+          }
+        }
+
+        if (lpOverlapped) {
+          auto binding =
+              handshakes ? handshakes->binding_of(s) : std::nullopt;
+          return complete_overlapped(binding, lpOverlapped,
+                                     lpCompletionRoutine, GetCurrentThread(),
+                                     0, payload);
+        }
+        if (lpNumberOfBytesSent) {
+          *lpNumberOfBytesSent = payload;
+        }
+        return 0;
+      }
+
+      if (target.fake) {
+        if (auto real = target.resolve()) {
+          return original(s, lpBuffers, dwBufferCount, lpNumberOfBytesSent,
+                          dwFlags, real->get(), real->size, lpOverlapped,
+                          lpCompletionRoutine);
+        }
+        WSASetLastError(WSAHOST_NOT_FOUND);
+        return SOCKET_ERROR;
+      }
+    }
+
+    return original(s, lpBuffers, dwBufferCount, lpNumberOfBytesSent, dwFlags,
+                    lpTo, iTolen, lpOverlapped, lpCompletionRoutine);
+  }
+};
+
+struct hook_sendto : minhook::api<sendto, hook_sendto> {
+  static int WSAAPI detour(SOCKET s, const char *buf, int len, int flags,
+                           const sockaddr *to, int tolen) {
+    if (to && udp && config && is_inet(to) && !is_localhost(to)) {
+      WSABUF one{(ULONG)len, (CHAR *)buf};
+      DWORD sent = 0;
+      if (hook_WSASendTo::detour(s, &one, 1, &sent, flags, to, tolen, nullptr,
+                                 nullptr) == SOCKET_ERROR) {
+        return SOCKET_ERROR;
+      }
+      return (int)sent;
+    }
+
+    return original(s, buf, len, flags, to, tolen);
+  }
+};
+
+struct hook_WSARecvFrom;
+
+struct hook_WSARecvMsg {
+
+  static inline LPFN_WSARECVMSG WSARecvMsg = nullptr;
+
+  static LPFN_WSARECVMSG GetWSARecvMsg() {
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+
+    SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    DWORD numBytes = 0;
+    GUID guid = WSAID_WSARECVMSG;
+    LPFN_WSARECVMSG WSARecvMsgPtr = nullptr;
+
+    WSAIoctl(s, SIO_GET_EXTENSION_FUNCTION_POINTER, (void *)&guid, sizeof(guid),
+             (void *)&WSARecvMsgPtr, sizeof(WSARecvMsgPtr), &numBytes, nullptr,
+             nullptr);
+
+    closesocket(s);
+    return WSARecvMsgPtr;
+  }
+
+  static inline decltype(WSARecvMsg) original = nullptr;
+
+  static INT PASCAL detour(SOCKET s, LPWSAMSG lpMsg,
+                           LPDWORD lpdwNumberOfBytesRecvd,
+                           LPWSAOVERLAPPED lpOverlapped,
+                           LPWSAOVERLAPPED_COMPLETION_ROUTINE
+                               lpCompletionRoutine) {
+    if (auto ret = receive_datagram(
+            s, lpMsg->lpBuffers, lpMsg->dwBufferCount, lpdwNumberOfBytesRecvd,
+            &lpMsg->dwFlags, lpMsg->name, &lpMsg->namelen, lpMsg,
+            lpOverlapped, lpCompletionRoutine)) {
+      return *ret;
+    }
+
+    return original(s, lpMsg, lpdwNumberOfBytesRecvd, lpOverlapped,
+                    lpCompletionRoutine);
+  }
+
+  static minhook::status create() {
+    WSARecvMsg = GetWSARecvMsg();
+    return minhook::create(WSARecvMsg, detour, original);
+  }
+
+  static minhook::status remove() { return minhook::remove(WSARecvMsg); }
+};
+
+// strips the header of a datagram that a socket of `assoc` has received from
+// its relay; false if it is malformed or a fragment, and to be dropped;
+// datagrams that other hosts have sent directly are left as they are
+//
+// the state is read after the datagram has arrived, since a reply from the
+// relay can only follow its settling
+inline bool unwrap_datagram(const udp_association<SOCKET> &assoc,
+                            std::span<const char> &data,
+                            sockaddr_storage &source, int &source_size) {
+  if (!assoc.relayed() ||
+      !sockequal((const sockaddr *)&source, assoc.relay().get())) {
+    return true;
+  }
+
+  sockaddr_storage origin;
+  auto header = socks5_decode_udp_header(data, origin);
+  if (!header) {
+    return false;
+  }
+
+  data = data.subspan(header);
+  source = origin;
+  source_size = source.ss_family == AF_INET ? sizeof(sockaddr_in)
+                                            : sizeof(sockaddr_in6);
+  return true;
+}
+
+// copies a datagram into the buffers and address of the application,
+// returns how much of it fit
+inline DWORD deliver_datagram(std::span<const char> data,
+                              const sockaddr_storage &source, int source_size,
+                              LPWSABUF bufs, DWORD count, sockaddr *from,
+                              LPINT fromlen) {
+  std::size_t copied = 0;
+  for (DWORD i = 0; i < count && copied < data.size(); ++i) {
+    auto size = std::min<std::size_t>(bufs[i].len, data.size() - copied);
+    std::copy_n(data.data() + copied, size, bufs[i].buf);
+    copied += size;
+  }
+
+  if (from && fromlen) {
+    memcpy(from, &source, std::min(*fromlen, source_size));
+    *fromlen = source_size;
+  }
+  return (DWORD)copied;
+}
+
+// a receive of the hooks' own into a buffer that fits any datagram, made
+// with WSARecvMsg when it stands in for one of the application's, so that
+// its control data still arrives
+struct raw_datagram {
+  std::unique_ptr<char[]> data =
+      std::make_unique<char[]>(udp_datagram_max_size);
+  WSABUF buf{(ULONG)udp_datagram_max_size, data.get()};
+  sockaddr_storage source;
+  int source_size;
+  DWORD flags;
+  WSAMSG msg;
+
+  int post(SOCKET s, DWORD in_flags, LPWSAMSG app, LPDWORD received,
+           LPWSAOVERLAPPED overlapped) {
+    source_size = sizeof(source);
+    flags = in_flags;
+    if (app) {
+      msg = {(sockaddr *)&source, source_size, &buf, 1, app->Control, flags};
+      return hook_WSARecvMsg::original(s, &msg, received, overlapped,
+                                       nullptr);
+    }
+    return original_of<WSARecvFrom, hook_WSARecvFrom>(
+        s, &buf, 1, received, &flags, (sockaddr *)&source, &source_size,
+        overlapped, nullptr);
+  }
+
+  // takes what a completed receive has left in its message
+  void received(LPWSAMSG app) {
+    if (app) {
+      source_size = msg.namelen;
+      flags = msg.dwFlags;
+      app->Control.len = msg.Control.len;
+    }
+  }
+};
+
+// overlapped receives of the application on sockets with an association;
+// each is carried out by an overlapped receive of the hooks' own, whose
+// event a thread pool waits for, so that the datagram is unwrapped before
+// it completes the application's operation
+//
+// the low bit of the event keeps the hooks' receives off the completion
+// port of the application
+class overlapped_receives {
+  struct operation {
+    overlapped_receives *owner;
+    SOCKET sock;
+    std::shared_ptr<udp_association<SOCKET>> assoc;
+    DWORD in_flags;
+    raw_datagram raw;
+    WSAOVERLAPPED overlapped{};
+    WSAEVENT event = WSACreateEvent();
+    PTP_WAIT wait = nullptr;
+
+    // the application's operation
+    std::vector<WSABUF> bufs;
+    sockaddr *from;
+    LPINT fromlen;
+    LPWSAMSG msg;
+    LPWSAOVERLAPPED app;
+    LPWSAOVERLAPPED_COMPLETION_ROUTINE routine;
+    HANDLE thread = nullptr;
+    std::optional<completion_binding> binding;
+
+    ~operation() {
+      if (wait) {
+        CloseThreadpoolWait(wait);
+      }
+      if (thread) {
+        CloseHandle(thread);
+      }
+      if (event != WSA_INVALID_EVENT) {
+        WSACloseEvent(event);
+      }
+    }
+  };
+
+  std::mutex mtx_;
+  std::condition_variable drained_;
+  std::unordered_set<operation *> ops_;
+  // finished, but their callbacks may not have returned yet
+  std::vector<std::unique_ptr<operation>> retired_;
+  bool stopping_ = false;
+
+  // makes the hooks' receive of `op` and waits for it; called with the
+  // lock held, so that it cannot race with the destructor
+  bool post(operation &op) {
+    if (stopping_) {
+      WSASetLastError(WSA_OPERATION_ABORTED);
+      return false;
+    }
+
+    WSAResetEvent(op.event);
+    op.overlapped = {};
+    op.overlapped.hEvent = (HANDLE)((ULONG_PTR)op.event | 1);
+    if (op.raw.post(op.sock, op.in_flags, op.msg, nullptr, &op.overlapped) ==
+            SOCKET_ERROR &&
+        WSAGetLastError() != WSA_IO_PENDING) {
+      return false;
+    }
+
+    SetThreadpoolWait(op.wait, op.event, nullptr);
+    return true;
+  }
+
+  void finish(operation *op, int error, DWORD bytes, DWORD flags) {
+    if (op->msg) {
+      op->msg->dwFlags = flags;
+    }
+    complete_overlapped(op->binding, op->app, op->routine, op->thread, error,
+                        bytes, flags);
+
+    std::lock_guard guard(mtx_);
+    ops_.erase(op);
+    retired_.emplace_back(op);
+    if (ops_.empty()) {
+      drained_.notify_all();
+    }
+  }
+
+  // frees the operations that have finished once their callbacks are over
+  void reap() {
+    std::vector<std::unique_ptr<operation>> done;
+    {
+      std::lock_guard guard(mtx_);
+      done.swap(retired_);
+    }
+
+    for (auto &op : done) {
+      WaitForThreadpoolWaitCallbacks(op->wait, FALSE);
+    }
+  }
+
+  static void CALLBACK on_wait(PTP_CALLBACK_INSTANCE, PVOID context, PTP_WAIT,
+                               TP_WAIT_RESULT) {
+    auto op = (operation *)context;
+    auto self = op->owner;
+    auto &raw = op->raw;
+
+    DWORD n = 0, flags = 0;
+    int error = 0;
+    if (!WSAGetOverlappedResult(op->sock, &op->overlapped, &n, FALSE,
+                                &flags)) {
+      error = WSAGetLastError();
+    }
+    // the application has closed the socket, cancelling the receive
+    if (error == WSAENOTSOCK) {
+      error = WSA_OPERATION_ABORTED;
+    }
+
+    DWORD copied = 0;
+    if (!error) {
+      raw.flags = flags;
+      raw.received(op->msg);
+      flags = raw.flags;
+
+      // malformed datagrams and fragments from the relay are dropped, unless
+      // the caller is only peeking
+      std::span<const char> data(raw.data.get(), n);
+      if (!unwrap_datagram(*op->assoc, data, raw.source, raw.source_size)) {
+        if (!(op->in_flags & MSG_PEEK)) {
+          std::lock_guard guard(self->mtx_);
+          if (self->post(*op)) {
+            return;
+          }
+          error = WSAGetLastError();
+        }
+        data = {};
+      }
+
+      if (!error) {
+        copied = deliver_datagram(data, raw.source, raw.source_size,
+                                  op->bufs.data(), (DWORD)op->bufs.size(),
+                                  op->from, op->fromlen);
+        if (copied < data.size()) {
+          flags |= MSG_PARTIAL;
+          error = WSAEMSGSIZE;
+        }
+      }
+    }
+
+    self->finish(op, error, copied, flags);
+  }
+
+public:
+  overlapped_receives() = default;
+
+  // cancels the receives still in progress, whose callbacks complete the
+  // application's operations as aborted
+  ~overlapped_receives() {
+    {
+      std::unique_lock lock(mtx_);
+      stopping_ = true;
+      for (auto op : ops_) {
+        CancelIoEx((HANDLE)op->sock, &op->overlapped);
+      }
+      drained_.wait(lock, [this] { return ops_.empty(); });
+    }
+    reap();
+  }
+
+  overlapped_receives(const overlapped_receives &) = delete;
+  overlapped_receives &operator=(const overlapped_receives &) = delete;
+
+  // starts an overlapped receive of the application on `s` and returns
+  // what the hooked call returns
+  int start(SOCKET s, std::shared_ptr<udp_association<SOCKET>> assoc,
+            LPWSABUF bufs, DWORD count, DWORD flags, sockaddr *from,
+            LPINT fromlen, LPWSAMSG msg, LPWSAOVERLAPPED overlapped,
+            LPWSAOVERLAPPED_COMPLETION_ROUTINE routine) {
+    reap();
+
+    auto op = std::make_unique<operation>();
+    op->owner = this;
+    op->sock = s;
+    op->assoc = std::move(assoc);
+    op->in_flags = flags;
+    op->bufs.assign(bufs, bufs + count);
+    op->from = from;
+    op->fromlen = fromlen;
+    op->msg = msg;
+    op->app = overlapped;
+    op->routine = routine;
+    op->binding = handshakes ? handshakes->binding_of(s) : std::nullopt;
+
+    // completion routines run on the thread that has made the call
+    if (routine && !DuplicateHandle(GetCurrentProcess(), GetCurrentThread(),
+                                    GetCurrentProcess(), &op->thread, 0,
+                                    FALSE, DUPLICATE_SAME_ACCESS)) {
+      op->thread = nullptr;
+    }
+
+    op->wait = CreateThreadpoolWait(on_wait, op.get(), nullptr);
+    if (op->event == WSA_INVALID_EVENT || !op->wait ||
+        (routine && !op->thread)) {
+      WSASetLastError(WSAENOBUFS);
+      return SOCKET_ERROR;
+    }
+
+    std::lock_guard guard(mtx_);
+    if (!post(*op)) {
+      auto error = WSAGetLastError();
+      op.reset();
+      WSASetLastError(error);
+      return SOCKET_ERROR;
+    }
+
+    ops_.insert(op.release());
+    WSASetLastError(WSA_IO_PENDING);
+    return SOCKET_ERROR;
+  }
+};
+
+inline std::optional<int>
+receive_datagram(SOCKET s, LPWSABUF bufs, DWORD count, LPDWORD received,
+                 LPDWORD flags, sockaddr *from, LPINT fromlen, LPWSAMSG msg,
+                 LPWSAOVERLAPPED overlapped,
+                 LPWSAOVERLAPPED_COMPLETION_ROUTINE routine) {
+  auto assoc = udp ? udp->get(s) : nullptr;
+  if (!assoc || assoc->refused()) {
+    return std::nullopt;
+  }
+
+  DWORD in_flags = flags ? *flags : 0;
+  if (overlapped) {
+    if (!receives) {
+      return std::nullopt;
+    }
+    return receives->start(s, std::move(assoc), bufs, count, in_flags, from,
+                           fromlen, msg, overlapped, routine);
+  }
+
+  thread_local raw_datagram raw;
+  std::span<const char> data;
+  while (true) {
+    DWORD n = 0;
+    if (raw.post(s, in_flags, msg, &n, nullptr) == SOCKET_ERROR) {
+      return SOCKET_ERROR;
+    }
+    raw.received(msg);
+    data = {raw.data.get(), n};
+
+    // malformed datagrams and fragments from the relay are dropped, unless
+    // the caller is only peeking
+    if (unwrap_datagram(*assoc, data, raw.source, raw.source_size)) {
+      break;
+    } else if (in_flags & MSG_PEEK) {
+      data = {};
+      break;
+    }
+  }
+
+  auto copied = deliver_datagram(data, raw.source, raw.source_size, bufs,
+                                 count, from, fromlen);
+  if (received) {
+    *received = copied;
+  }
+  if (flags) {
+    *flags = raw.flags;
+  }
+
+  if (copied < data.size()) {
+    if (flags) {
+      *flags |= MSG_PARTIAL;
+    }
+    WSASetLastError(WSAEMSGSIZE);
+    return SOCKET_ERROR;
+  }
+  return 0;
+}
+
+struct hook_WSARecvFrom : minhook::api<WSARecvFrom, hook_WSARecvFrom> {
+  static int WSAAPI detour(SOCKET s, LPWSABUF lpBuffers, DWORD dwBufferCount,
+                           LPDWORD lpNumberOfBytesRecvd, LPDWORD lpFlags,
+                           sockaddr *lpFrom, LPINT lpFromlen,
+                           LPWSAOVERLAPPED lpOverlapped,
+                           LPWSAOVERLAPPED_COMPLETION_ROUTINE
+                               lpCompletionRoutine) {
+    if (auto ret = receive_datagram(s, lpBuffers, dwBufferCount,
+                                    lpNumberOfBytesRecvd, lpFlags, lpFrom,
+                                    lpFromlen, nullptr, lpOverlapped,
+                                    lpCompletionRoutine)) {
+      return *ret;
+    }
+
+    return original(s, lpBuffers, dwBufferCount, lpNumberOfBytesRecvd, lpFlags,
+                    lpFrom, lpFromlen, lpOverlapped, lpCompletionRoutine);
+  }
+};
+
+struct hook_recvfrom : minhook::api<recvfrom, hook_recvfrom> {
+  static int WSAAPI detour(SOCKET s, char *buf, int len, int flags,
+                           sockaddr *from, int *fromlen) {
+    WSABUF one{(ULONG)len, buf};
+    DWORD received = 0, in_flags = flags;
+    if (auto ret = receive_datagram(s, &one, 1, &received, &in_flags, from,
+                                    fromlen, nullptr, nullptr, nullptr)) {
+      return *ret == SOCKET_ERROR ? SOCKET_ERROR : (int)received;
+    }
+
+    return original(s, buf, len, flags, from, fromlen);
+  }
+};
+
 template <typename T, typename... Ts> minhook::status create_hooks() {
   if (auto status = T::create(); status.error()) {
     return status;
@@ -448,7 +1868,13 @@ inline minhook::status hook_create_all() {
                       hook_WSAConnectByNameA, hook_WSAConnectByNameW,
                       hook_CreateProcessA, hook_CreateProcessW,
                       hook_ioctlsocket, hook_WSAAsyncSelect,
-                      hook_WSAEventSelect, hook_ConnectEx>();
+                      hook_WSAEventSelect, hook_closesocket, hook_send,
+                      hook_recv, hook_WSASend, hook_WSARecv, hook_ConnectEx,
+                      hook_getaddrinfo, hook_GetAddrInfoW, hook_freeaddrinfo,
+                      hook_FreeAddrInfoW, hook_sendto, hook_WSASendTo,
+                      hook_recvfrom, hook_WSARecvFrom, hook_WSARecvMsg,
+                      hook_CreateIoCompletionPort,
+                      hook_SetFileCompletionNotificationModes>();
 }
 
 #endif
@@ -20,17 +20,26 @@ void do_client(HINSTANCE dll_handle, std::uint16_t port) {
   {
     asio::io_context io_context(1);
 
-    auto qu =
-        std::make_unique<blocking_queue<InjecteeMessage>>(io_context, 1024);
+    auto qu = std::make_unique<mpsc_queue<InjecteeMessage>>(io_context);
     auto cfg = std::make_unique<injectee_config>();
-    auto sock_map = std::make_unique<std::map<SOCKET, bool>>();
+    auto sock_map = std::make_unique<socket_table<SOCKET>>();
+    auto driver = std::make_unique<handshake_driver>();
+    auto names = std::make_unique<fake_dns>();
+    auto res = std::make_unique<remote_resolver>();
+    auto assocs = std::make_unique<udp_associations<SOCKET>>();
+    auto recvs = std::make_unique<overlapped_receives>();
 
     scope_ptr_bind queue_bind(queue, qu.get());
     scope_ptr_bind config_bind(config, cfg.get());
     scope_ptr_bind map_bind(nbio_map, sock_map.get());
+    scope_ptr_bind handshake_bind(handshakes, driver.get());
+    scope_ptr_bind names_bind(fake_names, names.get());
+    scope_ptr_bind resolver_bind(resolver, res.get());
+    scope_ptr_bind udp_bind(udp, assocs.get());
+    scope_ptr_bind receives_bind(receives, recvs.get());
 
     injectee_client c(io_context, tcp::endpoint(localhost, port), *queue,
-                      *config);
+                      *config, resolver);
     asio::co_spawn(io_context, c.start(), asio::detached);
 
     io_context.run();
@@ -0,0 +1,117 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef PROXINJECT_INJECTEE_POSIXNET
+#define PROXINJECT_INJECTEE_POSIXNET
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <array>
+#include <bit>
+#include <netinet/in.h>
+#include <optional>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// POSIX counterpart of winnet.hpp, keeping the same byte order conventions
+// for `IpAddr` so that both backends report identical messages
+
+std::optional<IpAddr> to_ip_addr(const sockaddr *name) {
+  if (name->sa_family == AF_INET) {
+    auto v4 = (const sockaddr_in *)name;
+    return IpAddr((std::uint32_t)ntohl(v4->sin_addr.s_addr), {}, {},
+                  ntohs(v4->sin_port));
+  } else if (name->sa_family == AF_INET6) {
+    auto v6 = (const sockaddr_in6 *)name;
+    auto addr = std::bit_cast<std::array<unsigned char, 16>>(v6->sin6_addr);
+    return IpAddr(std::nullopt,
+                  std::vector<unsigned char>{addr.begin(), addr.end()}, {},
+                  ntohs(v6->sin6_port));
+  }
+
+  return std::nullopt;
+}
+
+struct sockaddr_buf {
+  sockaddr_storage storage{};
+  socklen_t size = 0;
+
+  const sockaddr *get() const { return (const sockaddr *)&storage; }
+};
+
+std::optional<sockaddr_buf> to_sockaddr(const IpAddr &addr) {
+  sockaddr_buf res;
+
+  if (const auto &v = addr["v4_addr"_f]) {
+    auto v4 = (sockaddr_in *)&res.storage;
+    v4->sin_family = AF_INET;
+    v4->sin_addr.s_addr = htonl(v.value());
+    v4->sin_port = htons(addr["port"_f].value());
+    res.size = sizeof(sockaddr_in);
+  } else if (const auto &v = addr["v6_addr"_f]; v && v->size() == 16) {
+    auto v6 = (sockaddr_in6 *)&res.storage;
+    v6->sin6_family = AF_INET6;
+    std::copy(v->begin(), v->end(), v6->sin6_addr.s6_addr);
+    v6->sin6_port = htons(addr["port"_f].value());
+    res.size = sizeof(sockaddr_in6);
+  } else {
+    return std::nullopt;
+  }
+
+  return res;
+}
+
+bool is_localhost(const sockaddr *name) {
+  if (name->sa_family == AF_INET) {
+    auto v4 = (const sockaddr_in *)name;
+    return (ntohl(v4->sin_addr.s_addr) >> 24) == 0x7f;
+  } else if (name->sa_family == AF_INET6) {
+    auto v6 = (const sockaddr_in6 *)name;
+    return IN6_IS_ADDR_LOOPBACK(&v6->sin6_addr);
+  }
+
+  return false;
+}
+
+bool is_inet(const sockaddr *name) {
+  return name->sa_family == AF_INET || name->sa_family == AF_INET6;
+}
+
+bool sockequal(const sockaddr *l, const sockaddr *r) {
+  if (l->sa_family == r->sa_family) {
+    if (l->sa_family == AF_INET) {
+      auto l4 = (const sockaddr_in *)l;
+      auto r4 = (const sockaddr_in *)r;
+
+      return l4->sin_addr.s_addr == r4->sin_addr.s_addr &&
+             l4->sin_port == r4->sin_port;
+    } else if (l->sa_family == AF_INET6) {
+      auto l6 = (const sockaddr_in6 *)l;
+      auto r6 = (const sockaddr_in6 *)r;
+
+      return l6->sin6_port == r6->sin6_port &&
+             IN6_ARE_ADDR_EQUAL(&l6->sin6_addr, &r6->sin6_addr);
+    }
+
+    return false;
+  }
+
+  return false;
+}
+
+std::uint32_t current_pid() { return (std::uint32_t)getpid(); }
+
+#endif
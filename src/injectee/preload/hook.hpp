@@ -0,0 +1,927 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef PROXINJECT_INJECTEE_PRELOAD_HOOK
+#define PROXINJECT_INJECTEE_PRELOAD_HOOK
+
+#include "client.hpp"
+#include "proxy_chain.hpp"
+#include "udp_relay.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <netinet/udp.h>
+#include <numeric>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+inline mpsc_queue<InjecteeMessage> *queue = nullptr;
+inline injectee_config *config = nullptr;
+inline udp_associations<int> *udp = nullptr;
+
+// environment entries that make a child process load this library and find
+// the injector, captured when the library is loaded
+inline std::string preload_env;
+inline std::string port_env;
+
+constexpr const std::string_view preload_env_name = "LD_PRELOAD=";
+constexpr const std::string_view port_env_name = "PROXINJECT_PORT=";
+
+// the definition a hook overrides, i.e. the one in libc; looked up lazily
+// since hooks can run before the library constructor
+template <typename F> F *next_symbol(const char *name) {
+  return reinterpret_cast<F *>(dlsym(RTLD_NEXT, name));
+}
+
+struct blocking_scope {
+  int fd;
+  int flags;
+
+  blocking_scope(int fd) : fd(fd), flags(fcntl(fd, F_GETFL)) {
+    if (flags != -1 && (flags & O_NONBLOCK)) {
+      fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+  }
+  ~blocking_scope() {
+    if (flags != -1 && (flags & O_NONBLOCK)) {
+      fcntl(fd, F_SETFL, flags);
+    }
+  }
+
+  blocking_scope(const blocking_scope &) = delete;
+  blocking_scope(blocking_scope &&) = delete;
+};
+
+// bounds the blocking calls on `fd` by one deadline, through its send and
+// receive timeouts; the application's own timeouts are put back afterwards
+struct deadline_scope {
+  int fd;
+  std::chrono::steady_clock::time_point deadline;
+  timeval send_timeout{}, recv_timeout{};
+  bool saved;
+  bool timed_out = false;
+
+  deadline_scope(int fd, std::chrono::milliseconds timeout)
+      : fd(fd), deadline(std::chrono::steady_clock::now() + timeout) {
+    socklen_t send_len = sizeof(send_timeout), recv_len = sizeof(recv_timeout);
+    saved = getsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout,
+                       &send_len) == 0 &&
+            getsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &recv_timeout,
+                       &recv_len) == 0;
+  }
+  ~deadline_scope() {
+    if (saved) {
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout,
+                 sizeof(send_timeout));
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &recv_timeout,
+                 sizeof(recv_timeout));
+    }
+  }
+
+  // gives the next call what is left before the deadline; false once none is
+  // (without the application's timeouts to restore, calls are left unbounded)
+  bool arm() {
+    if (!saved) {
+      return true;
+    }
+
+    auto left = std::chrono::duration_cast<std::chrono::microseconds>(
+        deadline - std::chrono::steady_clock::now());
+    if (left.count() <= 0) {
+      timed_out = true;
+      return false;
+    }
+
+    timeval tv{(time_t)(left.count() / 1000000),
+               (suseconds_t)(left.count() % 1000000)};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return true;
+  }
+
+  // a call that failed with `error` under the timeouts ran out of time;
+  // a blocking connect reports that as EINPROGRESS
+  bool expired(int error) {
+    if (saved && (error == EAGAIN || error == EWOULDBLOCK ||
+                  error == EINPROGRESS)) {
+      timed_out = true;
+    }
+    return timed_out;
+  }
+
+  deadline_scope(const deadline_scope &) = delete;
+  deadline_scope(deadline_scope &&) = delete;
+};
+
+// runs the whole handshake of `client` on a connected, blocking socket, each
+// step bounded by `deadline` if one is given
+inline char socks5_connect(int fd, proxy_chain &client,
+                           deadline_scope *deadline = nullptr) {
+  while (client.want_write() || client.want_read()) {
+    if (deadline && !deadline->arm()) {
+      client.closed();
+      return SOCKS_GENERAL_FAILURE;
+    }
+
+    if (client.want_write()) {
+      auto out = client.output();
+      auto n = send(fd, out.data(), out.size(), MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0) {
+        if (deadline) {
+          deadline->expired(errno);
+        }
+        client.closed();
+        return SOCKS_GENERAL_FAILURE;
+      }
+
+      client.sent(n);
+    } else {
+      auto in = client.input();
+      auto peek = client.peek();
+      auto n = recv(fd, in.data(), in.size(), peek ? MSG_PEEK : 0);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0) {
+        if (n < 0 && deadline) {
+          deadline->expired(errno);
+        }
+        client.closed();
+        return SOCKS_GENERAL_FAILURE;
+      }
+
+      // what the handshake used of peeked bytes is taken off the socket
+      auto used = client.received(n);
+      while (peek && recv(fd, in.data(), used, 0) < 0 && errno == EINTR) {
+      }
+    }
+  }
+
+  return client.done() ? SOCKS_SUCCESS : client.reply();
+}
+
+// connects `fd` to `proxy` once more; connecting a TCP socket to AF_UNSPEC
+// drops its connection and lets it connect again, keeping its options
+inline bool reconnect_proxy(int fd, const upstream &proxy,
+                            deadline_scope &deadline) {
+  static auto f = next_symbol<decltype(::connect)>("connect");
+
+  sockaddr unspec{};
+  unspec.sa_family = AF_UNSPEC;
+  if (f(fd, &unspec, sizeof(unspec)) != 0 || !deadline.arm()) {
+    return false;
+  }
+  if (f(fd, proxy.get(), proxy.size) != 0) {
+    deadline.expired(errno);
+    return false;
+  }
+  return true;
+}
+
+inline bool proxy_handshake(int fd, const config_snapshot &snapshot,
+                            const upstream &proxy,
+                            std::span<const char> request,
+                            deadline_scope &deadline) {
+  proxy_chain client(request, proxy.protocol, snapshot.chain,
+                     snapshot.pipelining());
+  auto res = socks5_connect(fd, client, &deadline);
+
+  // a proxy refusing the pipelined handshake is asked once more in sequence
+  if (config_snapshot::pipeline_refused(client)) {
+    snapshot.report(proxy, client);
+    client.restart();
+    res = reconnect_proxy(fd, proxy, deadline)
+              ? socks5_connect(fd, client, &deadline)
+              : SOCKS_GENERAL_FAILURE;
+  }
+  snapshot.report(proxy, client);
+
+  // the connect event sent before cannot tell how long the hops took
+  if (queue && snapshot.log && !snapshot.chain.empty()) {
+    InjecteeTiming timing;
+    timing["handle"_f] = (std::uint32_t)fd;
+    timing["syscall"_f] = "connect";
+    timing["hop_us"_f] = client.hop_us();
+    if (!timing["hop_us"_f].empty()) {
+      timing["handshake_us"_f] = std::accumulate(
+          timing["hop_us"_f].begin(), timing["hop_us"_f].end(), 0u);
+    }
+    timing["success"_f] = client.done();
+    timing["timed_out"_f] = deadline.timed_out;
+    queue->push(create_message<InjecteeMessage, "timing">(std::move(timing)));
+  }
+
+  if (res != SOCKS_SUCCESS) {
+    shutdown(fd, SHUT_RDWR);
+    errno = deadline.timed_out ? ETIMEDOUT : ECONNREFUSED;
+    return false;
+  }
+
+  return true;
+}
+
+inline bool is_stream(int fd) {
+  int type = 0;
+  socklen_t len = sizeof(type);
+  return getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 &&
+         type == SOCK_STREAM;
+}
+
+struct hook_connect {
+  static int original(int fd, const sockaddr *name, socklen_t namelen) {
+    static auto f = next_symbol<decltype(::connect)>("connect");
+    return f(fd, name, namelen);
+  }
+
+  // non-blocking sockets are switched to blocking mode for the handshake,
+  // so the application sees a connect that completed immediately; the
+  // connect and the handshake together give up after the connect timeout
+  static int detour(int fd, const sockaddr *name, socklen_t namelen) {
+    if (is_inet(name) && config && !is_localhost(name) && is_stream(fd)) {
+      auto snapshot = config->get();
+      auto action = snapshot->routes.route(name);
+      auto proxy = snapshot->pick(action);
+
+      if (queue && snapshot->log) {
+        if (auto v = to_ip_addr(name)) {
+          queue->push(create_message<InjecteeMessage, "connect">(
+              InjecteeConnect{(std::uint32_t)fd, *v, snapshot->via(proxy),
+                              "connect"}));
+        }
+      }
+
+      if (action == route_action::block) {
+        errno = ECONNREFUSED;
+        return -1;
+      }
+
+      char req[SOCKS_REQUEST_MAX_SIZE];
+      auto size = socks5_encode_request(req, name);
+
+      if (proxy && size && !sockequal(proxy->get(), name)) {
+        blocking_scope scope(fd);
+        deadline_scope deadline(fd, snapshot->connect_timeout);
+
+        deadline.arm();
+        auto ret = original(fd, proxy->get(), proxy->size);
+        if (ret) {
+          if (deadline.expired(errno)) {
+            errno = ETIMEDOUT;
+          }
+          return ret;
+        }
+
+        if (!proxy_handshake(fd, *snapshot, *proxy, {req, size}, deadline)) {
+          return -1;
+        }
+
+        return 0;
+      }
+    }
+    return original(fd, name, namelen);
+  }
+};
+
+inline bool is_datagram(int fd) {
+  int type = 0;
+  socklen_t len = sizeof(type);
+  return getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 &&
+         type == SOCK_DGRAM;
+}
+
+struct hook_close {
+  static int original(int fd) {
+    static auto f = next_symbol<decltype(::close)>("close");
+    return f(fd);
+  }
+
+  static int detour(int fd) {
+    if (udp) {
+      if (auto control = udp->remove(fd); control && *control >= 0) {
+        original(*control);
+      }
+    }
+    return original(fd);
+  }
+};
+
+// starts a UDP ASSOCIATE for `fd` through `proxy`, an upstream of `snapshot`,
+// on a thread of its own and returns the association right away; it holds
+// datagrams until the proxy has answered, and keeps a refusal, so that later
+// datagrams fail at once
+inline std::shared_ptr<udp_association<int>>
+associate(int fd, std::shared_ptr<const config_snapshot> snapshot,
+          const upstream &proxy) {
+  auto [assoc, made] = udp->make(fd);
+  if (!made) {
+    return assoc;
+  }
+
+  auto run = [fd, assoc, snapshot, proxy = &proxy] {
+    // the address datagrams will come from is not known yet
+    sockaddr_in any{};
+    any.sin_family = AF_INET;
+
+    char req[SOCKS_REQUEST_MAX_SIZE];
+    auto size = socks5_encode_request(req, (const sockaddr *)&any,
+                                      SOCKS_UDP_ASSOCIATE);
+
+    // an HTTP proxy has no UDP to offer, and datagrams cannot follow a chain
+    // (they would skip its hops); either is kept as a refusal
+    std::optional<sockaddr_buf> relay;
+    int control =
+        proxy->protocol == proxy_protocol::socks5 && snapshot->chain.empty()
+            ? socket(proxy->get()->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0)
+            : -1;
+
+    // the connect and every step of the handshake give up after the timeout
+    auto timeout = std::chrono::duration_cast<std::chrono::microseconds>(
+        snapshot->connect_timeout);
+    timeval tv{(time_t)(timeout.count() / 1000000),
+               (suseconds_t)(timeout.count() % 1000000)};
+    if (control >= 0) {
+      setsockopt(control, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+      setsockopt(control, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+
+    if (control >= 0 &&
+        hook_connect::original(control, proxy->get(), proxy->size) == 0) {
+      proxy_chain client(std::span<const char>(req, size));
+      auto res = socks5_connect(control, client);
+      snapshot->report(*proxy, client);
+
+      if (res == SOCKS_SUCCESS) {
+        relay = relay_address(client.bound(), *proxy);
+      }
+    }
+
+    if (!relay && control >= 0) {
+      hook_close::original(control);
+      control = -1;
+    }
+
+    auto send = [&](std::span<const char> datagram) {
+      iovec iov{const_cast<char *>(datagram.data()), datagram.size()};
+      msghdr msg{};
+      msg.msg_name = const_cast<sockaddr *>(relay->get());
+      msg.msg_namelen = relay->size;
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      static auto f = next_symbol<decltype(::sendmsg)>("sendmsg");
+      f(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    };
+    if (!assoc->settle(control, relay, send) && control >= 0) {
+      hook_close::original(control);
+    }
+  };
+
+  try {
+    std::thread(run).detach();
+  } catch (std::system_error &) {
+    assoc->settle(-1, std::nullopt, [](std::span<const char>) {});
+  }
+  return assoc;
+}
+
+// the association a datagram from `fd` to `to` has to go through, pending or
+// relayed, or null to send it as it is; nullopt with errno set if it must
+// not be sent
+inline std::optional<std::shared_ptr<udp_association<int>>>
+udp_route(int fd, const sockaddr *to) {
+  if (!to || !udp || !config || !is_inet(to) || is_localhost(to)) {
+    return nullptr;
+  }
+
+  auto snapshot = config->get();
+  auto action = snapshot->routes.route(to);
+  if (action == route_action::block) {
+    errno = ECONNREFUSED;
+    return std::nullopt;
+  } else if (action != route_action::proxy || !snapshot->udp_relay) {
+    return nullptr;
+  }
+
+  auto assoc = udp->get(fd);
+  if (!assoc) {
+    auto proxy = snapshot->pick(action);
+    if (!proxy || !is_datagram(fd)) {
+      return nullptr;
+    }
+    assoc = associate(fd, snapshot, *proxy);
+  }
+
+  if (assoc->refused()) {
+    errno = ENETUNREACH;
+    return std::nullopt;
+  }
+  return assoc;
+}
+
+// holds the datagram of `iov` to `to` while `assoc` is pending; false if it
+// has been settled, so that the datagram is to be sent as usual
+inline bool hold_datagram(udp_association<int> &assoc, const sockaddr *to,
+                          const iovec *iov, std::size_t count) {
+  return assoc.state() == udp_state::pending && assoc.hold([&] {
+    std::vector<char> datagram(SOCKS_REQUEST_MAX_SIZE);
+    datagram.resize(socks5_encode_udp_header(datagram.data(), to));
+    for (std::size_t i = 0; i < count; ++i) {
+      auto base = (const char *)iov[i].iov_base;
+      datagram.insert(datagram.end(), base, base + iov[i].iov_len);
+    }
+    return datagram;
+  });
+}
+
+// proxied datagrams of a batch get their header as an extra leading iovec
+// and are redirected to the relay, so the batch still takes a single call
+struct hook_sendmmsg {
+  static int original(int fd, mmsghdr *msgs, unsigned int vlen, int flags) {
+    static auto f = next_symbol<decltype(::sendmmsg)>("sendmmsg");
+    return f(fd, msgs, vlen, flags);
+  }
+
+  static int detour(int fd, mmsghdr *msgs, unsigned int vlen, int flags) {
+    if (!udp || !config || vlen == 0) {
+      return original(fd, msgs, vlen, flags);
+    }
+
+    std::vector<mmsghdr> wrapped(msgs, msgs + vlen);
+    std::vector<std::size_t> header_sizes(vlen);
+    std::vector<char> headers(vlen * SOCKS_REQUEST_MAX_SIZE);
+
+    // reserved up front, as the wrapped messages point into it
+    std::size_t iov_count = 0;
+    for (unsigned int i = 0; i < vlen; ++i) {
+      iov_count += msgs[i].msg_hdr.msg_iovlen + 1;
+    }
+    std::vector<iovec> iovs;
+    iovs.reserve(iov_count);
+
+    bool proxied = false;
+    for (unsigned int i = 0; i < vlen; ++i) {
+      auto &hdr = wrapped[i].msg_hdr;
+      auto to = (const sockaddr *)hdr.msg_name;
+
+      // a datagram held for a pending association is sent alone, ending
+      // the batch before it
+      auto route = udp_route(fd, to);
+      if (route && *route && !(*route)->relayed()) {
+        if (i > 0) {
+          vlen = i;
+          break;
+        }
+
+        if (hold_datagram(**route, to, hdr.msg_iov, hdr.msg_iovlen)) {
+          msgs[0].msg_len = std::accumulate(
+              hdr.msg_iov, hdr.msg_iov + hdr.msg_iovlen, 0u,
+              [](unsigned int n, const iovec &v) {
+                return n + (unsigned int)v.iov_len;
+              });
+          return 1;
+        } else if (!(*route)->relayed()) {
+          errno = ENETUNREACH;
+          route = std::nullopt;
+        }
+      }
+
+      // like sendmmsg itself, stop at the first datagram that fails
+      if (!route) {
+        if (i == 0) {
+          return -1;
+        }
+        vlen = i;
+        break;
+      } else if (!*route) {
+        continue;
+      }
+
+      const auto &relay = (*route)->relay();
+      auto header = headers.data() + i * SOCKS_REQUEST_MAX_SIZE;
+      header_sizes[i] = socks5_encode_udp_header(header, to);
+
+      auto first = iovs.size();
+      iovs.push_back({header, header_sizes[i]});
+      iovs.insert(iovs.end(), hdr.msg_iov, hdr.msg_iov + hdr.msg_iovlen);
+
+      hdr.msg_iov = iovs.data() + first;
+      hdr.msg_iovlen += 1;
+      hdr.msg_name = const_cast<sockaddr *>(relay.get());
+      hdr.msg_namelen = relay.size;
+      proxied = true;
+    }
+
+    if (!proxied) {
+      return original(fd, msgs, vlen, flags);
+    }
+
+    int n = original(fd, wrapped.data(), vlen, flags);
+    for (int i = 0; i < n; ++i) {
+      auto len = wrapped[i].msg_len;
+      msgs[i].msg_len = len > header_sizes[i] ? len - header_sizes[i] : 0;
+    }
+    return n;
+  }
+};
+
+// copies the control data of `msg` into `control`, but for a UDP_SEGMENT
+// message, whose segment size is returned (0 without one)
+inline std::size_t strip_segment(const msghdr &msg,
+                                 std::vector<char> &control) {
+  std::size_t segment = 0;
+  auto end = (const char *)msg.msg_control + msg.msg_controllen;
+  for (auto c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR((msghdr *)&msg, c)) {
+    if (c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_SEGMENT) {
+      std::uint16_t size;
+      std::memcpy(&size, CMSG_DATA(c), sizeof(size));
+      segment = size;
+      continue;
+    }
+
+    auto from = (const char *)c;
+    auto size = std::min<std::size_t>(CMSG_ALIGN(c->cmsg_len), end - from);
+    control.insert(control.end(), from, from + size);
+    control.resize(CMSG_ALIGN(control.size()));
+  }
+  return segment;
+}
+
+// proxied datagrams get their header as an extra leading iovec; a payload
+// that the kernel is asked to split into segments (UDP GSO) is split here
+// instead, since each segment needs a header of its own, and the segments
+// go out with a single sendmmsg
+struct hook_sendmsg {
+  static ssize_t original(int fd, const msghdr *msg, int flags) {
+    static auto f = next_symbol<decltype(::sendmsg)>("sendmsg");
+    return f(fd, msg, flags);
+  }
+
+  static ssize_t detour(int fd, const msghdr *msg, int flags) {
+    auto to = (const sockaddr *)msg->msg_name;
+    auto route = udp_route(fd, to);
+    if (!route) {
+      return -1;
+    } else if (!*route) {
+      return original(fd, msg, flags);
+    }
+
+    auto &assoc = **route;
+    std::vector<char> control;
+    auto segment = strip_segment(*msg, control);
+
+    // the payload, in segments of `segment` bytes, or whole
+    std::vector<char> payload;
+    for (std::size_t i = 0; i < msg->msg_iovlen; ++i) {
+      auto base = (const char *)msg->msg_iov[i].iov_base;
+      payload.insert(payload.end(), base, base + msg->msg_iov[i].iov_len);
+    }
+    if (segment == 0 || segment >= payload.size()) {
+      segment = std::max<std::size_t>(payload.size(), 1);
+    }
+
+    std::vector<iovec> segments;
+    for (std::size_t at = 0; at < payload.size() || segments.empty();
+         at += segment) {
+      segments.push_back(
+          {payload.data() + at, std::min(segment, payload.size() - at)});
+    }
+
+    bool held = true;
+    for (const auto &v : segments) {
+      held = held && hold_datagram(assoc, to, &v, 1);
+    }
+    if (held) {
+      return payload.size();
+    } else if (!assoc.relayed()) {
+      errno = ENETUNREACH;
+      return -1;
+    }
+
+    const auto &relay = assoc.relay();
+    char header[SOCKS_REQUEST_MAX_SIZE];
+    auto size = socks5_encode_udp_header(header, to);
+
+    std::vector<iovec> iovs;
+    iovs.reserve(segments.size() * 2);
+    std::vector<mmsghdr> msgs(segments.size());
+    for (std::size_t i = 0; i < segments.size(); ++i) {
+      iovs.push_back({header, size});
+      iovs.push_back(segments[i]);
+
+      auto &hdr = msgs[i].msg_hdr;
+      hdr.msg_name = const_cast<sockaddr *>(relay.get());
+      hdr.msg_namelen = relay.size;
+      hdr.msg_iov = iovs.data() + i * 2;
+      hdr.msg_iovlen = 2;
+      hdr.msg_control = control.empty() ? nullptr : control.data();
+      hdr.msg_controllen = control.size();
+    }
+
+    if (msgs.size() == 1) {
+      auto n = original(fd, &msgs[0].msg_hdr, flags);
+      if (n < 0) {
+        return n;
+      }
+      return n > (ssize_t)size ? n - size : 0;
+    }
+
+    auto n = hook_sendmmsg::original(fd, msgs.data(), msgs.size(), flags);
+    if (n < 0) {
+      return n;
+    }
+    std::size_t sent = 0;
+    for (int i = 0; i < n; ++i) {
+      sent += segments[i].iov_len;
+    }
+    return sent;
+  }
+};
+
+// the header goes out from its own buffer ahead of the application's payload
+struct hook_sendto {
+  static ssize_t original(int fd, const void *buf, size_t len, int flags,
+                          const sockaddr *to, socklen_t tolen) {
+    static auto f = next_symbol<decltype(::sendto)>("sendto");
+    return f(fd, buf, len, flags, to, tolen);
+  }
+
+  static ssize_t detour(int fd, const void *buf, size_t len, int flags,
+                        const sockaddr *to, socklen_t tolen) {
+    auto route = udp_route(fd, to);
+    if (!route) {
+      return -1;
+    } else if (!*route) {
+      return original(fd, buf, len, flags, to, tolen);
+    }
+
+    auto &assoc = **route;
+    iovec payload{const_cast<void *>(buf), len};
+    if (hold_datagram(assoc, to, &payload, 1)) {
+      return len;
+    } else if (!assoc.relayed()) {
+      errno = ENETUNREACH;
+      return -1;
+    }
+
+    const auto &relay = assoc.relay();
+    char header[SOCKS_REQUEST_MAX_SIZE];
+    auto size = socks5_encode_udp_header(header, to);
+
+    iovec iov[2] = {{header, size}, payload};
+    msghdr msg{};
+    msg.msg_name = const_cast<sockaddr *>(relay.get());
+    msg.msg_namelen = relay.size;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    auto n = hook_sendmsg::original(fd, &msg, flags);
+    if (n < 0) {
+      return n;
+    }
+    return n > (ssize_t)size ? n - size : 0;
+  }
+};
+
+// every receive of a socket with an association that has not been refused
+// strips the header of datagrams from the relay, copying the payload once
+// into the caller's buffers; datagrams that other hosts have sent directly
+// are passed on as they are
+//
+// NOTE: read and readv are left alone, as associations are only made for
+// datagrams sent with a destination of their own
+struct hook_recvmsg {
+  static ssize_t original(int fd, msghdr *msg, int flags) {
+    static auto f = next_symbol<decltype(::recvmsg)>("recvmsg");
+    return f(fd, msg, flags);
+  }
+
+  // the association of `fd` to unwrap its receives with, or null
+  static std::shared_ptr<udp_association<int>> unwrapping(int fd, int flags) {
+    auto assoc = udp && !(flags & MSG_ERRQUEUE) ? udp->get(fd) : nullptr;
+    return assoc && !assoc->refused() ? assoc : nullptr;
+  }
+
+  static ssize_t unwrap(int fd, udp_association<int> &assoc, msghdr *msg,
+                        int flags) {
+    thread_local auto scratch = std::make_unique<char[]>(udp_datagram_max_size);
+
+    sockaddr_storage source;
+    iovec whole{scratch.get(), udp_datagram_max_size};
+    msghdr inner{};
+    inner.msg_iov = &whole;
+    inner.msg_iovlen = 1;
+    std::span<const char> data;
+
+    while (true) {
+      inner.msg_name = &source;
+      inner.msg_namelen = sizeof(source);
+      inner.msg_control = msg->msg_control;
+      inner.msg_controllen = msg->msg_controllen;
+      auto n = original(fd, &inner, flags & ~MSG_TRUNC);
+      if (n < 0) {
+        return n;
+      }
+      data = {scratch.get(), (std::size_t)n};
+
+      // the state is read after the datagram has arrived, since a reply
+      // from the relay can only follow its settling
+      if (!assoc.relayed() ||
+          !sockequal((const sockaddr *)&source, assoc.relay().get())) {
+        break;
+      }
+
+      // malformed datagrams and fragments from the relay are dropped, unless
+      // the caller is only peeking
+      sockaddr_storage origin;
+      if (auto header = socks5_decode_udp_header(data, origin)) {
+        data = data.subspan(header);
+        source = origin;
+        inner.msg_namelen = source.ss_family == AF_INET
+                                ? sizeof(sockaddr_in)
+                                : sizeof(sockaddr_in6);
+        break;
+      } else if (flags & MSG_PEEK) {
+        data = {};
+        break;
+      }
+    }
+
+    std::size_t copied = 0;
+    for (std::size_t i = 0; i < msg->msg_iovlen && copied < data.size(); ++i) {
+      auto size = std::min(msg->msg_iov[i].iov_len, data.size() - copied);
+      std::memcpy(msg->msg_iov[i].iov_base, data.data() + copied, size);
+      copied += size;
+    }
+
+    if (msg->msg_name) {
+      std::memcpy(msg->msg_name, &source,
+                  std::min(msg->msg_namelen, inner.msg_namelen));
+      msg->msg_namelen = inner.msg_namelen;
+    }
+    msg->msg_controllen = inner.msg_controllen;
+    msg->msg_flags = inner.msg_flags & ~MSG_TRUNC;
+    if (copied < data.size()) {
+      msg->msg_flags |= MSG_TRUNC;
+    }
+
+    return (flags & MSG_TRUNC) ? data.size() : copied;
+  }
+
+  static ssize_t detour(int fd, msghdr *msg, int flags) {
+    auto assoc = unwrapping(fd, flags);
+    return assoc ? unwrap(fd, *assoc, msg, flags) : original(fd, msg, flags);
+  }
+};
+
+struct hook_recvfrom {
+  static ssize_t original(int fd, void *buf, size_t len, int flags,
+                          sockaddr *from, socklen_t *fromlen) {
+    static auto f = next_symbol<decltype(::recvfrom)>("recvfrom");
+    return f(fd, buf, len, flags, from, fromlen);
+  }
+
+  static ssize_t detour(int fd, void *buf, size_t len, int flags,
+                        sockaddr *from, socklen_t *fromlen) {
+    auto assoc = hook_recvmsg::unwrapping(fd, flags);
+    if (!assoc) {
+      return original(fd, buf, len, flags, from, fromlen);
+    }
+
+    iovec iov{buf, len};
+    msghdr msg{};
+    msg.msg_name = from && fromlen ? from : nullptr;
+    msg.msg_namelen = from && fromlen ? *fromlen : 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    auto n = hook_recvmsg::unwrap(fd, *assoc, &msg, flags);
+    if (n >= 0 && msg.msg_name) {
+      *fromlen = msg.msg_namelen;
+    }
+    return n;
+  }
+};
+
+// recv is recvfrom without an address, which libc does not turn it into
+struct hook_recv {
+  static ssize_t detour(int fd, void *buf, size_t len, int flags) {
+    return hook_recvfrom::detour(fd, buf, len, flags, nullptr, nullptr);
+  }
+};
+
+// datagrams of a batch are received one at a time, each unwrapped as by
+// recvmsg; as with recvmmsg itself, MSG_WAITFORONE makes every receive after
+// the first non-blocking, and the timeout is only checked once a datagram
+// has arrived
+struct hook_recvmmsg {
+  static int original(int fd, mmsghdr *msgs, unsigned int vlen, int flags,
+                      timespec *timeout) {
+    static auto f = next_symbol<decltype(::recvmmsg)>("recvmmsg");
+    return f(fd, msgs, vlen, flags, timeout);
+  }
+
+  static int detour(int fd, mmsghdr *msgs, unsigned int vlen, int flags,
+                    timespec *timeout) {
+    auto assoc = hook_recvmsg::unwrapping(fd, flags);
+    if (!assoc) {
+      return original(fd, msgs, vlen, flags, timeout);
+    }
+
+    using clock = std::chrono::steady_clock;
+    auto deadline = clock::now();
+    if (timeout) {
+      deadline += std::chrono::seconds(timeout->tv_sec) +
+                  std::chrono::nanoseconds(timeout->tv_nsec);
+    }
+
+    unsigned int i = 0;
+    while (i < vlen) {
+      auto each = flags & ~MSG_WAITFORONE;
+      if (i > 0 && (flags & MSG_WAITFORONE)) {
+        each |= MSG_DONTWAIT;
+      }
+
+      auto n = hook_recvmsg::unwrap(fd, *assoc, &msgs[i].msg_hdr, each);
+      if (n < 0) {
+        if (i == 0) {
+          return -1;
+        }
+        break;
+      }
+      msgs[i++].msg_len = (unsigned int)n;
+
+      if (timeout && clock::now() >= deadline) {
+        break;
+      }
+    }
+
+    // the time left is written back, as recvmmsg does
+    if (timeout) {
+      auto left = std::max(deadline - clock::now(), clock::duration::zero());
+      auto secs = std::chrono::duration_cast<std::chrono::seconds>(left);
+      timeout->tv_sec = (time_t)secs.count();
+      timeout->tv_nsec = (long)std::chrono::duration_cast<
+                             std::chrono::nanoseconds>(left - secs)
+                             .count();
+    }
+    return (int)i;
+  }
+};
+
+// child processes inherit LD_PRELOAD through the environment anyway, so this
+// only has to keep it in line with the "subprocess" option when the
+// application passes an environment of its own
+//
+// NOTE: exec* wrappers and posix_spawn in glibc call execve internally and
+// are not intercepted; their children simply inherit the environment
+struct hook_execve {
+  static int original(const char *path, char *const argv[],
+                      char *const envp[]) {
+    static auto f = next_symbol<decltype(::execve)>("execve");
+    return f(path, argv, envp);
+  }
+
+  static int detour(const char *path, char *const argv[], char *const envp[]) {
+    if (!config || preload_env.empty() || port_env.empty()) {
+      return original(path, argv, envp);
+    }
+
+    std::vector<char *> env;
+    for (auto p = envp; p && *p; ++p) {
+      std::string_view entry(*p);
+      if (!entry.starts_with(preload_env_name) &&
+          !entry.starts_with(port_env_name)) {
+        env.push_back(*p);
+      }
+    }
+
+    if (config->get()->subprocess) {
+      env.push_back(preload_env.data());
+      env.push_back(port_env.data());
+    }
+    env.push_back(nullptr);
+
+    return original(path, argv, env.data());
+  }
+};
+
+#endif
@@ -0,0 +1,113 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "hook.hpp"
+#include <cstdlib>
+#include <thread>
+
+// LD_PRELOAD backend of the injectee: the injector port comes from the
+// PROXINJECT_PORT environment variable instead of a file mapping
+
+void do_client(std::uint16_t port) {
+  asio::io_context io_context(1);
+
+  auto qu = std::make_unique<mpsc_queue<InjecteeMessage>>(io_context);
+  auto cfg = std::make_unique<injectee_config>();
+  auto assocs = std::make_unique<udp_associations<int>>();
+
+  queue = qu.get();
+  config = cfg.get();
+  udp = assocs.get();
+
+  injectee_client c(io_context, tcp::endpoint(localhost, port), *queue,
+                    *config);
+  asio::co_spawn(io_context, c.start(), asio::detached);
+
+  io_context.run();
+
+  queue = nullptr;
+  config = nullptr;
+  udp = nullptr;
+}
+
+extern "C" {
+
+int connect(int fd, const sockaddr *name, socklen_t namelen) {
+  return hook_connect::detour(fd, name, namelen);
+}
+
+ssize_t sendto(int fd, const void *buf, size_t len, int flags,
+               const sockaddr *to, socklen_t tolen) {
+  return hook_sendto::detour(fd, buf, len, flags, to, tolen);
+}
+
+ssize_t sendmsg(int fd, const msghdr *msg, int flags) {
+  return hook_sendmsg::detour(fd, msg, flags);
+}
+
+int sendmmsg(int fd, mmsghdr *msgs, unsigned int vlen, int flags) {
+  return hook_sendmmsg::detour(fd, msgs, vlen, flags);
+}
+
+ssize_t recvfrom(int fd, void *buf, size_t len, int flags, sockaddr *from,
+                 socklen_t *fromlen) {
+  return hook_recvfrom::detour(fd, buf, len, flags, from, fromlen);
+}
+
+ssize_t recv(int fd, void *buf, size_t len, int flags) {
+  return hook_recv::detour(fd, buf, len, flags);
+}
+
+ssize_t recvmsg(int fd, msghdr *msg, int flags) {
+  return hook_recvmsg::detour(fd, msg, flags);
+}
+
+int recvmmsg(int fd, mmsghdr *msgs, unsigned int vlen, int flags,
+             timespec *timeout) {
+  return hook_recvmmsg::detour(fd, msgs, vlen, flags, timeout);
+}
+
+int close(int fd) { return hook_close::detour(fd); }
+
+int execve(const char *path, char *const argv[],
+           char *const envp[]) noexcept {
+  return hook_execve::detour(path, argv, envp);
+}
+
+}
+
+// a dynamically initialized variable rather than a constructor function, so
+// that it runs after the inline variables of the hooks are initialized
+static const bool started = [] {
+  const char *port = std::getenv("PROXINJECT_PORT");
+  if (!port) {
+    return false;
+  }
+
+  char *end = nullptr;
+  auto value = std::strtoul(port, &end, 10);
+  if (end == port || *end || value == 0 || value > 0xffff) {
+    return false;
+  }
+
+  if (const char *preload = std::getenv("LD_PRELOAD")) {
+    preload_env = std::string(preload_env_name) + preload;
+  }
+  port_env = std::string(port_env_name) + port;
+
+  std::thread(do_client, (std::uint16_t)value).detach();
+  return true;
+}();
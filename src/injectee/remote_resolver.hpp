@@ -0,0 +1,97 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef PROXINJECT_INJECTEE_REMOTE_RESOLVER
+#define PROXINJECT_INJECTEE_REMOTE_RESOLVER
+
+#include "schema.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// lets hooked resolver calls, on any application thread, wait for lookups
+// answered by the shared resolver of the injector
+class remote_resolver {
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  std::function<void(InjecteeMessage)> send_;
+  std::thread::id owner_;
+  std::uint32_t next_id_ = 0;
+  std::unordered_map<std::uint32_t, std::optional<std::vector<IpAddr>>>
+      waiting_;
+
+public:
+  static constexpr auto timeout = std::chrono::seconds(2);
+
+  // `send` must be callable from any thread; queries made on the calling
+  // thread itself are refused, since it is the one delivering answers
+  void attach(std::function<void(InjecteeMessage)> send) {
+    std::lock_guard guard(mtx_);
+    send_ = std::move(send);
+    owner_ = std::this_thread::get_id();
+  }
+
+  // wakes up every query, as unanswered
+  void detach() {
+    std::lock_guard guard(mtx_);
+    send_ = nullptr;
+    waiting_.clear();
+    cv_.notify_all();
+  }
+
+  // the addresses of `name` (with port 0), nullopt if the injector has not
+  // answered in time and the caller should resolve it by itself
+  std::optional<std::vector<IpAddr>> query(const std::string &name) {
+    std::unique_lock lock(mtx_);
+    if (!send_ || std::this_thread::get_id() == owner_) {
+      return std::nullopt;
+    }
+
+    auto id = next_id_++;
+    waiting_.emplace(id, std::nullopt);
+    send_(create_message<InjecteeMessage, "resolve">(
+        InjecteeResolve{id, name}));
+
+    std::optional<std::vector<IpAddr>> res;
+    cv_.wait_for(lock, timeout, [&] {
+      auto iter = waiting_.find(id);
+      return iter == waiting_.end() || iter->second.has_value();
+    });
+
+    if (auto iter = waiting_.find(id); iter != waiting_.end()) {
+      res = std::move(iter->second);
+      waiting_.erase(iter);
+    }
+    return res;
+  }
+
+  void complete(std::uint32_t id, std::vector<IpAddr> addrs) {
+    std::lock_guard guard(mtx_);
+    if (auto iter = waiting_.find(id); iter != waiting_.end()) {
+      iter->second = std::move(addrs);
+      cv_.notify_all();
+    }
+  }
+};
+
+#endif
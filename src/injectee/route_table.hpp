@@ -0,0 +1,305 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef PROXINJECT_INJECTEE_ROUTE_TABLE
+#define PROXINJECT_INJECTEE_ROUTE_TABLE
+
+#include "schema.hpp"
+#include <algorithm>
+#include <compare>
+#include <cstdint>
+#include <optional>
+#include <tuple>
+#include <vector>
+
+#ifdef _WIN32
+#include <WinSock2.h>
+#include <ws2ipdef.h>
+#else
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+// an IPv6 address as a number, since MSVC has no 128-bit integer
+struct uint128 {
+  std::uint64_t hi = 0;
+  std::uint64_t lo = 0;
+
+  auto operator<=>(const uint128 &) const = default;
+};
+
+template <typename Addr> struct address_traits;
+
+template <> struct address_traits<std::uint32_t> {
+  static constexpr unsigned bits = 32;
+
+  static std::uint32_t load(const unsigned char *p) {
+    return (std::uint32_t)p[0] << 24 | (std::uint32_t)p[1] << 16 |
+           (std::uint32_t)p[2] << 8 | (std::uint32_t)p[3];
+  }
+
+  static std::uint32_t first(std::uint32_t a, unsigned prefix) {
+    return prefix ? a & (~std::uint32_t(0) << (32 - prefix)) : 0;
+  }
+
+  static std::uint32_t last(std::uint32_t a, unsigned prefix) {
+    return prefix ? a | ~(~std::uint32_t(0) << (32 - prefix))
+                  : ~std::uint32_t(0);
+  }
+
+  static std::optional<std::uint32_t> next(std::uint32_t a) {
+    if (a == ~std::uint32_t(0)) {
+      return std::nullopt;
+    }
+    return a + 1;
+  }
+};
+
+template <> struct address_traits<uint128> {
+  static constexpr unsigned bits = 128;
+
+  static uint128 load(const unsigned char *p) {
+    uint128 res;
+    for (int i = 0; i < 8; ++i) {
+      res.hi = res.hi << 8 | p[i];
+      res.lo = res.lo << 8 | p[i + 8];
+    }
+    return res;
+  }
+
+  // mask of the lowest `n` bits of a 64-bit half, for 0 <= n <= 64
+  static std::uint64_t low_bits(unsigned n) {
+    return n >= 64 ? ~std::uint64_t(0) : (std::uint64_t(1) << n) - 1;
+  }
+
+  static uint128 first(uint128 a, unsigned prefix) {
+    auto host = 128 - prefix;
+    if (host >= 64) {
+      return {a.hi & ~low_bits(host - 64), 0};
+    }
+    return {a.hi, a.lo & ~low_bits(host)};
+  }
+
+  static uint128 last(uint128 a, unsigned prefix) {
+    auto host = 128 - prefix;
+    if (host >= 64) {
+      return {a.hi | low_bits(host - 64), ~std::uint64_t(0)};
+    }
+    return {a.hi, a.lo | low_bits(host)};
+  }
+
+  static std::optional<uint128> next(uint128 a) {
+    if (a.lo != ~std::uint64_t(0)) {
+      return uint128{a.hi, a.lo + 1};
+    } else if (a.hi != ~std::uint64_t(0)) {
+      return uint128{a.hi + 1, 0};
+    }
+    return std::nullopt;
+  }
+};
+
+// longest-prefix-match over CIDR prefixes with per-prefix port ranges
+//
+// prefixes are either nested or disjoint, so they cut the address space into
+// intervals, each covered by a chain of nested prefixes; a lookup is a binary
+// search over interval starts, then a walk from the longest prefix of the
+// chain to its parents until a port range matches
+struct route_entry {
+  std::uint16_t port_min;
+  std::uint16_t port_max;
+  route_action action;
+};
+
+template <typename Addr> class prefix_table {
+  using traits = address_traits<Addr>;
+
+  struct node {
+    Addr last;
+    int parent;
+    std::uint32_t begin, end; // range in `entries_`
+  };
+
+  std::vector<route_entry> entries_;
+  std::vector<node> nodes_;
+
+  // interval starts and the innermost prefix covering each interval (or -1)
+  std::vector<Addr> starts_;
+  std::vector<int> targets_;
+
+  void emit(Addr start, int target) {
+    if (!starts_.empty() && starts_.back() == start) {
+      targets_.back() = target;
+    } else {
+      starts_.push_back(start);
+      targets_.push_back(target);
+    }
+  }
+
+public:
+  struct rule {
+    Addr addr;
+    unsigned prefix;
+    route_entry value;
+  };
+
+  prefix_table() = default;
+
+  // rules sharing a prefix are tried in the given order
+  explicit prefix_table(std::vector<rule> rules) {
+    for (auto &r : rules) {
+      r.addr = traits::first(r.addr, r.prefix);
+    }
+
+    // enclosing prefixes sort before the prefixes they contain
+    std::stable_sort(rules.begin(), rules.end(),
+                     [](const rule &l, const rule &r) {
+                       return std::tie(l.addr, l.prefix) <
+                              std::tie(r.addr, r.prefix);
+                     });
+
+    std::vector<int> stack;
+    auto pop = [&] {
+      auto top = stack.back();
+      stack.pop_back();
+      if (auto after = traits::next(nodes_[top].last)) {
+        emit(*after, stack.empty() ? -1 : stack.back());
+      }
+    };
+
+    for (std::size_t i = 0; i < rules.size();) {
+      auto first = rules[i].addr;
+      auto last = traits::last(first, rules[i].prefix);
+
+      auto begin = (std::uint32_t)entries_.size();
+      for (auto prefix = rules[i].prefix;
+           i < rules.size() && rules[i].addr == first &&
+           rules[i].prefix == prefix;
+           ++i) {
+        entries_.push_back(rules[i].value);
+      }
+
+      while (!stack.empty() && nodes_[stack.back()].last < first) {
+        pop();
+      }
+
+      int index = (int)nodes_.size();
+      nodes_.push_back(node{last, stack.empty() ? -1 : stack.back(), begin,
+                            (std::uint32_t)entries_.size()});
+      emit(first, index);
+      stack.push_back(index);
+    }
+
+    while (!stack.empty()) {
+      pop();
+    }
+  }
+
+  bool empty() const { return nodes_.empty(); }
+
+  std::optional<route_action> lookup(Addr addr, std::uint16_t port) const {
+    auto iter = std::upper_bound(starts_.begin(), starts_.end(), addr);
+    if (iter == starts_.begin()) {
+      return std::nullopt;
+    }
+
+    for (int n = targets_[iter - starts_.begin() - 1]; n != -1;
+         n = nodes_[n].parent) {
+      for (auto i = nodes_[n].begin; i < nodes_[n].end; ++i) {
+        if (entries_[i].port_min <= port && port <= entries_[i].port_max) {
+          return entries_[i].action;
+        }
+      }
+    }
+
+    return std::nullopt;
+  }
+};
+
+// the routing rules of a config, compiled for lookups on every connect;
+// destinations matching no rule are proxied
+class route_table {
+  prefix_table<std::uint32_t> v4_;
+  prefix_table<uint128> v6_;
+
+public:
+  route_table() = default;
+
+  template <typename Rules> explicit route_table(const Rules &rules) {
+    std::vector<prefix_table<std::uint32_t>::rule> v4;
+    std::vector<prefix_table<uint128>::rule> v6;
+
+    for (const auto &rule : rules) {
+      const auto &network = rule["network"_f];
+      if (!network) {
+        continue;
+      }
+
+      auto prefix = rule["prefix"_f].value_or(0);
+      auto action = (route_action)rule["action"_f].value_or(0);
+      if (action > route_action::block) {
+        continue;
+      }
+
+      route_entry value{
+          (std::uint16_t)std::min(rule["port_min"_f].value_or(0), 0xffffu),
+          (std::uint16_t)std::min(rule["port_max"_f].value_or(0xffff),
+                                  0xffffu),
+          action};
+
+      if (network->size() == 4 && prefix <= 32) {
+        v4.push_back({address_traits<std::uint32_t>::load(network->data()),
+                      prefix, value});
+      } else if (network->size() == 16 && prefix <= 128) {
+        v6.push_back(
+            {address_traits<uint128>::load(network->data()), prefix, value});
+      }
+    }
+
+    v4_ = prefix_table<std::uint32_t>(std::move(v4));
+    v6_ = prefix_table<uint128>(std::move(v6));
+  }
+
+  bool empty() const { return v4_.empty() && v6_.empty(); }
+
+  route_action route(const sockaddr *name) const {
+    std::optional<route_action> res;
+
+    if (name->sa_family == AF_INET) {
+      auto v4 = (const sockaddr_in *)name;
+      res = v4_.lookup(
+          address_traits<std::uint32_t>::load(
+              (const unsigned char *)&v4->sin_addr),
+          ntohs(v4->sin_port));
+    } else if (name->sa_family == AF_INET6) {
+      auto v6 = (const sockaddr_in6 *)name;
+      auto bytes = (const unsigned char *)&v6->sin6_addr;
+      auto port = ntohs(v6->sin6_port);
+
+      // IPv4-mapped addresses follow the IPv4 rules
+      if (std::all_of(bytes, bytes + 10, [](auto b) { return b == 0; }) &&
+          bytes[10] == 0xff && bytes[11] == 0xff) {
+        res = v4_.lookup(address_traits<std::uint32_t>::load(bytes + 12),
+                         port);
+      } else {
+        res = v6_.lookup(address_traits<uint128>::load(bytes), port);
+      }
+    }
+
+    return res.value_or(route_action::proxy);
+  }
+};
+
+#endif
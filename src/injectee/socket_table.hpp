@@ -0,0 +1,158 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PROXINJECT_INJECTEE_SOCKET_TABLE
+#define PROXINJECT_INJECTEE_SOCKET_TABLE
+
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+
+// fixed-size, open-addressed table mapping a socket handle to a flag;
+// lookups are lock-free while writers take a mutex, so a key is never stored
+// twice. a cleared entry leaves a tombstone that later inserts reuse, and
+// tombstones followed by an empty slot become empty again, so misses stay
+// short however many sockets come and go. keys that find no free slot spill
+// into a locked set rather than being dropped
+template <typename Key, std::size_t Capacity = 16384> class socket_table {
+  static_assert(std::has_single_bit(Capacity));
+
+  static constexpr std::uintptr_t empty = 0;
+  static constexpr std::uintptr_t tombstone = ~std::uintptr_t(0);
+  static constexpr std::size_t mask = Capacity - 1;
+  static constexpr int shift = 64 - std::countr_zero(Capacity);
+
+  struct slot {
+    std::atomic<std::uintptr_t> key = empty;
+    std::atomic<bool> value = false;
+  };
+
+  std::unique_ptr<slot[]> slots_ = std::make_unique<slot[]>(Capacity);
+
+  mutable std::mutex mtx_;
+  std::unordered_set<std::uintptr_t> overflow_;
+  std::atomic<std::size_t> overflowed_ = 0;
+
+  // keep 0 free as the empty marker
+  static std::uintptr_t encode(Key k) { return (std::uintptr_t)k + 1; }
+
+  static std::size_t hash(std::uintptr_t k) {
+    return (std::size_t)(((std::uint64_t)k * 0x9e3779b97f4a7c15ull) >> shift);
+  }
+
+  // index of the slot holding `k`, or Capacity
+  std::size_t probe(std::uintptr_t k) const {
+    for (std::size_t i = 0, h = hash(k); i < Capacity; ++i) {
+      std::size_t idx = (h + i) & mask;
+      auto key = slots_[idx].key.load(std::memory_order_acquire);
+      if (key == k) {
+        return idx;
+      } else if (key == empty) {
+        break;
+      }
+    }
+
+    return Capacity;
+  }
+
+  bool overflowed(std::uintptr_t k) const {
+    if (overflowed_.load(std::memory_order_acquire) == 0) {
+      return false;
+    }
+
+    std::lock_guard guard(mtx_);
+    return overflow_.contains(k);
+  }
+
+public:
+  void set(Key k, bool value) {
+    if (!value) {
+      clear(k);
+      return;
+    }
+
+    auto key = encode(k);
+    std::lock_guard guard(mtx_);
+    if (overflow_.contains(key)) {
+      return;
+    }
+
+    slot *free = nullptr;
+    for (std::size_t i = 0, h = hash(key); i < Capacity; ++i) {
+      slot &s = slots_[(h + i) & mask];
+      auto curr = s.key.load(std::memory_order_relaxed);
+      if (curr == key) {
+        return;
+      } else if (curr == tombstone && !free) {
+        free = &s;
+      } else if (curr == empty) {
+        free = free ? free : &s;
+        break;
+      }
+    }
+
+    if (free) {
+      free->value.store(true, std::memory_order_relaxed);
+      free->key.store(key, std::memory_order_release);
+    } else {
+      overflow_.insert(key);
+      overflowed_.store(overflow_.size(), std::memory_order_release);
+    }
+  }
+
+  bool get(Key k) const {
+    auto key = encode(k);
+    if (auto idx = probe(key); idx != Capacity) {
+      return slots_[idx].value.load(std::memory_order_acquire);
+    }
+
+    return overflowed(key);
+  }
+
+  void clear(Key k) {
+    auto key = encode(k);
+    std::lock_guard guard(mtx_);
+    if (overflow_.erase(key)) {
+      overflowed_.store(overflow_.size(), std::memory_order_release);
+      return;
+    }
+
+    auto idx = probe(key);
+    if (idx == Capacity) {
+      return;
+    }
+
+    slots_[idx].value.store(false, std::memory_order_relaxed);
+    slots_[idx].key.store(tombstone, std::memory_order_release);
+
+    // no key is stored past an empty slot on its probe path, so a run of
+    // tombstones ending at one can be emptied without hiding anything
+    if (slots_[(idx + 1) & mask].key.load(std::memory_order_relaxed) !=
+        empty) {
+      return;
+    }
+    for (std::size_t i = 0; i < Capacity; ++i, idx = (idx - 1) & mask) {
+      if (slots_[idx].key.load(std::memory_order_relaxed) != tombstone) {
+        break;
+      }
+      slots_[idx].key.store(empty, std::memory_order_release);
+    }
+  }
+};
+
+#endif
@@ -14,100 +14,36 @@
 // limitations under the License.
 
 #include <WinSock2.h>
-#include <cstddef>
-#include <schema.hpp>
-
-constexpr const char SOCKS_VERSION = 5;
-constexpr const char SOCKS_NO_AUTHENTICATION = 0;
-
-constexpr const char SOCKS_CONNECT = 1;
-constexpr const char SOCKS_IPV4 = 1;
-constexpr const char SOCKS_DOMAINNAME = 3;
-constexpr const char SOCKS_IPV6 = 4;
-
-constexpr const char SOCKS_SUCCESS = 0;
-constexpr const char SOCKS_GENERAL_FAILURE = 4;
-
-constexpr const size_t SOCKS_REQUEST_MAX_SIZE = 134;
-
-bool socks5_handshake(SOCKET s) {
-  const char req[] = {SOCKS_VERSION, 1, SOCKS_NO_AUTHENTICATION};
-  if (send(s, req, sizeof(req), 0) != sizeof(req))
-    return false;
-
-  char res[2];
-  if (recv(s, res, sizeof(res), MSG_WAITALL) != sizeof(res))
-    return false;
-
-  return res[0] == SOCKS_VERSION && res[1] == SOCKS_NO_AUTHENTICATION;
-}
-
-char socks5_request_send(SOCKET s, char *buf, size_t size) {
-  if (send(s, buf, size, 0) != size)
-    return SOCKS_GENERAL_FAILURE;
-
-  if (recv(s, buf, 4, 0) == SOCKET_ERROR)
-    return SOCKS_GENERAL_FAILURE;
-
-  if (buf[1] != SOCKS_SUCCESS)
-    return buf[1];
-
-  if (buf[3] == SOCKS_IPV4) {
-    if (recv(s, buf + 4, 6, MSG_WAITALL) == SOCKET_ERROR)
-      return SOCKS_GENERAL_FAILURE;
-  } else if (buf[3] == SOCKS_IPV6) {
-    if (recv(s, buf + 4, 18, MSG_WAITALL) == SOCKET_ERROR)
-      return SOCKS_GENERAL_FAILURE;
-  } else {
-    return SOCKS_GENERAL_FAILURE;
-  }
-
-  return SOCKS_SUCCESS;
-}
-
-char socks5_request(SOCKET s, const sockaddr *addr) {
-  char buf[SOCKS_REQUEST_MAX_SIZE] = {SOCKS_VERSION, SOCKS_CONNECT, 0};
-
-  char *ptr = buf + 3;
-  if (addr->sa_family == AF_INET) {
-    auto v4 = (const sockaddr_in *)addr;
-    *ptr++ = SOCKS_IPV4;
-    *((ULONG *&)ptr)++ = v4->sin_addr.s_addr;
-    *((USHORT *&)ptr)++ = v4->sin_port;
-  } else if (addr->sa_family == AF_INET6) {
-    auto v6 = (const sockaddr_in6 *)addr;
-    *ptr++ = SOCKS_IPV6;
-    ptr = std::copy((const char *)&v6->sin6_addr,
-                    (const char *)(&v6->sin6_addr + 1), ptr);
-    *((USHORT *&)ptr)++ = v6->sin6_port;
-  } else {
-    return SOCKS_GENERAL_FAILURE;
-  }
-
-  return socks5_request_send(s, buf, ptr - buf);
-}
-
-char socks5_request(SOCKET s, const IpAddr &addr) {
-  char buf[SOCKS_REQUEST_MAX_SIZE] = {SOCKS_VERSION, SOCKS_CONNECT, 0};
-
-  char *ptr = buf + 3;
-  if (auto v4 = addr["v4_addr"_f]) {
-    *ptr++ = SOCKS_IPV4;
-    *((ULONG *&)ptr)++ = *v4;
-  } else if (auto v6 = addr["v6_addr"_f]) {
-    *ptr++ = SOCKS_IPV6;
-    ptr = std::copy(v6->begin(), v6->end(), ptr);
-  } else if (auto domain = addr["domain"_f]) {
-    *ptr++ = SOCKS_DOMAINNAME;
-    if (domain->size() >= 256) {
-      return SOCKS_GENERAL_FAILURE;
+#include <proxy_chain.hpp>
+
+// runs the whole handshake of `client` on a connected, blocking socket
+inline char socks5_connect(SOCKET s, proxy_chain &client) {
+  while (client.want_write() || client.want_read()) {
+    if (client.want_write()) {
+      auto out = client.output();
+      int n = send(s, out.data(), (int)out.size(), 0);
+      if (n == SOCKET_ERROR) {
+        client.closed();
+        return SOCKS_GENERAL_FAILURE;
+      }
+
+      client.sent(n);
+    } else {
+      auto in = client.input();
+      auto peek = client.peek();
+      int n = recv(s, in.data(), (int)in.size(), peek ? MSG_PEEK : 0);
+      if (n == SOCKET_ERROR || n == 0) {
+        client.closed();
+        return SOCKS_GENERAL_FAILURE;
+      }
+
+      // what the handshake used of peeked bytes is taken off the socket
+      auto used = (int)client.received(n);
+      if (peek) {
+        recv(s, in.data(), used, 0);
+      }
     }
-    *ptr++ = (char)domain->size();
-    ptr = std::copy(domain->begin(), domain->end(), ptr);
-  } else {
-    return SOCKS_GENERAL_FAILURE;
   }
-  *((USHORT *&)ptr)++ = *addr["port"_f];
 
-  return socks5_request_send(s, buf, ptr - buf);
+  return client.done() ? SOCKS_SUCCESS : client.reply();
 }
@@ -0,0 +1,207 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef PROXINJECT_INJECTEE_UDP_RELAY
+#define PROXINJECT_INJECTEE_UDP_RELAY
+
+#include "client.hpp"
+#include "socks5_udp.hpp"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+enum class udp_state { pending, relayed, refused };
+
+// a SOCKS5 UDP ASSOCIATE made for one application socket: the association
+// lives as long as the TCP connection `control` to the proxy, and datagrams
+// go through the relay the proxy has answered with
+//
+// the association is made in the background, while datagrams sent in the
+// meantime are held here, header included, until the proxy has answered
+template <typename Socket> class udp_association {
+  mutable std::mutex mtx_;
+  std::atomic<udp_state> state_ = udp_state::pending;
+  bool closed_ = false;
+  Socket control_{};
+  sockaddr_buf relay_;
+  std::vector<std::vector<char>> held_;
+
+public:
+  // datagrams held beyond this are dropped, as a congested network would
+  static constexpr std::size_t held_max = 64;
+
+  udp_state state() const { return state_.load(std::memory_order_acquire); }
+  bool relayed() const { return state() == udp_state::relayed; }
+  bool refused() const { return state() == udp_state::refused; }
+
+  // where datagrams go, once relayed
+  const sockaddr_buf &relay() const { return relay_; }
+
+  // holds the datagram `make()` returns while the association is pending;
+  // false if it has been settled meanwhile, so that the datagram is to be
+  // sent as usual
+  template <typename F> bool hold(F &&make) {
+    std::lock_guard guard(mtx_);
+    if (state() != udp_state::pending) {
+      return false;
+    }
+
+    if (held_.size() < held_max) {
+      held_.push_back(make());
+    }
+    return true;
+  }
+
+  // records the answer of the proxy on `control`, with `relay` unless it
+  // has refused, and hands the held datagrams to `send` if it has not; false
+  // if the socket has been closed meanwhile, leaving `control` to the caller
+  template <typename F>
+  bool settle(Socket control, const std::optional<sockaddr_buf> &relay,
+              F &&send) {
+    std::lock_guard guard(mtx_);
+    if (closed_) {
+      return false;
+    }
+
+    // the state is published first, so that replies to the held datagrams
+    // are recognized as coming from the relay
+    control_ = control;
+    if (relay) {
+      relay_ = *relay;
+    }
+    state_.store(relay ? udp_state::relayed : udp_state::refused,
+                 std::memory_order_release);
+
+    if (relay) {
+      for (const auto &datagram : held_) {
+        send(std::span<const char>(datagram));
+      }
+    }
+    held_ = {};
+    return true;
+  }
+
+  // marks the socket closed, returns the control socket to close if the
+  // association has been settled; a pending one leaves it to `settle`
+  std::optional<Socket> close() {
+    std::lock_guard guard(mtx_);
+    closed_ = true;
+    if (state() == udp_state::pending) {
+      return std::nullopt;
+    }
+    return control_;
+  }
+};
+
+// the associations of application sockets, made on their first datagram to
+// a proxied destination and dropped when they are closed
+template <typename Socket> class udp_associations {
+  using association = udp_association<Socket>;
+
+  mutable std::shared_mutex mtx_;
+  std::unordered_map<Socket, std::shared_ptr<association>> map_;
+  // lets sockets of applications that never send proxied datagrams skip
+  // the lock
+  std::atomic<std::size_t> size_ = 0;
+
+public:
+  std::shared_ptr<association> get(Socket s) const {
+    if (size_.load(std::memory_order_relaxed) == 0) {
+      return nullptr;
+    }
+
+    std::shared_lock guard(mtx_);
+    if (auto iter = map_.find(s); iter != map_.end()) {
+      return iter->second;
+    }
+    return nullptr;
+  }
+
+  // the association of `s`, and whether it has just been made, pending, so
+  // that the caller is the one to start it
+  std::pair<std::shared_ptr<association>, bool> make(Socket s) {
+    std::lock_guard guard(mtx_);
+    auto [iter, inserted] = map_.try_emplace(s);
+    if (inserted) {
+      iter->second = std::make_shared<association>();
+      size_.store(map_.size(), std::memory_order_relaxed);
+    }
+    return {iter->second, inserted};
+  }
+
+  // the control socket of the association of `s` to close, if any
+  std::optional<Socket> remove(Socket s) {
+    if (size_.load(std::memory_order_relaxed) == 0) {
+      return std::nullopt;
+    }
+
+    std::shared_ptr<association> assoc;
+    {
+      std::lock_guard guard(mtx_);
+      auto iter = map_.find(s);
+      if (iter == map_.end()) {
+        return std::nullopt;
+      }
+
+      assoc = std::move(iter->second);
+      map_.erase(iter);
+      size_.store(map_.size(), std::memory_order_relaxed);
+    }
+    return assoc->close();
+  }
+};
+
+// datagrams from a relay, before the header is stripped, fit in here
+constexpr std::size_t udp_datagram_max_size = 65536;
+
+// the relay of a UDP ASSOCIATE reply from `proxy`, whose bound address is
+// `bound`; a relay on an unspecified address listens where the proxy does
+inline std::optional<sockaddr_buf> relay_address(std::span<const char> bound,
+                                                 const sockaddr_buf &proxy) {
+  sockaddr_buf relay;
+  if (!socks5_decode_address(bound, relay.storage)) {
+    return std::nullopt;
+  }
+
+  auto v4 = (sockaddr_in *)&relay.storage;
+  auto v6 = (sockaddr_in6 *)&relay.storage;
+  auto port = relay.storage.ss_family == AF_INET ? v4->sin_port : v6->sin6_port;
+  auto addr = relay.storage.ss_family == AF_INET
+                  ? std::span((const char *)&v4->sin_addr, 4)
+                  : std::span((const char *)&v6->sin6_addr, 16);
+  relay.size = relay.storage.ss_family == AF_INET ? sizeof(sockaddr_in)
+                                                  : sizeof(sockaddr_in6);
+
+  if (std::all_of(addr.begin(), addr.end(), [](char c) { return c == 0; })) {
+    relay.storage = proxy.storage;
+    relay.size = proxy.size;
+    if (relay.storage.ss_family == AF_INET) {
+      v4->sin_port = port;
+    } else {
+      v6->sin6_port = port;
+    }
+  }
+
+  return relay;
+}
+
+#endif
@@ -19,6 +19,8 @@
 #include "winraii.hpp"
 #include <WinSock2.h>
 
+// IPv6 addresses of `IpAddr` are kept in network byte order, as `from_asio`
+// and the SOCKS5 encoding have them
 std::optional<IpAddr> to_ip_addr(const sockaddr *name) {
   char buf[1024];
 
@@ -30,32 +32,40 @@ std::optional<IpAddr> to_ip_addr(const sockaddr *name) {
     auto v6 = (const sockaddr_in6 *)name;
     auto addr = std::bit_cast<std::array<unsigned char, 16>>(v6->sin6_addr);
     return IpAddr(std::nullopt,
-                  std::vector<unsigned char>{addr.rbegin(), addr.rend()}, {},
+                  std::vector<unsigned char>{addr.begin(), addr.end()}, {},
                   ntohs(v6->sin6_port));
   }
 
   return std::nullopt;
 }
 
-std::pair<std::unique_ptr<sockaddr>, size_t> to_sockaddr(const IpAddr &addr) {
-  if (auto v = addr["v4_addr"_f]) {
-    auto res = new sockaddr_in();
-    res->sin_family = AF_INET;
-    res->sin_addr.s_addr = htonl(v.value());
-    res->sin_port = htons(addr["port"_f].value());
-    return {std::unique_ptr<sockaddr>{(sockaddr *)res}, sizeof(sockaddr_in)};
+struct sockaddr_buf {
+  sockaddr_storage storage{};
+  int size = 0;
+
+  const sockaddr *get() const { return (const sockaddr *)&storage; }
+};
+
+std::optional<sockaddr_buf> to_sockaddr(const IpAddr &addr) {
+  sockaddr_buf res;
+
+  if (const auto &v = addr["v4_addr"_f]) {
+    auto v4 = (sockaddr_in *)&res.storage;
+    v4->sin_family = AF_INET;
+    v4->sin_addr.s_addr = htonl(v.value());
+    v4->sin_port = htons(addr["port"_f].value());
+    res.size = sizeof(sockaddr_in);
+  } else if (const auto &v = addr["v6_addr"_f]; v && v->size() == 16) {
+    auto v6 = (sockaddr_in6 *)&res.storage;
+    v6->sin6_family = AF_INET6;
+    std::copy(v->begin(), v->end(), v6->sin6_addr.u.Byte);
+    v6->sin6_port = htons(addr["port"_f].value());
+    res.size = sizeof(sockaddr_in6);
   } else {
-    auto res = new sockaddr_in6();
-    res->sin6_family = AF_INET6;
-    std::array<unsigned char, 16> arr;
-    std::copy(addr["v6_addr"_f].value().begin(),
-              addr["v6_addr"_f].value().end(), arr.rbegin());
-    res->sin6_addr = *(IN6_ADDR *)&arr;
-    res->sin6_port = htons(addr["port"_f].value());
-    return {std::unique_ptr<sockaddr>{(sockaddr *)res}, sizeof(sockaddr_in6)};
+    return std::nullopt;
   }
 
-  return {nullptr, 0};
+  return res;
 }
 
 bool is_localhost(const sockaddr *name) {
@@ -101,4 +111,6 @@ bool sockequal(const sockaddr *l, const sockaddr *r) {
   return false;
 }
 
+std::uint32_t current_pid() { return GetCurrentProcessId(); }
+
 #endif
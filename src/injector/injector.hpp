@@ -17,11 +17,13 @@
 #define PROXINJECT_INJECTOR_INJECTOR
 
 #include "utils.hpp"
-#include "winraii.hpp"
 #include <filesystem>
 
 namespace fs = std::filesystem;
 
+#ifdef _WIN32
+#include "winraii.hpp"
+
 struct injector {
   static inline const FARPROC load_library =
       GetProcAddress(GetModuleHandleA("kernel32.dll"), "LoadLibraryW");
@@ -167,5 +169,77 @@ struct injector {
     });
   }
 };
+#else
+#include <cstdint>
+#include <cstdlib>
+#include <optional>
+#include <spawn.h>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <vector>
+
+extern char **environ;
+
+// running processes cannot be injected outside Windows; programs are started
+// with the LD_PRELOAD injectee instead, and their children inherit it through
+// the environment
+struct injector {
+  static bool inject(std::uint32_t, std::uint16_t) { return false; }
+
+  static inline const char injectee_filename[] = "libproxinjectee.so";
+
+  static std::optional<std::string> find_injectee() {
+    std::error_code ec;
+    auto path = fs::read_symlink("/proc/self/exe", ec)
+                    .replace_filename(injectee_filename);
+
+    if (ec || !std::filesystem::exists(path)) {
+      return std::nullopt;
+    }
+
+    return path.string();
+  }
+
+  // runs `command` with `sh -c`, preloading the injectee and pointing it at
+  // the injector on `port`; returns the pid of the shell
+  static std::optional<pid_t> launch(const std::string &command,
+                                     std::uint16_t port) {
+    auto path = find_injectee();
+    if (!path) {
+      return std::nullopt;
+    }
+
+    std::string preload = "LD_PRELOAD=" + *path;
+    if (auto v = std::getenv("LD_PRELOAD"); v && *v) {
+      preload = preload + ":" + v;
+    }
+    std::string port_env = "PROXINJECT_PORT=" + std::to_string(port);
+
+    std::vector<char *> env{preload.data(), port_env.data()};
+    for (auto e = environ; *e; ++e) {
+      std::string_view entry(*e);
+      if (!entry.starts_with("LD_PRELOAD=") &&
+          !entry.starts_with("PROXINJECT_PORT=")) {
+        env.push_back(*e);
+      }
+    }
+    env.push_back(nullptr);
+
+    std::string shell = "/bin/sh", flag = "-c", cmd = command;
+    char *argv[] = {shell.data(), flag.data(), cmd.data(), nullptr};
+
+    pid_t pid;
+    if (posix_spawn(&pid, argv[0], nullptr, nullptr, argv, env.data()) != 0) {
+      return std::nullopt;
+    }
+
+    return pid;
+  }
+};
+
+// children of an injected process already inherit the injectee
+template <typename F> void enumerate_child_pids(std::uint32_t, F &&) {}
+#endif
 
 #endif
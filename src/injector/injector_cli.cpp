@@ -17,6 +17,7 @@
 
 #include "injector.hpp"
 #include "injector_cli.hpp"
+#include "upstream_monitor.hpp"
 #include "utils.hpp"
 #include "version.hpp"
 #include <argparse/argparse.hpp>
@@ -89,10 +90,44 @@ auto create_parser() {
       .implicit_value(true);
 
   parser.add_argument("-p", "--set-proxy")
-      .help("set a proxy address for network connections (string, e.g. "
-            "`127.0.0.1:1080`)")
+      .help("set a proxy address for network connections, an HTTP CONNECT "
+            "proxy if prefixed by `http://` (string, e.g. `127.0.0.1:1080`, "
+            "`http://127.0.0.1:8080`)")
       .default_value(string{});
 
+  parser.add_argument("-u", "--upstream")
+      .help("add another proxy address, spreading connections over all of "
+            "them (and the one of `-p`) by their measured latency and "
+            "failure rate (string, e.g. `127.0.0.1:1081`, "
+            "`http://127.0.0.1:8081`)")
+      .default_value(vector<string>{})
+      .append();
+
+  parser.add_argument("-C", "--chain")
+      .help("add a proxy that connections go through after the one of "
+            "`-p`/`-u`, in the given order; hostnames are resolved by the "
+            "proxy before it (string, e.g. `10.0.0.2:1080`, "
+            "`http://proxy.internal:3128`)")
+      .default_value(vector<string>{})
+      .append();
+
+  parser.add_argument("-L", "--local-relay")
+      .help("send injected processes to a SOCKS5 relay on loopback, which "
+            "forwards their connections to the proxies of `-p`/`-u`")
+      .default_value(false)
+      .implicit_value(true);
+
+  parser.add_argument("-M", "--mux-server")
+      .help("carry the connections of the local relay (implied) as streams "
+            "over a few long-lived links to a proxinject mux server instead "
+            "of the proxies (string, e.g. `203.0.113.7:1090`)")
+      .default_value(string{});
+
+  parser.add_argument("--mux-links")
+      .help("links to the mux server per relay thread (int, default 2)")
+      .default_value(2)
+      .scan<'d', int>();
+
   parser.add_argument("-w", "--new-console-window")
       .help("create a new console window while a new console process is "
             "executed in `-e`")
@@ -104,6 +139,61 @@ auto create_parser() {
       .default_value(false)
       .implicit_value(true);
 
+  parser.add_argument("-x", "--pipeline-handshake")
+      .help("send the socks5 greeting and CONNECT request together to save "
+            "one round-trip (only for proxies without authentication)")
+      .default_value(false)
+      .implicit_value(true);
+
+  parser.add_argument("-f", "--fake-dns")
+      .help("answer name lookups of proxied hostnames with placeholder "
+            "addresses, so that the proxy resolves the hostname instead "
+            "(only for `getaddrinfo`/`GetAddrInfoW`)")
+      .default_value(false)
+      .implicit_value(true);
+
+  parser.add_argument("-D", "--shared-resolver")
+      .help("resolve names for all injected processes here, sharing one "
+            "cache among them (only for `getaddrinfo`/`GetAddrInfoW`)")
+      .default_value(false)
+      .implicit_value(true);
+
+  parser.add_argument("-U", "--udp-relay")
+      .help("send datagrams to proxied destinations through a socks5 UDP "
+            "ASSOCIATE of the proxy, and none if the proxy refuses it (only "
+            "through socks5 proxies, not with `-C`, `-L` or `-M`)")
+      .default_value(false)
+      .implicit_value(true);
+
+  parser.add_argument("-t", "--route")
+      .help("route destinations in a CIDR range (and a port range) directly, "
+            "through the proxy or nowhere; the longest matching prefix wins "
+            "(string, e.g. `192.168.0.0/16=direct`, `0.0.0.0/0,25=block`, "
+            "`fd00::/8,80-443=proxy`)")
+      .default_value(vector<string>{})
+      .append();
+
+  parser.add_argument("-d", "--domain-route")
+      .help("route connections by domain name (in `WSAConnectByName`) "
+            "directly, through the proxy or nowhere; the longest matching "
+            "suffix wins (string, e.g. `intranet.corp=direct`, "
+            "`*.corp.example=direct`, `.ads.example=block`)")
+      .default_value(vector<string>{})
+      .append();
+
+  parser.add_argument("-c", "--connect-timeout")
+      .help("give up proxied `WSAConnectByName`/`WSAConnectByList` calls "
+            "without a timeout of their own after this many milliseconds, "
+            "proxy handshake included (int, default 30000)")
+      .default_value(0)
+      .scan<'d', int>();
+
+  parser.add_argument("-o", "--overflow-policy")
+      .help("what injected processes do with connection events when their "
+            "event queue is full (string, one of `drop-newest`, "
+            "`drop-oldest`, `aggregate`)")
+      .default_value(string{});
+
   return parser;
 }
 
@@ -131,8 +221,41 @@ int main(int argc, char *argv[]) {
     return 2;
   }
 
+#ifndef _WIN32
+  if (!pids.empty() || !proc_names.empty() || !proc_paths.empty() ||
+      !proc_re_names.empty() || !proc_re_paths.empty()) {
+    info("running processes can only be injected on Windows, `-i`, `-n`, "
+         "`-P`, `-r` and `-R` are ignored");
+  }
+#endif
+
+  // proxies that connections are routed through are checked before anything
+  // starts, a dropped one would send traffic around them
+  vector<tuple<ip::address, uint16_t, proxy_protocol>> upstreams;
+  for (const auto &upstream : parser.get<vector<string>>("-u")) {
+    asio::error_code ec;
+    auto res = parse_proxy(trim_copy(upstream));
+    auto addr = res ? ip::make_address(get<0>(*res), ec) : ip::address{};
+    if (!res || ec) {
+      cerr << "Invalid upstream proxy `" << upstream << "`" << endl;
+      return 2;
+    }
+    upstreams.emplace_back(addr, get<1>(*res), get<2>(*res));
+  }
+
+  vector<tuple<string, uint16_t, proxy_protocol>> hops;
+  for (const auto &hop : parser.get<vector<string>>("-C")) {
+    auto res = parse_proxy(trim_copy(hop));
+    if (!res) {
+      cerr << "Invalid chained proxy `" << hop << "`" << endl;
+      return 2;
+    }
+    hops.push_back(*res);
+  }
+
   asio::io_context io_context(1);
   injector_server server;
+  optional<socks5_relay> relay;
 
   auto acceptor = tcp::acceptor(io_context, auto_endpoint);
   server.set_port(acceptor.local_endpoint().port());
@@ -149,22 +272,137 @@ int main(int argc, char *argv[]) {
     info("logging enabled");
   }
 
+  optional<IpAddr> mux;
+  if (auto mux_str = trim_copy(parser.get<string>("-M")); !mux_str.empty()) {
+    if (auto res = parse_address(mux_str)) {
+      asio::error_code ec;
+      auto addr = ip::make_address(res->first, ec);
+      if (!ec) {
+        mux = from_asio(addr, res->second);
+      }
+    }
+
+    if (!mux) {
+      info("mux server {} is invalid, ignored", mux_str);
+    }
+  }
+
+  if (parser.get<bool>("-L") || mux) {
+    relay.emplace(server);
+
+    if (mux) {
+      relay->use_mux(*mux, max(parser.get<int>("--mux-links"), 1));
+      auto [addr, port] = to_asio(*mux);
+      info("relay connections carried over links to mux server {}:{}", addr,
+           port);
+    }
+
+    server.enable_relay(relay->start(auto_endpoint), mux.has_value());
+    info("local relay listening on port {} with {} threads",
+         server.relay_port_, relay->cores());
+
+    asio::co_spawn(io_context, report_relay(*relay, chrono::seconds(60)),
+                   asio::detached);
+  }
+
   if (parser.get<bool>("-s")) {
     server.enable_subprocess();
     info("subprocess injection enabled");
   }
 
+  if (parser.get<bool>("-x")) {
+    server.enable_pipeline();
+    info("pipelined socks5 handshake enabled");
+  }
+
+  if (parser.get<bool>("-f")) {
+    server.enable_fake_dns();
+    info("fake-ip dns enabled");
+  }
+
+  if (parser.get<bool>("-D")) {
+    server.enable_shared_resolver();
+    info("shared resolver enabled");
+  }
+
+  if (parser.get<bool>("-U")) {
+    if (relay) {
+      info("the local relay does not carry datagrams, `-U` is ignored");
+    } else {
+      server.enable_udp_relay();
+      info("udp relay enabled");
+    }
+  }
+
+  if (auto timeout = parser.get<int>("-c"); timeout > 0) {
+    server.set_connect_timeout(timeout);
+    info("proxied connect timeout set to {}ms", timeout);
+  }
+
+  if (auto policy_str = trim_copy(parser.get<string>("-o"));
+      !policy_str.empty()) {
+    if (auto policy = parse_overflow_policy(policy_str)) {
+      server.set_overflow_policy(*policy);
+      info("event queue overflow policy set to {}", policy_str);
+    } else {
+      info("overflow policy {} is invalid, ignored", policy_str);
+    }
+  }
+
+  for (const auto &route : parser.get<vector<string>>("-t")) {
+    if (auto rule = parse_route(trim_copy(route))) {
+      server.add_route(*rule);
+      info("route {} added", route);
+    } else {
+      info("route {} is invalid, ignored", route);
+    }
+  }
+
+  for (const auto &route : parser.get<vector<string>>("-d")) {
+    if (auto rule = parse_domain_route(trim_copy(route))) {
+      server.add_domain_route(*rule);
+      info("domain route {} added", route);
+    } else {
+      info("domain route {} is invalid, ignored", route);
+    }
+  }
+
   if (auto proxy_str = trim_copy(parser.get<string>("-p"));
       !proxy_str.empty()) {
-    if (auto res = parse_address(proxy_str)) {
-      auto [addr, port] = res.value();
-      server.set_proxy(ip::address::from_string(addr), port);
+    if (auto res = parse_proxy(proxy_str)) {
+      auto [addr, port, protocol] = res.value();
+      server.set_proxy(ip::address::from_string(addr), port, protocol);
       info("proxy address set to {}:{}", addr, port);
+
+      if (!upstreams.empty()) {
+        server.add_upstream(ip::address::from_string(addr), port, protocol);
+      }
     }
   }
 
+  for (const auto &[addr, port, protocol] : upstreams) {
+    server.add_upstream(addr, port, protocol);
+    info("upstream proxy {}:{} added", addr.to_string(), port);
+  }
+
+  for (const auto &[host, port, protocol] : hops) {
+    asio::error_code ec;
+    auto addr = ip::make_address(host, ec);
+    server.add_chain_hop(ec ? IpAddr{{}, {}, host, port}
+                            : from_asio(addr, port),
+                         protocol);
+    info("proxy {}:{} added to the chain", host, port);
+  }
+
+  if (!upstreams.empty()) {
+    asio::co_spawn(io_context,
+                   monitor_upstreams(server, chrono::seconds(5),
+                                     chrono::seconds(2)),
+                   asio::detached);
+  }
+
   bool has_process = false;
-  auto report_injected = [&has_process](DWORD pid) {
+  auto report_injected = [&has_process](std::uint32_t pid) {
     info("{}: injected", pid);
     has_process = true;
   };
@@ -177,6 +415,7 @@ int main(int argc, char *argv[]) {
     }
   }
 
+#ifdef _WIN32
   for (const auto &name : proc_names) {
     injector::pid_by_name_wildcard(name,
                                    [&server, &report_injected](DWORD pid) {
@@ -210,14 +449,23 @@ int main(int argc, char *argv[]) {
       }
     });
   }
+#endif
 
   for (const auto &file : create_paths) {
+#ifdef _WIN32
     DWORD creation_flags = parser.get<bool>("-w") ? CREATE_NEW_CONSOLE : 0;
     if (auto res = create_process(file, creation_flags)) {
       if (server.inject(res->dwProcessId)) {
         report_injected(res->dwProcessId);
       }
     }
+#else
+    if (auto pid = injector::launch(file, server.port_)) {
+      report_injected(*pid);
+    } else {
+      info("{} cannot be started with {}", file, injector::injectee_filename);
+    }
+#endif
   }
 
   if (!has_process) {
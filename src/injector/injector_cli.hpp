@@ -16,6 +16,7 @@
 #ifndef PROXINJECT_INJECTOR_INJECTOR_CLI
 #define PROXINJECT_INJECTOR_INJECTOR_CLI
 
+#include "relay.hpp"
 #include "server.hpp"
 #include <spdlog/fmt/ostr.h>
 #include <spdlog/spdlog.h>
@@ -34,6 +35,33 @@ struct injectee_session_cli : injectee_session {
     co_return;
   }
 
+  asio::awaitable<void> process_timing(const InjecteeTiming &msg) override {
+    auto result = msg["success"_f].value_or(false) ? "succeeded"
+                  : msg["timed_out"_f].value_or(false) ? "timed out"
+                                                       : "failed";
+    std::string phases;
+    if (auto v = msg["connect_us"_f])
+      phases = fmt::format("{}us connecting", *v);
+    if (auto v = msg["handshake_us"_f])
+      phases += fmt::format("{}{}us handshaking", phases.empty() ? "" : " and ",
+                            *v);
+    for (std::size_t i = 0; i < msg["hop_us"_f].size(); ++i)
+      phases += fmt::format("{}hop {} {}us", i ? ", " : " (",
+                            i + 1, msg["hop_us"_f][i]);
+    if (!msg["hop_us"_f].empty())
+      phases += ")";
+
+    info("{}: {} {} after {}", (int)pid_, *msg["syscall"_f], result, phases);
+    co_return;
+  }
+
+  asio::awaitable<void> process_overflow(std::uint64_t dropped,
+                                         std::uint64_t aggregated) override {
+    info("{}: event queue overflowed, {} dropped, {} aggregated", (int)pid_,
+         dropped, aggregated);
+    co_return;
+  }
+
   asio::awaitable<void> process_pid() override {
     info("{}: established injectee connection", (int)pid_);
     co_return;
@@ -49,6 +77,128 @@ struct injectee_session_cli : injectee_session {
   }
 };
 
+// logs the flows of each core of `relay` every `interval` while they change
+asio::awaitable<void>
+report_relay(const socks5_relay &relay,
+             std::chrono::steady_clock::duration interval) {
+  asio::steady_timer timer(co_await asio::this_coro::executor);
+  std::vector<std::uint64_t> last(relay.cores());
+
+  while (true) {
+    timer.expires_after(interval);
+    co_await timer.async_wait(asio::use_awaitable);
+
+    for (std::size_t i = 0; i < relay.cores(); ++i) {
+      const auto &stats = relay.stats(i);
+      auto sent = stats.sent.load(), received = stats.received.load();
+      if (sent + received != last[i]) {
+        info("relay core {}: {} connections ({} active, {} failed), {} bytes "
+             "sent, {} bytes received",
+             i, stats.accepted.load(), stats.active.load(),
+             stats.failed.load(), sent, received);
+        last[i] = sent + received;
+      }
+    }
+  }
+}
+
+std::optional<overflow_policy>
+parse_overflow_policy(const std::string &policy) {
+  if (policy == "drop-newest") {
+    return overflow_policy::drop_newest;
+  } else if (policy == "drop-oldest") {
+    return overflow_policy::drop_oldest;
+  } else if (policy == "aggregate") {
+    return overflow_policy::aggregate;
+  }
+
+  return std::nullopt;
+}
+
+std::optional<route_action> parse_route_action(const std::string &action) {
+  if (action == "proxy") {
+    return route_action::proxy;
+  } else if (action == "direct") {
+    return route_action::direct;
+  } else if (action == "block") {
+    return route_action::block;
+  }
+
+  return std::nullopt;
+}
+
+// parses `<address>/<prefix>[,<port>[-<port>]]=<direct|proxy|block>`
+std::optional<RouteRule> parse_route(const std::string &route) {
+  auto assign = route.find_last_of('=');
+  auto slash = route.find_first_of('/');
+  if (assign == std::string::npos || slash == std::string::npos ||
+      slash > assign) {
+    return std::nullopt;
+  }
+
+  RouteRule rule;
+
+  if (auto action = parse_route_action(route.substr(assign + 1))) {
+    rule["action"_f] = (std::uint32_t)*action;
+  } else {
+    return std::nullopt;
+  }
+
+  asio::error_code ec;
+  auto addr = ip::make_address(route.substr(0, slash), ec);
+  if (ec) {
+    return std::nullopt;
+  }
+
+  auto rest = route.substr(slash + 1, assign - slash - 1);
+  auto comma = rest.find_first_of(',');
+  auto prefix = rest.substr(0, comma);
+  if (prefix.empty() || prefix.size() > 3 || !all_of_digit(prefix) ||
+      std::stoul(prefix) > (addr.is_v4() ? 32 : 128)) {
+    return std::nullopt;
+  }
+  rule["prefix"_f] = std::stoul(prefix);
+
+  if (addr.is_v4()) {
+    auto bytes = addr.to_v4().to_bytes();
+    rule["network"_f] = std::vector<unsigned char>{bytes.begin(), bytes.end()};
+  } else {
+    auto bytes = addr.to_v6().to_bytes();
+    rule["network"_f] = std::vector<unsigned char>{bytes.begin(), bytes.end()};
+  }
+
+  if (comma != std::string::npos) {
+    auto ports = rest.substr(comma + 1);
+    auto dash = ports.find_first_of('-');
+    auto min = ports.substr(0, dash);
+    auto max = dash == std::string::npos ? min : ports.substr(dash + 1);
+    if (min.empty() || max.empty() || !all_of_digit(min) ||
+        !all_of_digit(max) || min.size() > 5 || max.size() > 5 ||
+        std::stoul(min) > std::stoul(max) || std::stoul(max) > 65535) {
+      return std::nullopt;
+    }
+
+    rule["port_min"_f] = std::stoul(min);
+    rule["port_max"_f] = std::stoul(max);
+  }
+
+  return rule;
+}
+
+// parses `<pattern>=<direct|proxy|block>`
+std::optional<DomainRule> parse_domain_route(const std::string &route) {
+  auto assign = route.find_last_of('=');
+  if (assign == std::string::npos || assign == 0) {
+    return std::nullopt;
+  }
+
+  if (auto action = parse_route_action(route.substr(assign + 1))) {
+    return DomainRule{route.substr(0, assign), (std::uint32_t)*action};
+  }
+
+  return std::nullopt;
+}
+
 std::optional<std::pair<std::string, uint16_t>>
 parse_address(const std::string &addr) {
   auto delimiter = addr.find_last_of(':');
@@ -57,9 +207,36 @@ parse_address(const std::string &addr) {
   }
 
   auto host = addr.substr(0, delimiter);
-  uint16_t port = std::stoul(addr.substr(delimiter + 1));
+  auto port_str = addr.substr(delimiter + 1);
+  if (port_str.empty() || port_str.size() > 5 ||
+      port_str.find_first_not_of("0123456789") != std::string::npos ||
+      std::stoul(port_str) > 65535) {
+    return std::nullopt;
+  }
+  uint16_t port = std::stoul(port_str);
 
   return make_pair(host, port);
 }
 
+// a proxy address, optionally prefixed by `socks5://` (the default) or by
+// `http://` for an HTTP CONNECT proxy
+std::optional<std::tuple<std::string, uint16_t, proxy_protocol>>
+parse_proxy(const std::string &addr) {
+  auto protocol = proxy_protocol::socks5;
+  auto rest = addr;
+  if (auto scheme = addr.find("://"); scheme != std::string::npos) {
+    if (auto name = addr.substr(0, scheme); name == "http") {
+      protocol = proxy_protocol::http;
+    } else if (name != "socks5") {
+      return std::nullopt;
+    }
+    rest = addr.substr(scheme + 3);
+  }
+
+  if (auto res = parse_address(rest)) {
+    return std::make_tuple(res->first, res->second, protocol);
+  }
+  return std::nullopt;
+}
+
 #endif
@@ -50,7 +50,7 @@ struct injectee_session_ui : injectee_session {
   ce::dynamic_list_s &list_;
   ce::selectable_text_box &log_;
 
-  asio::awaitable<void> process_connect(const InjecteeConnect &msg) override {
+  void append_log(const std::string &text) {
     auto curr_time = std::chrono::system_clock::now();
     auto curr_sec = std::chrono::system_clock::to_time_t(curr_time);
     auto curr_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
@@ -62,16 +62,53 @@ struct injectee_session_ui : injectee_session {
            << std::put_time(std::localtime(&curr_sec), "%Y-%m-%d %H:%M:%S")
            << "." << std::setfill('0') << std::setw(3) << curr_milli_part
            << "] ";
-    stream << (int)pid_ << ": " << *msg["syscall"_f] << " " << *msg["addr"_f];
-    if (auto v = msg["proxy"_f])
-      stream << " via " << *v;
-    stream << "\n";
+    stream << (int)pid_ << ": " << text << "\n";
 
     view_.post([&log = log_, str = stream.str()] {
       log.set_text(log.get_text() + str);
     });
     view_.refresh();
+  }
+
+  asio::awaitable<void> process_connect(const InjecteeConnect &msg) override {
+    std::stringstream stream;
+    stream << *msg["syscall"_f] << " " << *msg["addr"_f];
+    if (auto v = msg["proxy"_f])
+      stream << " via " << *v;
+
+    append_log(stream.str());
+    co_return;
+  }
+
+  asio::awaitable<void> process_timing(const InjecteeTiming &msg) override {
+    std::stringstream stream;
+    stream << *msg["syscall"_f] << " "
+           << (msg["success"_f].value_or(false)     ? "succeeded"
+               : msg["timed_out"_f].value_or(false) ? "timed out"
+                                                    : "failed")
+           << " after";
+    if (auto v = msg["connect_us"_f])
+      stream << " " << *v << "us connecting";
+    if (auto v = msg["handshake_us"_f])
+      stream << (msg["connect_us"_f] ? " and " : " ") << *v
+             << "us handshaking";
+    for (std::size_t i = 0; i < msg["hop_us"_f].size(); ++i)
+      stream << (i ? ", " : " (") << "hop " << i + 1 << " "
+             << msg["hop_us"_f][i] << "us";
+    if (!msg["hop_us"_f].empty())
+      stream << ")";
+
+    append_log(stream.str());
+    co_return;
+  }
+
+  asio::awaitable<void> process_overflow(std::uint64_t dropped,
+                                         std::uint64_t aggregated) override {
+    std::stringstream stream;
+    stream << "event queue overflowed, " << dropped << " dropped, "
+           << aggregated << " aggregated";
 
+    append_log(stream.str());
     co_return;
   }
 
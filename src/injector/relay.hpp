@@ -0,0 +1,585 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef PROXINJECT_INJECTOR_RELAY
+#define PROXINJECT_INJECTOR_RELAY
+
+#include "mux_link.hpp"
+#include "proxy_client.hpp"
+#include "server.hpp"
+#include <algorithm>
+#include <array>
+#include <asio/experimental/awaitable_operators.hpp>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <random>
+#include <span>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// totals over the connections served by one core of the relay, which only
+// that core writes to; aligned so that cores do not share cache lines
+struct alignas(64) relay_stats {
+  std::atomic<std::uint64_t> accepted = 0;
+  std::atomic<std::uint64_t> failed = 0;
+  std::atomic<std::uint64_t> active = 0;
+  // from injectees to upstreams and back
+  std::atomic<std::uint64_t> sent = 0;
+  std::atomic<std::uint64_t> received = 0;
+};
+
+constexpr std::size_t relay_chunk_size = 256 * 1024;
+
+// half-closes `to` once `from` has reached EOF, so that the other direction
+// carries on, and tears down both after an error
+inline void relay_end(tcp::socket &from, tcp::socket &to, bool eof) {
+  asio::error_code ec;
+  if (eof) {
+    to.shutdown(tcp::socket::shutdown_send, ec);
+  } else {
+    from.shutdown(tcp::socket::shutdown_both, ec);
+    to.shutdown(tcp::socket::shutdown_both, ec);
+  }
+}
+
+// forwards `from` to `to` through a buffer in user space
+inline asio::awaitable<void> relay_copy(tcp::socket &from, tcp::socket &to,
+                                        std::atomic<std::uint64_t> &counter) {
+  auto buf = std::make_unique<char[]>(relay_chunk_size);
+
+  bool eof = false;
+  try {
+    while (true) {
+      auto n = co_await from.async_read_some(
+          asio::buffer(buf.get(), relay_chunk_size), asio::use_awaitable);
+      co_await asio::async_write(to, asio::buffer(buf.get(), n),
+                                 asio::use_awaitable);
+      counter.fetch_add(n, std::memory_order_relaxed);
+    }
+  } catch (asio::system_error &e) {
+    eof = e.code() == asio::error::eof;
+  }
+
+  relay_end(from, to, eof);
+}
+
+#ifdef __linux__
+// forwards `from` to `to` through a pipe with splice, so that the payload
+// never enters user space; falls back to copying if no pipe can be made
+inline asio::awaitable<void> relay_pump(tcp::socket &from, tcp::socket &to,
+                                        std::atomic<std::uint64_t> &counter) {
+  int pipe[2];
+  if (pipe2(pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+    co_await relay_copy(from, to, counter);
+    co_return;
+  }
+  fcntl(pipe[1], F_SETPIPE_SZ, (int)relay_chunk_size);
+
+  from.native_non_blocking(true);
+  to.native_non_blocking(true);
+
+  constexpr auto flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+  bool eof = false, error = false;
+  try {
+    while (!eof && !error) {
+      auto n = splice(from.native_handle(), nullptr, pipe[1], nullptr,
+                      relay_chunk_size, flags);
+      if (n < 0) {
+        if (errno == EAGAIN) {
+          co_await from.async_wait(tcp::socket::wait_read,
+                                   asio::use_awaitable);
+        } else if (errno != EINTR) {
+          error = true;
+        }
+        continue;
+      }
+      eof = n == 0;
+
+      // the pipe is drained before the next read, so it never fills up
+      while (n > 0 && !error) {
+        auto m = splice(pipe[0], nullptr, to.native_handle(), nullptr, n,
+                        flags);
+        if (m > 0) {
+          n -= m;
+          counter.fetch_add(m, std::memory_order_relaxed);
+        } else if (m < 0 && errno == EAGAIN) {
+          co_await to.async_wait(tcp::socket::wait_write,
+                                 asio::use_awaitable);
+        } else if (m == 0 || errno != EINTR) {
+          error = true;
+        }
+      }
+    }
+  } catch (asio::system_error &) {
+    error = true;
+  }
+
+  close(pipe[0]);
+  close(pipe[1]);
+  relay_end(from, to, eof && !error);
+}
+#else
+inline asio::awaitable<void> relay_pump(tcp::socket &from, tcp::socket &to,
+                                        std::atomic<std::uint64_t> &counter) {
+  return relay_copy(from, to, counter);
+}
+#endif
+
+// the links of one core of the relay to a mux server, opened as they are
+// needed and replaced once broken; a new stream goes to the link carrying
+// the fewest, or waits for one being connected if there is none yet
+class mux_pool {
+  IpAddr server_;
+  std::size_t size_;
+  std::vector<std::shared_ptr<mux_link>> links_;
+  std::size_t connecting_ = 0;
+  // cancelled whenever a connect attempt ends, to wake up waiting streams
+  asio::steady_timer settled_;
+
+  asio::awaitable<std::shared_ptr<mux_link>> connect() {
+    auto executor = co_await asio::this_coro::executor;
+    auto [host, port] = to_asio(server_);
+
+    tcp::resolver resolver(executor);
+    auto endpoints = co_await resolver.async_resolve(
+        host, std::to_string(port), asio::use_awaitable);
+
+    tcp::socket socket(executor);
+    co_await asio::async_connect(socket, endpoints, asio::use_awaitable);
+    socket.set_option(tcp::no_delay(true));
+
+    auto link = std::make_shared<mux_link>(std::move(socket));
+    link->start();
+    co_return link;
+  }
+
+public:
+  mux_pool(asio::io_context &ctx, const IpAddr &server, std::size_t size)
+      : server_(server), size_(std::max<std::size_t>(size, 1)), settled_(ctx) {
+    settled_.expires_at(std::chrono::steady_clock::time_point::max());
+  }
+
+  mux_pool(const mux_pool &) = delete;
+
+  ~mux_pool() {
+    for (auto &link : links_) {
+      link->close();
+    }
+  }
+
+  asio::awaitable<std::shared_ptr<mux_link>> get() {
+    while (true) {
+      std::erase_if(links_, [](const auto &link) { return link->closed(); });
+
+      if (links_.size() + connecting_ < size_) {
+        ++connecting_;
+        std::shared_ptr<mux_link> link;
+        try {
+          link = co_await connect();
+        } catch (...) {
+          --connecting_;
+          settled_.cancel();
+          throw;
+        }
+        --connecting_;
+        settled_.cancel();
+
+        links_.push_back(link);
+        co_return link;
+      }
+
+      if (!links_.empty()) {
+        co_return *std::min_element(links_.begin(), links_.end(),
+                                    [](const auto &l, const auto &r) {
+                                      return l->streams() < r->streams();
+                                    });
+      }
+
+      // every link there may be is still connecting
+      asio::error_code ec;
+      co_await settled_.async_wait(
+          asio::redirect_error(asio::use_awaitable, ec));
+    }
+  }
+};
+
+// a SOCKS5 server on loopback for injectees, forwarding each CONNECT to one
+// of the upstreams of `server` by their weights, so that upstream choice and
+// accounting happen in one place
+//
+// connections are sharded over one io_context and thread per core; nothing
+// on the path of a connection is shared with other cores but the atomically
+// published list of upstreams
+//
+// with a mux server set, connections go there as streams over a few links
+// per core instead, saving a connection and a SOCKS5 handshake to a remote
+// proxy for each of them
+class socks5_relay {
+  struct core {
+    asio::io_context io_context{1};
+    relay_stats stats;
+    std::unique_ptr<mux_pool> mux;
+    std::thread thread;
+  };
+
+  injector_server &server_;
+  std::vector<std::unique_ptr<core>> cores_;
+
+  using request_buffer = std::array<char, SOCKS_REQUEST_MAX_SIZE>;
+
+  // reads the greeting and the request of a client, answering the former;
+  // returns the size of the request in `buf`, 0 if it is not a valid one
+  static asio::awaitable<std::size_t> accept_request(tcp::socket &s,
+                                                     request_buffer &buf) {
+    co_await asio::async_read(s, asio::buffer(buf.data(), 2),
+                              asio::use_awaitable);
+    if (buf[0] != SOCKS_VERSION) {
+      co_return 0;
+    }
+
+    auto methods = (std::size_t)(unsigned char)buf[1];
+    co_await asio::async_read(s, asio::buffer(buf.data(), methods),
+                              asio::use_awaitable);
+    auto end = buf.begin() + methods;
+    bool acceptable =
+        std::find(buf.begin(), end, SOCKS_NO_AUTHENTICATION) != end;
+
+    const char method[] = {SOCKS_VERSION,
+                           acceptable ? SOCKS_NO_AUTHENTICATION : (char)0xff};
+    co_await asio::async_write(s, asio::buffer(method), asio::use_awaitable);
+    if (!acceptable) {
+      co_return 0;
+    }
+
+    // VER CMD RSV ATYP and the first byte of the address
+    co_await asio::async_read(s, asio::buffer(buf.data(), 5),
+                              asio::use_awaitable);
+    if (buf[0] != SOCKS_VERSION) {
+      co_return 0;
+    }
+
+    std::size_t size = 0;
+    switch (buf[3]) {
+    case SOCKS_IPV4:
+      size = 4 + 4 + 2;
+      break;
+    case SOCKS_IPV6:
+      size = 4 + 16 + 2;
+      break;
+    case SOCKS_DOMAINNAME:
+      size = 4 + 1 + (unsigned char)buf[4] + 2;
+      break;
+    default:
+      co_return 0;
+    }
+
+    co_await asio::async_read(s, asio::buffer(buf.data() + 5, size - 5),
+                              asio::use_awaitable);
+    co_return size;
+  }
+
+  static asio::awaitable<void> reply(tcp::socket &s, char code,
+                                     std::span<const char> bound = {}) {
+    const char unspecified[] = {SOCKS_IPV4, 0, 0, 0, 0, 0, 0};
+    if (bound.empty()) {
+      bound = unspecified;
+    }
+
+    std::array<char, 3 + SOCKS_REPLY_MAX_SIZE> buf{SOCKS_VERSION, code, 0};
+    std::copy(bound.begin(), bound.end(), buf.begin() + 3);
+    co_await asio::async_write(s, asio::buffer(buf.data(), 3 + bound.size()),
+                               asio::use_awaitable);
+  }
+
+  // connects `s` to the proxy at `addr` and runs the handshake of `client`
+  static asio::awaitable<bool> open_upstream(tcp::socket &s,
+                                             const IpAddr &addr,
+                                             proxy_client &client) {
+    auto [host, port] = to_asio(addr);
+    tcp::resolver resolver(s.get_executor());
+    auto endpoints = co_await resolver.async_resolve(
+        host, std::to_string(port), asio::use_awaitable);
+    co_await asio::async_connect(s, endpoints, asio::use_awaitable);
+    s.set_option(tcp::no_delay(true));
+
+    while (client.want_write() || client.want_read()) {
+      if (client.want_write()) {
+        auto out = client.output();
+        client.sent(co_await asio::async_write(
+            s, asio::buffer(out.data(), out.size()), asio::use_awaitable));
+      } else if (client.peek()) {
+        // what the handshake used of peeked bytes is taken off the socket
+        auto in = client.input();
+        auto used = client.received(co_await s.async_receive(
+            asio::buffer(in.data(), in.size()), tcp::socket::message_peek,
+            asio::use_awaitable));
+        co_await asio::async_read(s, asio::buffer(in.data(), used),
+                                  asio::use_awaitable);
+      } else {
+        auto in = client.input();
+        client.received(co_await s.async_read_some(
+            asio::buffer(in.data(), in.size()), asio::use_awaitable));
+      }
+    }
+
+    co_return client.done();
+  }
+
+  // an upstream drawn in proportion to the weights
+  static std::optional<Upstream> pick(const std::vector<Upstream> &upstreams) {
+    std::vector<double> weights;
+    for (const auto &u : upstreams) {
+      weights.push_back(u["weight"_f].value_or(1));
+    }
+    if (std::all_of(weights.begin(), weights.end(),
+                    [](double w) { return w == 0; })) {
+      std::fill(weights.begin(), weights.end(), 1);
+    }
+    if (weights.empty()) {
+      return std::nullopt;
+    }
+
+    thread_local std::minstd_rand engine(std::random_device{}());
+    std::discrete_distribution<std::size_t> dist(weights.begin(),
+                                                 weights.end());
+    return upstreams[dist(engine)];
+  }
+
+  // returns whether the connection has been established
+  asio::awaitable<bool> forward_socks5(tcp::socket &client,
+                                       std::span<const char> request,
+                                       relay_stats &stats) {
+    using namespace asio::experimental::awaitable_operators;
+
+    auto proxy = pick(*server_.get_weighted_upstreams());
+    if (!proxy || !(*proxy)["addr"_f]) {
+      co_await reply(client, SOCKS_GENERAL_FAILURE);
+      co_return false;
+    }
+
+    const auto &addr = *(*proxy)["addr"_f];
+    tcp::socket upstream(client.get_executor());
+    // HTTP upstreams have no bound address, so the client is told none
+    proxy_client handshake(
+        request, (proxy_protocol)(*proxy)["protocol"_f].value_or(0));
+    asio::steady_timer timer(client.get_executor(), handshake_timeout);
+
+    auto res = co_await (open_upstream(upstream, addr, handshake) ||
+                         timer.async_wait(asio::use_awaitable));
+    if (res.index() != 0 || !std::get<0>(res)) {
+      co_await reply(client, handshake.failed() ? handshake.reply()
+                                                : SOCKS_GENERAL_FAILURE);
+      co_return false;
+    }
+
+    co_await reply(client, SOCKS_SUCCESS, handshake.bound());
+    co_await (relay_pump(client, upstream, stats.sent) &&
+              relay_pump(upstream, client, stats.received));
+    co_return true;
+  }
+
+  asio::awaitable<bool> forward_mux(tcp::socket &client,
+                                    std::span<const char> request, core &c) {
+    using namespace asio::experimental::awaitable_operators;
+
+    std::shared_ptr<mux_link> link;
+    try {
+      link = co_await c.mux->get();
+    } catch (std::exception &) {
+    }
+    if (!link) {
+      co_await reply(client, SOCKS_GENERAL_FAILURE);
+      co_return false;
+    }
+
+    // OPEN carries the destination as in the request, ATYP ADDR PORT
+    auto stream = link->open(request.subspan(3));
+
+    try {
+      asio::steady_timer timer(client.get_executor(), handshake_timeout);
+      co_await (stream->replied() || timer.async_wait(asio::use_awaitable));
+
+      auto answer = stream->reply();
+      if (answer.empty() || answer[0] != SOCKS_SUCCESS) {
+        stream->reset();
+        co_await reply(client,
+                       answer.empty() ? SOCKS_GENERAL_FAILURE : answer[0]);
+        co_return false;
+      }
+
+      co_await reply(client, SOCKS_SUCCESS, answer.subspan(1));
+      co_await (mux_pump(client, *stream, c.stats.sent) &&
+                mux_pump(*stream, client, c.stats.received));
+    } catch (...) {
+      stream->reset();
+      throw;
+    }
+    co_return true;
+  }
+
+  asio::awaitable<void> session(tcp::socket client, core &c) {
+    auto &stats = c.stats;
+    stats.accepted.fetch_add(1, std::memory_order_relaxed);
+    stats.active.fetch_add(1, std::memory_order_relaxed);
+
+    bool established = false;
+    try {
+      client.set_option(tcp::no_delay(true));
+
+      request_buffer req;
+      auto size = co_await accept_request(client, req);
+      std::span<const char> request(req.data(), size);
+
+      if (size && req[1] != SOCKS_CONNECT) {
+        co_await reply(client, SOCKS_COMMAND_NOT_SUPPORTED);
+      } else if (size && c.mux) {
+        established = co_await forward_mux(client, request, c);
+      } else if (size) {
+        established = co_await forward_socks5(client, request, stats);
+      }
+    } catch (std::exception &) {
+    }
+
+    if (!established) {
+      stats.failed.fetch_add(1, std::memory_order_relaxed);
+    }
+    stats.active.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  // every core accepts on a listener of its own, bound to the same port
+  asio::awaitable<void> listen(tcp::acceptor acceptor, core &c) {
+    for (;;) {
+      asio::error_code ec;
+      auto client = co_await acceptor.async_accept(
+          asio::redirect_error(asio::use_awaitable, ec));
+      if (ec) {
+        if (!co_await accept_failed(acceptor, ec)) {
+          co_return;
+        }
+        continue;
+      }
+
+      asio::co_spawn(c.io_context, session(std::move(client), c),
+                     asio::detached);
+    }
+  }
+
+  // the one listener hands connections to the cores in turn
+  asio::awaitable<void> dispatch(tcp::acceptor acceptor) {
+    for (std::size_t next = 0;; ++next) {
+      auto &c = *cores_[next % cores_.size()];
+      asio::error_code ec;
+      auto client = co_await acceptor.async_accept(
+          c.io_context, asio::redirect_error(asio::use_awaitable, ec));
+      if (ec) {
+        if (!co_await accept_failed(acceptor, ec)) {
+          co_return;
+        }
+        continue;
+      }
+
+      asio::co_spawn(c.io_context, session(std::move(client), c),
+                     asio::detached);
+    }
+  }
+
+public:
+  static constexpr auto handshake_timeout = std::chrono::seconds(30);
+
+  explicit socks5_relay(injector_server &server,
+                        std::size_t cores = std::thread::hardware_concurrency())
+      : server_(server) {
+    for (std::size_t i = 0; i < std::max<std::size_t>(cores, 1); ++i) {
+      cores_.push_back(std::make_unique<core>());
+    }
+  }
+
+  socks5_relay(const socks5_relay &) = delete;
+
+  ~socks5_relay() {
+    for (auto &c : cores_) {
+      c->io_context.stop();
+    }
+    for (auto &c : cores_) {
+      if (c->thread.joinable()) {
+        c->thread.join();
+      }
+    }
+  }
+
+  std::size_t cores() const { return cores_.size(); }
+
+  // sends connections to the mux server at `server` over `links` links per
+  // core instead of to the upstreams; to be called before `start`
+  void use_mux(const IpAddr &server, std::size_t links) {
+    for (auto &c : cores_) {
+      c->mux = std::make_unique<mux_pool>(c->io_context, server, links);
+    }
+  }
+
+  const relay_stats &stats(std::size_t core) const {
+    return cores_[core]->stats;
+  }
+
+  // listens on `endpoint` and starts the threads of all cores, returns the
+  // port listened on
+  std::uint16_t start(const tcp::endpoint &endpoint) {
+    auto port = endpoint.port();
+
+#ifdef SO_REUSEPORT
+    using reuse_port = asio::detail::socket_option::boolean<SOL_SOCKET,
+                                                            SO_REUSEPORT>;
+
+    // the kernel balances incoming connections over the listeners
+    for (auto &c : cores_) {
+      tcp::acceptor acceptor(c->io_context, endpoint.protocol());
+      acceptor.set_option(reuse_port(true));
+      acceptor.bind(tcp::endpoint(endpoint.address(), port));
+      acceptor.listen();
+      port = acceptor.local_endpoint().port();
+
+      asio::co_spawn(c->io_context, listen(std::move(acceptor), *c),
+                     asio::detached);
+    }
+#else
+    tcp::acceptor first(cores_.front()->io_context, endpoint.protocol());
+    first.bind(endpoint);
+    first.listen();
+    port = first.local_endpoint().port();
+
+    asio::co_spawn(cores_.front()->io_context, dispatch(std::move(first)),
+                   asio::detached);
+#endif
+
+    for (auto &c : cores_) {
+      c->thread = std::thread([&io_context = c->io_context] {
+        auto work = asio::make_work_guard(io_context);
+        io_context.run();
+      });
+    }
+
+    return port;
+  }
+};
+
+#endif
@@ -0,0 +1,150 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef PROXINJECT_INJECTOR_RESOLVER
+#define PROXINJECT_INJECTOR_RESOLVER
+
+#include "async_io.hpp"
+#include "schema.hpp"
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// name lookups shared by all injectees, so that a name resolved for one
+// process is answered from memory for the others; concurrent lookups of a
+// name wait for the first one instead of querying again
+//
+// getaddrinfo does not report the TTL of records, so answers are kept for a
+// fixed time, shorter for failed lookups
+class resolver_cache {
+  using clock = std::chrono::steady_clock;
+
+  static constexpr std::size_t shard_count = 16;
+  static constexpr std::size_t shard_capacity = 4096;
+
+  struct entry {
+    std::vector<IpAddr> addrs;
+    clock::time_point expires;
+  };
+
+  // a lookup in flight, whose timer fires once `addrs` is set
+  struct lookup {
+    asio::steady_timer done;
+    std::vector<IpAddr> addrs;
+
+    explicit lookup(asio::any_io_executor executor)
+        : done(executor, clock::time_point::max()) {}
+  };
+
+  struct shard {
+    std::mutex mtx;
+    std::unordered_map<std::string, entry> entries;
+    std::unordered_map<std::string, std::shared_ptr<lookup>> lookups;
+  };
+
+  std::array<shard, shard_count> shards_;
+  clock::duration ttl_;
+  clock::duration negative_ttl_;
+
+  shard &shard_of(const std::string &name) {
+    return shards_[std::hash<std::string>{}(name) % shard_count];
+  }
+
+  // called with the lock of `s` held
+  void store(shard &s, const std::string &name, std::vector<IpAddr> addrs) {
+    auto now = clock::now();
+    if (s.entries.size() >= shard_capacity) {
+      std::erase_if(s.entries,
+                    [now](const auto &e) { return e.second.expires <= now; });
+    }
+    if (s.entries.size() >= shard_capacity) {
+      s.entries.erase(s.entries.begin());
+    }
+
+    auto expires = now + (addrs.empty() ? negative_ttl_ : ttl_);
+    s.entries.insert_or_assign(name, entry{std::move(addrs), expires});
+  }
+
+public:
+  explicit resolver_cache(
+      clock::duration ttl = std::chrono::seconds(60),
+      clock::duration negative_ttl = std::chrono::seconds(5))
+      : ttl_(ttl), negative_ttl_(negative_ttl) {}
+
+  // the addresses of `name` (with port 0), empty if it cannot be resolved
+  asio::awaitable<std::vector<IpAddr>> resolve(std::string name) {
+    std::transform(name.begin(), name.end(), name.begin(),
+                   [](unsigned char c) { return (char)std::tolower(c); });
+
+    auto executor = co_await asio::this_coro::executor;
+    auto &s = shard_of(name);
+
+    std::shared_ptr<lookup> pending;
+    bool first = false;
+    {
+      std::lock_guard guard(s.mtx);
+      if (auto iter = s.entries.find(name);
+          iter != s.entries.end() && iter->second.expires > clock::now()) {
+        co_return iter->second.addrs;
+      }
+
+      auto &slot = s.lookups[name];
+      if (!slot) {
+        slot = std::make_shared<lookup>(executor);
+        first = true;
+      }
+      pending = slot;
+    }
+
+    if (!first) {
+      asio::error_code ec;
+      co_await pending->done.async_wait(
+          asio::redirect_error(asio::use_awaitable, ec));
+      co_return pending->addrs;
+    }
+
+    std::vector<IpAddr> addrs;
+    try {
+      tcp::resolver resolver(executor);
+      auto results =
+          co_await resolver.async_resolve(name, "", asio::use_awaitable);
+      for (const auto &r : results) {
+        addrs.push_back(from_asio(r.endpoint().address(), 0));
+      }
+    } catch (std::exception &) {
+    }
+
+    {
+      std::lock_guard guard(s.mtx);
+      store(s, name, addrs);
+      s.lookups.erase(name);
+    }
+
+    // a timer set to the past also completes waits started from now on
+    pending->addrs = addrs;
+    pending->done.expires_at(clock::time_point::min());
+
+    co_return addrs;
+  }
+};
+
+#endif
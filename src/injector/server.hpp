@@ -18,9 +18,13 @@
 
 #include "async_io.hpp"
 #include "injector.hpp"
+#include "queue.hpp"
+#include "resolver.hpp"
 #include "schema.hpp"
 #include <asio.hpp>
+#include <atomic>
 #include <map>
+#include <memory>
 
 using tcp = asio::ip::tcp;
 
@@ -35,15 +39,26 @@ struct injectee_client {
 using injectee_client_ptr = std::shared_ptr<injectee_client>;
 
 struct injector_server {
-  std::map<DWORD, injectee_client_ptr> clients;
+  std::map<std::uint32_t, injectee_client_ptr> clients;
   InjectorConfig config_;
   std::mutex config_mutex;
+  resolver_cache resolver;
 
   std::uint16_t port_ = -1;
+  // the loopback port of the local relay, 0 if injectees go to the upstreams
+  // themselves
+  std::uint16_t relay_port_ = 0;
+  // whether the relay reaches destinations without the upstreams, so that
+  // injectees are sent to it even if there are none
+  bool relay_standalone_ = false;
+  // the upstreams as the relay sees them, republished with every change of
+  // the config so that relay threads never take `config_mutex`
+  std::atomic<std::shared_ptr<const std::vector<Upstream>>>
+      weighted_upstreams_ = std::make_shared<const std::vector<Upstream>>();
 
   void set_port(std::uint16_t port) { port_ = port; }
 
-  bool inject(DWORD pid) {
+  bool inject(std::uint32_t pid) {
     if (port_ == -1) {
       return false;
     }
@@ -54,15 +69,42 @@ struct injector_server {
     }
   }
 
-  bool open(DWORD pid, injectee_client_ptr ptr) {
+  bool open(std::uint32_t pid, injectee_client_ptr ptr) {
     return clients.emplace(pid, ptr).second;
   }
 
+  // the config as injectees see it, which points them at the local relay
+  // instead of the upstreams while it is enabled (the relay then serves as
+  // the first hop of a chain); `config_mutex` is held
+  InjectorConfig published_config() const {
+    auto cfg = config_;
+    if (relay_port_ && (relay_standalone_ || cfg["addr"_f] ||
+                        !cfg["upstreams"_f].empty())) {
+      cfg["addr"_f] = from_asio(localhost, relay_port_);
+      cfg["protocol"_f] = std::nullopt;
+      cfg["upstreams"_f].clear();
+    }
+    return cfg;
+  }
+
+  // `config_mutex` is held
+  void publish_upstreams() {
+    auto res = config_["upstreams"_f];
+    if (res.empty() && config_["addr"_f]) {
+      res.push_back(Upstream{*config_["addr"_f], 1,
+                             config_["protocol"_f].value_or(0)});
+    }
+    weighted_upstreams_.store(
+        std::make_shared<const std::vector<Upstream>>(std::move(res)));
+  }
+
   void broadcast_config() {
+    publish_upstreams();
+
     for (const auto &[_, client] : clients) {
       asio::co_spawn(
           client->get_context(),
-          [cfg = config_, client] { return client->config(cfg); },
+          [cfg = published_config(), client] { return client->config(cfg); },
           asio::detached);
     }
   }
@@ -74,12 +116,75 @@ struct injector_server {
     broadcast_config();
   }
 
-  void set_proxy(const ip::address &addr, std::uint32_t port) {
-    config_proxy(from_asio(addr, port));
+  void set_proxy(const ip::address &addr, std::uint32_t port,
+                 proxy_protocol protocol = proxy_protocol::socks5) {
+    std::lock_guard guard(config_mutex);
+    config_["addr"_f] = from_asio(addr, port);
+    config_["protocol"_f] = (std::uint32_t)protocol;
+
+    broadcast_config();
   }
 
   void clear_proxy() { config_proxy(std::nullopt); }
 
+  void add_upstream(const ip::address &addr, std::uint32_t port,
+                    proxy_protocol protocol = proxy_protocol::socks5) {
+    std::lock_guard guard(config_mutex);
+    config_["upstreams"_f].push_back(
+        Upstream{from_asio(addr, port), 1, (std::uint32_t)protocol});
+
+    broadcast_config();
+  }
+
+  // connections go through `addr` next, after the proxies of the chain so
+  // far and whichever upstream they use
+  void add_chain_hop(const IpAddr &addr,
+                     proxy_protocol protocol = proxy_protocol::socks5) {
+    std::lock_guard guard(config_mutex);
+    config_["chain"_f].push_back(Upstream{addr, {}, (std::uint32_t)protocol});
+
+    broadcast_config();
+  }
+
+  void clear_chain() {
+    std::lock_guard guard(config_mutex);
+    config_["chain"_f].clear();
+
+    broadcast_config();
+  }
+
+  // the upstreams with their weights, `addr` alone counting as one
+  std::shared_ptr<const std::vector<Upstream>> get_weighted_upstreams() const {
+    return weighted_upstreams_.load();
+  }
+
+  std::vector<Upstream> get_upstreams() {
+    std::lock_guard guard(config_mutex);
+    return config_["upstreams"_f];
+  }
+
+  // only broadcast when a weight actually changes
+  void set_upstream_weights(const std::vector<std::uint32_t> &weights) {
+    std::lock_guard guard(config_mutex);
+
+    auto &upstreams = config_["upstreams"_f];
+    if (upstreams.size() != weights.size()) {
+      return;
+    }
+
+    bool changed = false;
+    for (std::size_t i = 0; i < weights.size(); ++i) {
+      if (upstreams[i]["weight"_f].value_or(1) != weights[i]) {
+        upstreams[i]["weight"_f] = weights[i];
+        changed = true;
+      }
+    }
+
+    if (changed) {
+      broadcast_config();
+    }
+  }
+
   void enable_log(bool enable = true) {
     std::lock_guard guard(config_mutex);
     config_["log"_f] = enable;
@@ -98,12 +203,107 @@ struct injector_server {
 
   void disable_subprocess() { enable_subprocess(false); }
 
+  void enable_pipeline(bool enable = true) {
+    std::lock_guard guard(config_mutex);
+    config_["pipeline"_f] = enable;
+
+    broadcast_config();
+  }
+
+  void disable_pipeline() { enable_pipeline(false); }
+
+  void enable_fake_dns(bool enable = true) {
+    std::lock_guard guard(config_mutex);
+    config_["fake_dns"_f] = enable;
+
+    broadcast_config();
+  }
+
+  void disable_fake_dns() { enable_fake_dns(false); }
+
+  // injectees send their name lookups to `resolver`
+  void enable_shared_resolver(bool enable = true) {
+    std::lock_guard guard(config_mutex);
+    config_["shared_resolver"_f] = enable;
+
+    broadcast_config();
+  }
+
+  void disable_shared_resolver() { enable_shared_resolver(false); }
+
+  void enable_udp_relay(bool enable = true) {
+    std::lock_guard guard(config_mutex);
+    config_["udp_relay"_f] = enable;
+
+    broadcast_config();
+  }
+
+  void disable_udp_relay() { enable_udp_relay(false); }
+
+  void add_route(const RouteRule &rule) {
+    std::lock_guard guard(config_mutex);
+    config_["routes"_f].push_back(rule);
+
+    broadcast_config();
+  }
+
+  void clear_routes() {
+    std::lock_guard guard(config_mutex);
+    config_["routes"_f].clear();
+
+    broadcast_config();
+  }
+
+  void add_domain_route(const DomainRule &rule) {
+    std::lock_guard guard(config_mutex);
+    config_["domains"_f].push_back(rule);
+
+    broadcast_config();
+  }
+
+  void clear_domain_routes() {
+    std::lock_guard guard(config_mutex);
+    config_["domains"_f].clear();
+
+    broadcast_config();
+  }
+
+  // in milliseconds, for proxied connects whose caller gives no timeout
+  void set_connect_timeout(std::uint32_t timeout) {
+    std::lock_guard guard(config_mutex);
+    config_["connect_timeout"_f] = timeout;
+
+    broadcast_config();
+  }
+
+  // injectees are sent to the local relay listening on `port`, which
+  // forwards to the upstreams, or elsewhere if it is `standalone`
+  void enable_relay(std::uint16_t port, bool standalone = false) {
+    std::lock_guard guard(config_mutex);
+    relay_port_ = port;
+    relay_standalone_ = standalone;
+
+    broadcast_config();
+  }
+
+  void set_overflow_policy(overflow_policy policy) {
+    std::lock_guard guard(config_mutex);
+    config_["overflow"_f] = (std::uint32_t)policy;
+
+    broadcast_config();
+  }
+
   InjectorConfig get_config() {
     std::lock_guard guard(config_mutex);
     return config_;
   }
 
-  bool remove(DWORD pid) {
+  InjectorConfig get_published_config() {
+    std::lock_guard guard(config_mutex);
+    return published_config();
+  }
+
+  bool remove(std::uint32_t pid) {
     if (auto iter = clients.find(pid); iter != clients.end()) {
       clients.erase(iter);
       return true;
@@ -112,7 +312,7 @@ struct injector_server {
     return false;
   }
 
-  bool close(DWORD pid) {
+  bool close(std::uint32_t pid) {
     if (auto iter = clients.find(pid); iter != clients.end()) {
       iter->second->stop();
       return true;
@@ -125,13 +325,15 @@ struct injector_server {
 struct injectee_session : injectee_client,
                           std::enable_shared_from_this<injectee_session> {
   tcp::socket socket_;
+  framed_reader<tcp::socket> input_;
+  framed_writer<tcp::socket> output_;
   asio::steady_timer timer_;
   injector_server &server_;
-  DWORD pid_;
+  std::uint32_t pid_;
 
   injectee_session(tcp::socket socket, injector_server &server)
-      : socket_(std::move(socket)), timer_(socket_.get_executor()),
-        server_(server), pid_(0) {
+      : socket_(std::move(socket)), input_(socket_), output_(socket_),
+        timer_(socket_.get_executor()), server_(server), pid_(0) {
     timer_.expires_at(std::chrono::steady_clock::time_point::max());
   }
 
@@ -144,14 +346,15 @@ struct injectee_session : injectee_client,
   asio::any_io_executor get_context() { return socket_.get_executor(); }
 
   asio::awaitable<void> config(const InjectorConfig &cfg) {
-    co_await async_write_message(
-        socket_, create_message<InjectorMessage, "config">(cfg));
+    output_.push(create_message<InjectorMessage, "config">(cfg),
+                 shared_from_this());
+    co_return;
   }
 
   asio::awaitable<void> reader() {
     try {
       while (true) {
-        auto msg = co_await async_read_message<InjecteeMessage>(socket_);
+        auto msg = co_await input_.read<InjecteeMessage>();
         asio::co_spawn(
             socket_.get_executor(),
             [self = shared_from_this(), msg = std::move(msg)] {
@@ -168,23 +371,46 @@ struct injectee_session : injectee_client,
   virtual asio::awaitable<void> process_connect(const InjecteeConnect &msg) {
     co_return;
   }
+  virtual asio::awaitable<void> process_timing(const InjecteeTiming &msg) {
+    co_return;
+  }
   virtual asio::awaitable<void> process_subpid(std::uint16_t pid, bool result) {
     co_return;
   }
+  virtual asio::awaitable<void> process_overflow(std::uint64_t dropped,
+                                                 std::uint64_t aggregated) {
+    co_return;
+  }
   virtual void process_close() {}
 
   asio::awaitable<void> process(const InjecteeMessage &msg) {
     if (auto v = compare_message<"pid">(msg)) {
       pid_ = *v;
       server_.open(pid_, shared_from_this());
-      auto config_ = server_.get_config();
+      auto config_ = server_.get_published_config();
       if (config_["subprocess"_f] && *config_["subprocess"_f]) {
-        enumerate_child_pids(pid_, [this](DWORD pid) { server_.inject(pid); });
+        enumerate_child_pids(pid_, [this](auto pid) { server_.inject(pid); });
       }
       co_await config(config_);
       co_await process_pid();
     } else if (auto v = compare_message<"connect">(msg)) {
       co_await process_connect(*v);
+    } else if (auto v = compare_message<"connects">(msg)) {
+      for (const auto &connect : (*v)["connects"_f]) {
+        co_await process_connect(connect);
+      }
+    } else if (auto v = compare_message<"resolve">(msg)) {
+      InjectorResolved res;
+      res["id"_f] = (*v)["id"_f].value_or(0);
+      res["addrs"_f] =
+          co_await server_.resolver.resolve((*v)["name"_f].value_or(""));
+      output_.push(create_message<InjectorMessage, "resolved">(res),
+                   shared_from_this());
+    } else if (auto v = compare_message<"timing">(msg)) {
+      co_await process_timing(*v);
+    } else if (auto v = compare_message<"overflow">(msg)) {
+      co_await process_overflow((*v)["dropped"_f].value_or(0),
+                                (*v)["aggregated"_f].value_or(0));
     } else if (auto v = compare_message<"subpid">(msg)) {
       co_await process_subpid(*v, server_.inject(*v));
     }
@@ -0,0 +1,162 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef PROXINJECT_INJECTOR_UPSTREAM_MONITOR
+#define PROXINJECT_INJECTOR_UPSTREAM_MONITOR
+
+#include "server.hpp"
+#include <algorithm>
+#include <asio/experimental/awaitable_operators.hpp>
+#include <chrono>
+#include <cmath>
+#include <optional>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+// exponentially weighted health of an upstream, from periodic probes
+struct upstream_health {
+  static constexpr double alpha = 0.3;
+
+  double latency = 0; // of a SOCKS5 greeting, in microseconds
+  double failure = 0; // rate of failed probes
+  bool measured = false;
+
+  void update(std::optional<std::chrono::microseconds> sample) {
+    if (sample) {
+      auto v = (double)std::max<std::int64_t>(sample->count(), 1);
+      latency = measured ? (1 - alpha) * latency + alpha * v : v;
+      failure = (1 - alpha) * failure;
+      measured = true;
+    } else {
+      failure = (1 - alpha) * failure + alpha;
+    }
+  }
+
+  // higher is better, 0 for an upstream that should not be used
+  double score() const {
+    if (!measured || failure >= 0.5) {
+      return 0;
+    }
+    return 1 / (latency * (1 + 4 * failure));
+  }
+};
+
+// weights in a small range, so that jitter does not cause a broadcast of the
+// config on every round of probes
+inline std::vector<std::uint32_t>
+upstream_weights(const std::vector<upstream_health> &health) {
+  constexpr std::uint32_t levels = 16;
+
+  double best = 0;
+  for (const auto &h : health) {
+    best = std::max(best, h.score());
+  }
+
+  std::vector<std::uint32_t> res;
+  for (const auto &h : health) {
+    auto score = h.score();
+    res.push_back(score > 0 ? std::clamp((std::uint32_t)std::lround(
+                                             levels * score / best),
+                                         1u, levels)
+                            : 0);
+  }
+  return res;
+}
+
+// connects to `addr` and exchanges a SOCKS5 greeting (or, for an HTTP
+// proxy, a request answered by the proxy itself with any status), returning
+// the time it took or nullopt on failure or timeout
+inline asio::awaitable<std::optional<std::chrono::microseconds>>
+probe_upstream(const IpAddr &addr, proxy_protocol protocol,
+               std::chrono::steady_clock::duration timeout) {
+  using namespace asio::experimental::awaitable_operators;
+
+  auto executor = co_await asio::this_coro::executor;
+  auto [host, port] = to_asio(addr);
+
+  tcp::socket socket(executor);
+  asio::steady_timer timer(executor, timeout);
+
+  auto exchange = [&]() -> asio::awaitable<bool> {
+    tcp::resolver resolver(executor);
+    auto endpoints = co_await resolver.async_resolve(
+        host, std::to_string(port), asio::use_awaitable);
+    co_await asio::async_connect(socket, endpoints, asio::use_awaitable);
+
+    if (protocol == proxy_protocol::http) {
+      const char request[] = "OPTIONS * HTTP/1.1\r\nHost: proxinject\r\n"
+                             "Connection: close\r\n\r\n";
+      co_await asio::async_write(socket,
+                                 asio::buffer(request, sizeof(request) - 1),
+                                 asio::use_awaitable);
+
+      char status[7];
+      co_await asio::async_read(socket, asio::buffer(status),
+                                asio::use_awaitable);
+      co_return std::string_view(status, 7) == "HTTP/1.";
+    }
+
+    const char greeting[] = {5, 1, 0};
+    co_await asio::async_write(socket, asio::buffer(greeting),
+                               asio::use_awaitable);
+
+    char reply[2];
+    co_await asio::async_read(socket, asio::buffer(reply),
+                              asio::use_awaitable);
+    co_return reply[0] == 5 && reply[1] == 0;
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  try {
+    auto res = co_await (exchange() || timer.async_wait(asio::use_awaitable));
+    if (res.index() == 0 && std::get<0>(res)) {
+      co_return std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - start);
+    }
+  } catch (std::exception &) {
+  }
+
+  co_return std::nullopt;
+}
+
+// probes the upstreams of `server` every `interval` and pushes weights derived
+// from their latency and failure rate to the injectees
+inline asio::awaitable<void>
+monitor_upstreams(injector_server &server,
+                  std::chrono::steady_clock::duration interval,
+                  std::chrono::steady_clock::duration timeout) {
+  asio::steady_timer timer(co_await asio::this_coro::executor);
+  std::vector<upstream_health> health;
+
+  while (true) {
+    auto upstreams = server.get_upstreams();
+    health.resize(upstreams.size());
+
+    for (std::size_t i = 0; i < upstreams.size(); ++i) {
+      health[i].update(co_await probe_upstream(
+          upstreams[i]["addr"_f].value_or(IpAddr{}),
+          (proxy_protocol)upstreams[i]["protocol"_f].value_or(0), timeout));
+    }
+
+    server.set_upstream_weights(upstream_weights(health));
+
+    timer.expires_after(interval);
+    co_await timer.async_wait(asio::use_awaitable);
+  }
+}
+
+#endif
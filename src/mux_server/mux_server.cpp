@@ -0,0 +1,187 @@
+// Copyright 2022 PragmaTwice
+//
+// Licensed under the Apache License,
+// Version 2.0(the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "mux_link.hpp"
+#include "socks5_client.hpp"
+#include <asio.hpp>
+#include <asio/experimental/awaitable_operators.hpp>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <optional>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+// the reference server of the mux protocol (see mux.hpp): accepts links from
+// the local relays of injectors and connects their streams to the
+// destinations, one io_context and thread per core
+
+using namespace std;
+
+constexpr auto connect_timeout = chrono::seconds(30);
+
+struct totals {
+  atomic<uint64_t> uploaded = 0;
+  atomic<uint64_t> downloaded = 0;
+};
+
+// the host and port of ATYP ADDR PORT
+optional<pair<string, uint16_t>> decode_target(span<const char> target) {
+  auto port = [&target](size_t at) {
+    return (uint16_t)((unsigned char)target[at] << 8 |
+                      (unsigned char)target[at + 1]);
+  };
+
+  if (target.size() == 1 + 4 + 2 && target[0] == SOCKS_IPV4) {
+    ip::address_v4::bytes_type addr;
+    copy_n(target.begin() + 1, 4, addr.begin());
+    return make_pair(ip::address_v4(addr).to_string(), port(1 + 4));
+  } else if (target.size() == 1 + 16 + 2 && target[0] == SOCKS_IPV6) {
+    ip::address_v6::bytes_type addr;
+    copy_n(target.begin() + 1, 16, addr.begin());
+    return make_pair(ip::address_v6(addr).to_string(), port(1 + 16));
+  } else if (target.size() >= 2 && target[0] == SOCKS_DOMAINNAME &&
+             target.size() == (size_t)(2 + (unsigned char)target[1] + 2)) {
+    return make_pair(string(target.begin() + 2, target.end() - 2),
+                     port(target.size() - 2));
+  }
+
+  return nullopt;
+}
+
+asio::awaitable<void> serve(shared_ptr<mux_stream> stream, vector<char> target,
+                            totals &total) {
+  using namespace asio::experimental::awaitable_operators;
+
+  auto executor = co_await asio::this_coro::executor;
+  tcp::socket socket(executor);
+
+  bool connected = false;
+  try {
+    if (auto v = decode_target(target)) {
+      tcp::resolver resolver(executor);
+      asio::steady_timer timer(executor, connect_timeout);
+
+      auto endpoints = co_await resolver.async_resolve(
+          v->first, to_string(v->second), asio::use_awaitable);
+      auto res = co_await (
+          asio::async_connect(socket, endpoints, asio::use_awaitable) ||
+          timer.async_wait(asio::use_awaitable));
+      connected = res.index() == 0;
+    }
+  } catch (exception &) {
+  }
+
+  if (!connected) {
+    stream->answer(SOCKS_GENERAL_FAILURE, {});
+    co_return;
+  }
+
+  asio::error_code ec;
+  socket.set_option(tcp::no_delay(true), ec);
+  auto local = socket.local_endpoint(ec);
+  if (ec) {
+    stream->answer(SOCKS_GENERAL_FAILURE, {});
+    co_return;
+  }
+
+  char bound[SOCKS_REQUEST_MAX_SIZE];
+  auto size = socks5_encode_request(bound, (const sockaddr *)local.data());
+  stream->answer(SOCKS_SUCCESS, {bound + 3, size - 3});
+
+  co_await (mux_pump(socket, *stream, total.uploaded) &&
+            mux_pump(*stream, socket, total.downloaded));
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 3) {
+    cerr << "usage: " << argv[0] << " [address (default 127.0.0.1)] <port>"
+         << endl;
+    return 1;
+  }
+
+  // links are not authenticated, so anything beyond loopback has to be asked
+  // for explicitly
+  asio::error_code ec;
+  auto address = argc == 3 ? ip::make_address(argv[1], ec)
+                           : ip::address(ip::address_v4::loopback());
+  char *end = nullptr;
+  auto port = strtoul(argv[argc - 1], &end, 10);
+  if (ec || *end || port == 0 || port > 0xffff) {
+    cerr << "invalid address or port" << endl;
+    return 1;
+  }
+
+  vector<unique_ptr<asio::io_context>> contexts;
+  for (size_t i = 0; i < max(thread::hardware_concurrency(), 1u); ++i) {
+    contexts.push_back(make_unique<asio::io_context>(1));
+  }
+
+  totals total;
+  tcp::acceptor acceptor(*contexts.front(),
+                         tcp::endpoint(address, (uint16_t)port));
+  cout << "listening on " << acceptor.local_endpoint() << " with "
+       << contexts.size() << " threads" << endl;
+  if (!address.is_loopback()) {
+    cerr << "warning: links are not authenticated, anyone reaching "
+         << acceptor.local_endpoint() << " can open connections through it"
+         << endl;
+  }
+
+  // every link stays on the core it has been accepted onto; a failed accept
+  // does not stop the ones after it
+  asio::co_spawn(
+      *contexts.front(),
+      [&]() -> asio::awaitable<void> {
+        for (size_t next = 0;; ++next) {
+          auto &context = *contexts[next % contexts.size()];
+          asio::error_code ec;
+          auto socket = co_await acceptor.async_accept(
+              context, asio::redirect_error(asio::use_awaitable, ec));
+          if (ec) {
+            if (!co_await accept_failed(acceptor, ec)) {
+              co_return;
+            }
+            continue;
+          }
+          socket.set_option(tcp::no_delay(true), ec);
+
+          make_shared<mux_link>(
+              move(socket),
+              [&total](shared_ptr<mux_stream> stream, vector<char> target) {
+                auto executor = stream->get_executor();
+                asio::co_spawn(executor,
+                               serve(move(stream), move(target), total),
+                               asio::detached);
+              })
+              ->start();
+        }
+      },
+      asio::detached);
+
+  vector<thread> threads;
+  for (auto &context : contexts) {
+    threads.emplace_back([&context] {
+      auto work = asio::make_work_guard(*context);
+      context->run();
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+}